@@ -1,8 +1,9 @@
 #include "BiDiB.h"
 #include "crc8.h"
+#include "escape.h"
 #include <string.h>
 
-BiDiB::BiDiB() : _messageAvailable(false), _isLoggedIn(false), _system_enabled(true) {
+BiDiB::BiDiB() : _isLoggedIn(false), _system_enabled(true) {
     // Initialize unique_id with a default placeholder value.
     // IMPORTANT: The user should set a truly unique ID in their setup() function.
     unique_id[0] = 0x80; unique_id[1] = 0x01; unique_id[2] = 0x02;
@@ -12,13 +13,25 @@ BiDiB::BiDiB() : _messageAvailable(false), _isLoggedIn(false), _system_enabled(t
     // Copy the unique ID to the local node representation.
     for (int i=0; i<7; ++i) { _local_node.unique_id[i] = unique_id[i]; }
 
+    // Flow control is opt-in; the node table starts without requests in flight.
+    _flowHeldCount = 0;
+    _flowInFlight = 0;
+    _flowTimeouts = 0;
+    _flowControl = false;
+    _sequencing = false;
+    _rxLost = 0;
+    _rxDuplicates = 0;
+    _requestCount = 0;
+    _requestTimeout = BIDIB_REQUEST_TIMEOUT;
+
     // The host itself is always considered the first node in the table.
-    _node_table[0] = _local_node;
+    resetNodeTable();
 
     node_table_version = 0;
-    _node_count = 1; // Start with 1 node (the host itself)
     _feature_count = 0;
     _next_feature_index = 0;
+    memset(_featureMask, 0, sizeof(_featureMask));
+    memset(_featureRank, 0, sizeof(_featureRank));
 
     // Initialize default features as per BiDiB specification.
     setFeature(BIDIB_FEATURE_FW_UPDATE_SUPPORT, 1);
@@ -26,21 +39,70 @@ BiDiB::BiDiB() : _messageAvailable(false), _isLoggedIn(false), _system_enabled(t
     setFeature(BIDIB_FEATURE_MSG_RECEIVE_COUNT, 4);
 
     _track_state = BIDIB_CS_STATE_OFF;
-    _driveAckCallback = nullptr;
-    _accessoryAckCallback = nullptr;
-    _pomAckCallback = nullptr;
-    _boosterStatusCallback = nullptr;
-    _boosterDiagnosticCallback = nullptr;
-    _occupancyCallback = nullptr;
-    _occupancyMultipleCallback = nullptr;
-    _addressCallback = nullptr;
-    _accessoryStateCallback = nullptr;
-    _firmwareUpdateStatusCallback = nullptr;
+
+    // No application message handlers are installed initially.
+    _messageHandlerCount = 0;
+    memset(_messageHandlerMask, 0, sizeof(_messageHandlerMask));
 
     // Initialize the pending Secure-ACKs list.
-    for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) {
-        _pendingSecureAcks[i].active = false;
+    _pendingSecureAckCount = 0;
+#if BIDIB_SECACK_DETECTOR_INDEX
+    memset(_secureAckSingleSlot, 0, sizeof(_secureAckSingleSlot));
+    memset(_secureAckRangeSlot, 0, sizeof(_secureAckRangeSlot));
+#endif
+    _secureAckArenaUsed = 0;
+    resetSecureAckRtt();
+
+    // All detectors start free, and that is what the master assumes as well.
+    memset(_occupancyState, 0, sizeof(_occupancyState));
+    memset(_occupancyReported, 0, sizeof(_occupancyReported));
+    _occupancyDirty = false;
+    _debounceEnabled = false;
+    _debounceLastTick = 0;
+
+    // Initialize the transmit buffer and queue; TX batching and queueing are opt-in.
+    _txLength = 0;
+    _txClass = BIDIB_TX_PRIORITY_BULK;
+    _txSequenced = false;
+    _txBatching = false;
+    for (uint8_t i = 0; i < BIDIB_TX_PRIORITIES; i++) {
+        _txQueueHead[i] = 0;
+        _txQueueFill[i] = 0;
     }
+    _txQueueCount = 0;
+    _txPacketLeft = 0;
+    _txPacketClass = BIDIB_TX_PRIORITY_SYSTEM;
+    _txBulkSkips = 0;
+    _txQueueHighWater = 0;
+    _txDropCount = 0;
+    _txQueueing = false;
+
+    // The drive scheduler is opt-in as well.
+    _driveSlotCount = 0;
+    _drivePending = 0;
+    _driveCursor = 0;
+    _driveScheduling = false;
+    _driveRate = BIDIB_DRIVE_RATE;
+    _driveBurst = BIDIB_DRIVE_BURST;
+    _driveTokens = 0;
+    _driveLastRefill = 0;
+    _driveCoalesced = 0;
+
+    // Initialize the receive queue and parser.
+    bidib_serial = nullptr;
+    _rxQueueHead = 0;
+    _rxQueueCount = 0;
+    _rxOverflowCount = 0;
+    _rxTarget = nullptr;
+    _rxState = RX_WAIT_MAGIC;
+    _rxPending = 0;
+    _rxDropped = 0;
+    _rxLastByte = 0;
+    _rxLength = 0;
+    _rxCrc = 0;
+    _rxIndex = 0;
+    _rxDataLength = 0;
+    _rxEscaped = false;
 }
 
 // =============================================================================
@@ -48,6 +110,121 @@ BiDiB::BiDiB() : _messageAvailable(false), _isLoggedIn(false), _system_enabled(t
 // =============================================================================
 
 void BiDiB::drive(uint16_t address, int8_t speed, uint8_t functions) {
+    if (!_driveScheduling) {
+        sendDrive(address, speed, functions);
+        return;
+    }
+
+    // Find the slot of this locomotive, or one that is free or idle.
+    int slot = -1;
+    int idle = -1;
+    for (uint8_t i = 0; i < _driveSlotCount; ++i) {
+        if (_driveSlots[i].address == address) { slot = i; break; }
+        if (idle < 0 && !_driveSlots[i].pending) { idle = i; }
+    }
+
+    // An emergency stop must not wait behind anything, and an older command for the loco is stale now.
+    if ((speed & 0x7F) == 1) {
+        if (slot >= 0 && _driveSlots[slot].pending) {
+            _driveSlots[slot].pending = false;
+            _drivePending--;
+        }
+        sendDrive(address, speed, functions);
+        return;
+    }
+
+    if (slot >= 0 && _driveSlots[slot].pending) {
+        // Latest wins: the waiting command is replaced and keeps its place in the round-robin.
+        _driveSlots[slot].speed = speed;
+        _driveSlots[slot].functions = functions;
+        _driveCoalesced++;
+        return;
+    }
+
+    refillDriveTokens(millis());
+    if (_drivePending == 0 && _driveTokens >= 1000) {
+        // Nothing is waiting and the budget allows it: no reason to delay.
+        _driveTokens -= 1000;
+        sendDrive(address, speed, functions);
+        return;
+    }
+
+    if (slot < 0) {
+        if (_driveSlotCount < BIDIB_DRIVE_SLOTS) {
+            slot = _driveSlotCount++;
+        } else if (idle >= 0) {
+            slot = idle;
+        } else {
+            // Every slot is waiting for another loco; sending beats losing the command.
+            sendDrive(address, speed, functions);
+            return;
+        }
+        _driveSlots[slot].address = address;
+    }
+    _driveSlots[slot].speed = speed;
+    _driveSlots[slot].functions = functions;
+    _driveSlots[slot].pending = true;
+    _drivePending++;
+}
+
+void BiDiB::setDriveScheduling(bool enabled) {
+    if (!enabled) {
+        // Nothing that was accepted gets lost.
+        for (uint8_t i = 0; i < _driveSlotCount; ++i) {
+            if (_driveSlots[i].pending) {
+                sendDrive(_driveSlots[i].address, _driveSlots[i].speed, _driveSlots[i].functions);
+            }
+        }
+    } else if (!_driveScheduling) {
+        _driveTokens = (uint32_t)_driveBurst * 1000;
+        _driveLastRefill = millis();
+        _driveCoalesced = 0;
+    }
+    _driveSlotCount = 0;
+    _drivePending = 0;
+    _driveCursor = 0;
+    _driveScheduling = enabled;
+}
+
+void BiDiB::setDriveRate(uint16_t commandsPerSecond, uint8_t burst) {
+    _driveRate = commandsPerSecond;
+    _driveBurst = burst < 1 ? 1 : burst;
+    if (_driveTokens > (uint32_t)_driveBurst * 1000) { _driveTokens = (uint32_t)_driveBurst * 1000; }
+}
+
+uint8_t BiDiB::getDrivePendingCount() {
+    return _drivePending;
+}
+
+uint16_t BiDiB::getDriveCoalescedCount() {
+    return _driveCoalesced;
+}
+
+void BiDiB::refillDriveTokens(unsigned long now) {
+    // One command costs 1000 tokens, and rate commands per second earn rate tokens per millisecond.
+    unsigned long elapsed = now - _driveLastRefill;
+    _driveLastRefill = now;
+    if (_driveRate == 0) { return; }
+    uint32_t limit = (uint32_t)_driveBurst * 1000;
+    // Beyond limit / rate milliseconds the bucket is full anyway, and the product cannot overflow.
+    if (elapsed > limit / _driveRate) { elapsed = limit / _driveRate; }
+    uint32_t earned = (uint32_t)elapsed * _driveRate;
+    _driveTokens = _driveTokens + earned < limit ? _driveTokens + earned : limit;
+}
+
+void BiDiB::drainDriveSlots() {
+    while (_drivePending > 0 && _driveTokens >= 1000) {
+        DriveSlot &slot = _driveSlots[_driveCursor];
+        _driveCursor = _driveCursor + 1 < _driveSlotCount ? _driveCursor + 1 : 0;
+        if (!slot.pending) { continue; }
+        slot.pending = false;
+        _drivePending--;
+        _driveTokens -= 1000;
+        sendDrive(slot.address, slot.speed, slot.functions);
+    }
+}
+
+void BiDiB::sendDrive(uint16_t address, int8_t speed, uint8_t functions) {
     BiDiBMessage msg;
     msg.length = 8;
     msg.address[0] = 0; // Broadcast to command station
@@ -62,7 +239,11 @@ void BiDiB::drive(uint16_t address, int8_t speed, uint8_t functions) {
 }
 
 void BiDiB::onDriveAck(DriveAckCallback callback) {
-    _driveAckCallback = callback;
+    _driveAckEvent.set(callback);
+}
+
+bool BiDiB::onDriveAck(DriveAckEvent::Listener listener, void *context) {
+    return _driveAckEvent.add(listener, context);
 }
 
 void BiDiB::accessory(uint16_t address, uint8_t output, uint8_t state) {
@@ -79,7 +260,11 @@ void BiDiB::accessory(uint16_t address, uint8_t output, uint8_t state) {
 }
 
 void BiDiB::onAccessoryAck(AccessoryAckCallback callback) {
-    _accessoryAckCallback = callback;
+    _accessoryAckEvent.set(callback);
+}
+
+bool BiDiB::onAccessoryAck(AccessoryAckEvent::Listener listener, void *context) {
+    return _accessoryAckEvent.add(listener, context);
 }
 
 void BiDiB::pomWriteByte(uint16_t address, uint16_t cv, uint8_t value) {
@@ -102,7 +287,11 @@ void BiDiB::pomWriteByte(uint16_t address, uint16_t cv, uint8_t value) {
 }
 
 void BiDiB::onPomAck(PomAckCallback callback) {
-    _pomAckCallback = callback;
+    _pomAckEvent.set(callback);
+}
+
+bool BiDiB::onPomAck(PomAckEvent::Listener listener, void *context) {
+    return _pomAckEvent.add(listener, context);
 }
 
 void BiDiB::setTrackState(uint8_t state) {
@@ -130,21 +319,33 @@ void BiDiB::setBoosterState(bool on, uint8_t node_addr) {
 }
 
 void BiDiB::queryBooster(uint8_t node_addr) {
+    queryBooster(node_addr, nullptr);
+}
+
+bool BiDiB::queryBooster(uint8_t node_addr, RequestCallback callback, void *context) {
     BiDiBMessage msg;
     msg.address[0] = node_addr;
     msg.address[1] = 0;
     msg.length = (node_addr == 0) ? 3 : 4;
     msg.msg_num = 0;
     msg.msg_type = MSG_BOOST_QUERY;
-    sendMessage(msg);
+    return sendRequest(msg, MSG_BOOST_STAT, callback, context);
 }
 
 void BiDiB::onBoosterStatus(BoosterStatusCallback callback) {
-    _boosterStatusCallback = callback;
+    _boosterStatusEvent.set(callback);
+}
+
+bool BiDiB::onBoosterStatus(BoosterStatusEvent::Listener listener, void *context) {
+    return _boosterStatusEvent.add(listener, context);
 }
 
 void BiDiB::onBoosterDiagnostic(BoosterDiagnosticCallback callback) {
-    _boosterDiagnosticCallback = callback;
+    _boosterDiagnosticEvent.set(callback);
+}
+
+bool BiDiB::onBoosterDiagnostic(BoosterDiagnosticEvent::Listener listener, void *context) {
+    return _boosterDiagnosticEvent.add(listener, context);
 }
 
 // =============================================================================
@@ -172,10 +373,18 @@ void BiDiB::vendorDisable(uint8_t node_addr) {
 }
 
 void BiDiB::onVendorAck(VendorAckCallback callback) {
-    _vendorAckCallback = callback;
+    _vendorAckEvent.set(callback);
+}
+
+bool BiDiB::onVendorAck(VendorAckEvent::Listener listener, void *context) {
+    return _vendorAckEvent.add(listener, context);
 }
 
 void BiDiB::vendorGet(uint8_t node_addr, const char* name) {
+    vendorGet(node_addr, name, nullptr);
+}
+
+bool BiDiB::vendorGet(uint8_t node_addr, const char* name, RequestCallback callback, void *context) {
     BiDiBMessage msg;
     msg.address[0] = node_addr;
     msg.address[1] = 0;
@@ -183,7 +392,7 @@ void BiDiB::vendorGet(uint8_t node_addr, const char* name) {
     msg.msg_type = MSG_VENDOR_GET;
     strncpy((char*)msg.data, name, sizeof(msg.data));
     msg.length = 4 + strlen(name) + 1;
-    sendMessage(msg);
+    return sendRequest(msg, MSG_VENDOR, callback, context);
 }
 
 void BiDiB::vendorSet(uint8_t node_addr, const char* name, const char* value) {
@@ -203,7 +412,11 @@ void BiDiB::vendorSet(uint8_t node_addr, const char* name, const char* value) {
 }
 
 void BiDiB::onVendorData(VendorDataCallback callback) {
-    _vendorDataCallback = callback;
+    _vendorDataEvent.set(callback);
+}
+
+bool BiDiB::onVendorData(VendorDataEvent::Listener listener, void *context) {
+    return _vendorDataEvent.add(listener, context);
 }
 
 // =============================================================================
@@ -228,17 +441,18 @@ void BiDiB::firmwareUpdateOperation(uint8_t node_addr, uint8_t op, const uint8_t
 }
 
 void BiDiB::onFirmwareUpdateStatus(FirmwareUpdateStatusCallback callback) {
-    _firmwareUpdateStatusCallback = callback;
+    _firmwareUpdateStatusEvent.set(callback);
+}
+
+bool BiDiB::onFirmwareUpdateStatus(FirmwareUpdateStatusEvent::Listener listener, void *context) {
+    return _firmwareUpdateStatusEvent.add(listener, context);
 }
 
 void BiDiB::enterFirmwareUpdateMode(uint8_t node_addr) {
     // Entering update mode requires the node's unique ID for security.
     // We assume the node is in the local node table.
-    int node_index = -1;
-    // node_addr is the index in the node table
-    if (node_addr < _node_count) {
-        node_index = node_addr;
-    }
+    uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {node_addr};
+    int node_index = findNodeByAddress(address);
 
     if (node_index != -1) {
         firmwareUpdateOperation(node_addr, BIDIB_MSG_FW_UPDATE_OP_ENTER, _node_table[node_index].unique_id, 7);
@@ -277,17 +491,25 @@ void BiDiB::setAccessory(uint8_t accessoryNum, uint8_t aspect) {
 }
 
 void BiDiB::getAccessory(uint8_t accessoryNum) {
+    getAccessory(accessoryNum, nullptr);
+}
+
+bool BiDiB::getAccessory(uint8_t accessoryNum, RequestCallback callback, void *context) {
     BiDiBMessage msg;
     msg.length = 4;
     msg.address[0] = 0; // Address to the local node
     msg.msg_num = 0;
     msg.msg_type = MSG_ACCESSORY_GET;
     msg.data[0] = accessoryNum;
-    sendMessage(msg);
+    return sendRequest(msg, MSG_ACCESSORY_STATE, callback, context);
 }
 
 void BiDiB::onAccessoryState(AccessoryStateCallback callback) {
-    _accessoryStateCallback = callback;
+    _accessoryStateEvent.set(callback);
+}
+
+bool BiDiB::onAccessoryState(AccessoryStateEvent::Listener listener, void *context) {
+    return _accessoryStateEvent.add(listener, context);
 }
 
 // =============================================================================
@@ -295,23 +517,43 @@ void BiDiB::onAccessoryState(AccessoryStateCallback callback) {
 // =============================================================================
 
 void BiDiB::onOccupancy(OccupancyCallback callback) {
-    _occupancyCallback = callback;
+    _occupancyEvent.set(callback);
+}
+
+bool BiDiB::onOccupancy(OccupancyEvent::Listener listener, void *context) {
+    return _occupancyEvent.add(listener, context);
 }
 
 void BiDiB::onOccupancyMultiple(OccupancyMultipleCallback callback) {
-    _occupancyMultipleCallback = callback;
+    _occupancyMultipleEvent.set(callback);
+}
+
+bool BiDiB::onOccupancyMultiple(OccupancyMultipleEvent::Listener listener, void *context) {
+    return _occupancyMultipleEvent.add(listener, context);
 }
 
 void BiDiB::onAddress(AddressCallback callback) {
-    _addressCallback = callback;
+    _addressEvent.set(callback);
+}
+
+bool BiDiB::onAddress(AddressEvent::Listener listener, void *context) {
+    return _addressEvent.add(listener, context);
 }
 
 void BiDiB::onSpeedUpdate(SpeedCallback callback) {
-    _speedCallback = callback;
+    _speedEvent.set(callback);
+}
+
+bool BiDiB::onSpeedUpdate(SpeedEvent::Listener listener, void *context) {
+    return _speedEvent.add(listener, context);
 }
 
 void BiDiB::onCvUpdate(CvCallback callback) {
-    _cvCallback = callback;
+    _cvEvent.set(callback);
+}
+
+bool BiDiB::onCvUpdate(CvEvent::Listener listener, void *context) {
+    return _cvEvent.add(listener, context);
 }
 
 void BiDiB::sendOccupancySingle(uint8_t detectorNum, bool occupied) {
@@ -346,33 +588,269 @@ void BiDiB::sendOccupancyMultiple(uint8_t baseNum, uint8_t size, const uint8_t*
     }
 }
 
+void BiDiB::setOccupancy(uint8_t detectorNum, bool occupied) {
+#if BIDIB_OCCUPANCY_DETECTORS < 256
+    if (detectorNum >= BIDIB_OCCUPANCY_DETECTORS) { return; }
+#endif
+    uint8_t &bits = _occupancyState[detectorNum / 8];
+    uint8_t mask = (uint8_t)(1 << (detectorNum % 8));
+    uint8_t updated = occupied ? (bits | mask) : (bits & ~mask);
+    if (updated != bits) {
+        bits = updated;
+        _occupancyDirty = true;
+    }
+    if (_debounceEnabled) {
+        // A state set directly is also the settled input, so the next tick does not undo it.
+        uint8_t &input = _debounceInput[detectorNum / 8];
+        input = occupied ? (input | mask) : (input & ~mask);
+        for (uint8_t k = 0; k < BIDIB_DEBOUNCE_BITS; ++k) { _debounceCount[k][detectorNum / 8] &= ~mask; }
+    }
+}
+
+void BiDiB::setOccupancyBitmap(uint8_t baseNum, uint8_t size, const uint8_t* data) {
+    if (baseNum % 8 == 0) {
+        // Aligned ranges are copied byte by byte.
+        for (uint8_t i = 0; i < size && baseNum / 8 + i < BIDIB_OCCUPANCY_DETECTORS / 8; ++i) {
+            if (_occupancyState[baseNum / 8 + i] != data[i]) {
+                _occupancyState[baseNum / 8 + i] = data[i];
+                _occupancyDirty = true;
+            }
+            if (_debounceEnabled) {
+                _debounceInput[baseNum / 8 + i] = data[i];
+                for (uint8_t k = 0; k < BIDIB_DEBOUNCE_BITS; ++k) { _debounceCount[k][baseNum / 8 + i] = 0; }
+            }
+        }
+        return;
+    }
+    for (uint16_t bit = 0; bit < 8 * size && baseNum + bit < BIDIB_OCCUPANCY_DETECTORS; ++bit) {
+        setOccupancy(baseNum + bit, (data[bit / 8] >> (bit % 8)) & 1);
+    }
+}
+
+bool BiDiB::getOccupancy(uint8_t detectorNum) {
+#if BIDIB_OCCUPANCY_DETECTORS < 256
+    if (detectorNum >= BIDIB_OCCUPANCY_DETECTORS) { return false; }
+#endif
+    return (_occupancyState[detectorNum / 8] >> (detectorNum % 8)) & 1;
+}
+
+void BiDiB::setOccupancyDebounce(uint8_t detectorNum, uint8_t onTicks, uint8_t offTicks) {
+#if BIDIB_OCCUPANCY_DETECTORS < 256
+    if (detectorNum >= BIDIB_OCCUPANCY_DETECTORS) { return; }
+#endif
+    const uint8_t maxTicks = (1 << BIDIB_DEBOUNCE_BITS) - 1;
+    onTicks = onTicks < 1 ? 1 : (onTicks > maxTicks ? maxTicks : onTicks);
+    offTicks = offTicks < 1 ? 1 : (offTicks > maxTicks ? maxTicks : offTicks);
+    if (!_debounceEnabled) {
+        // Start from the current states; every other detector keeps a delay of one tick.
+        memcpy(_debounceInput, _occupancyState, sizeof(_debounceInput));
+        memset(_debounceCount, 0, sizeof(_debounceCount));
+        memset(_debounceOn, 0, sizeof(_debounceOn));
+        memset(_debounceOff, 0, sizeof(_debounceOff));
+        memset(_debounceOn[0], 0xFF, sizeof(_debounceOn[0]));
+        memset(_debounceOff[0], 0xFF, sizeof(_debounceOff[0]));
+        _debounceEnabled = true;
+    }
+    uint8_t byte = detectorNum / 8;
+    uint8_t mask = (uint8_t)(1 << (detectorNum % 8));
+    for (uint8_t k = 0; k < BIDIB_DEBOUNCE_BITS; ++k) {
+        _debounceOn[k][byte] = (onTicks >> k) & 1 ? (_debounceOn[k][byte] | mask) : (_debounceOn[k][byte] & ~mask);
+        _debounceOff[k][byte] = (offTicks >> k) & 1 ? (_debounceOff[k][byte] | mask) : (_debounceOff[k][byte] & ~mask);
+    }
+}
+
+void BiDiB::setOccupancyDebounce(uint8_t onTicks, uint8_t offTicks) {
+    for (uint16_t i = 0; i < BIDIB_OCCUPANCY_DETECTORS; ++i) {
+        setOccupancyDebounce(i, onTicks, offTicks);
+    }
+}
+
+void BiDiB::setOccupancyInput(uint8_t detectorNum, bool occupied) {
+    if (!_debounceEnabled) {
+        setOccupancy(detectorNum, occupied);
+        return;
+    }
+#if BIDIB_OCCUPANCY_DETECTORS < 256
+    if (detectorNum >= BIDIB_OCCUPANCY_DETECTORS) { return; }
+#endif
+    uint8_t mask = (uint8_t)(1 << (detectorNum % 8));
+    _debounceInput[detectorNum / 8] = occupied ? (_debounceInput[detectorNum / 8] | mask)
+                                               : (_debounceInput[detectorNum / 8] & ~mask);
+}
+
+void BiDiB::setOccupancyInputBitmap(uint8_t baseNum, uint8_t size, const uint8_t* data) {
+    if (!_debounceEnabled) {
+        setOccupancyBitmap(baseNum, size, data);
+        return;
+    }
+    if (baseNum % 8 == 0) {
+        for (uint8_t i = 0; i < size && baseNum / 8 + i < BIDIB_OCCUPANCY_DETECTORS / 8; ++i) {
+            _debounceInput[baseNum / 8 + i] = data[i];
+        }
+        return;
+    }
+    for (uint16_t bit = 0; bit < 8 * size && baseNum + bit < BIDIB_OCCUPANCY_DETECTORS; ++bit) {
+        setOccupancyInput(baseNum + bit, (data[bit / 8] >> (bit % 8)) & 1);
+    }
+}
+
+// Vertical counters: plane k holds bit k of the counters of all detectors in a word, so one
+// tick is a ripple-carry increment and an equality test done on whole words.
+template <typename W>
+void BiDiB::tickDebounceLane(uint8_t offset) {
+    W input, state;
+    memcpy(&input, &_debounceInput[offset], sizeof(W));
+    memcpy(&state, &_occupancyState[offset], sizeof(W));
+    W delta = input ^ state;   // Detectors whose input differs from the accepted state
+    W carry = delta;
+    W match = (W)~(W)0;        // Detectors whose counter reached their delay
+    W count[BIDIB_DEBOUNCE_BITS];
+    for (uint8_t k = 0; k < BIDIB_DEBOUNCE_BITS; ++k) {
+        W c, on, off;
+        memcpy(&c, &_debounceCount[k][offset], sizeof(W));
+        memcpy(&on, &_debounceOn[k][offset], sizeof(W));
+        memcpy(&off, &_debounceOff[k][offset], sizeof(W));
+        count[k] = (c ^ carry) & delta; // Count on where the input differs, restart where it agrees
+        carry &= c;
+        W delay = (input & on) | (~input & off);
+        match &= ~(count[k] ^ delay);
+    }
+    W accept = delta & match;
+    for (uint8_t k = 0; k < BIDIB_DEBOUNCE_BITS; ++k) {
+        count[k] &= ~accept;
+        memcpy(&_debounceCount[k][offset], &count[k], sizeof(W));
+    }
+    if (accept != 0) {
+        state ^= accept;
+        memcpy(&_occupancyState[offset], &state, sizeof(W));
+        _occupancyDirty = true;
+    }
+}
+
+void BiDiB::tickOccupancyDebounce() {
+    if (!_debounceEnabled) { return; }
+    const uint8_t bytes = BIDIB_OCCUPANCY_DETECTORS / 8;
+    uint8_t offset = 0;
+#if !defined(__AVR__)
+    for (; offset + sizeof(uint32_t) <= bytes; offset += sizeof(uint32_t)) {
+        tickDebounceLane<uint32_t>(offset);
+    }
+#endif
+    for (; offset < bytes; ++offset) {
+        tickDebounceLane<uint8_t>(offset);
+    }
+}
+
+void BiDiB::flushOccupancy() {
+    if (!_occupancyDirty) { return; }
+    _occupancyDirty = false;
+
+    // Bytes of the bitmap that changed since the last report.
+    const uint8_t bytes = BIDIB_OCCUPANCY_DETECTORS / 8;
+    uint8_t changed[bytes];
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < bytes; ++i) {
+        if (_occupancyState[i] != _occupancyReported[i]) { changed[count++] = i; }
+    }
+    if (count == 0) { return; }
+
+    // Message sizes without framing: MSG_BM_OCC/FREE is LENGTH ADDR NUM TYPE DETECTOR, a
+    // MSG_BM_MULTIPLE is LENGTH ADDR NUM TYPE BASE SIZE plus its bitmap.
+    const uint8_t singleCost = 5;
+    const uint8_t multipleCost = 6;
+    const uint8_t maxBitmap = BIDIB_MAX_DATA_LENGTH - 2;
+
+    // cost[k] is the cheapest way to report the first k changed bytes; the last group of that
+    // solution starts at changed byte start[k] and is a MSG_BM_MULTIPLE if start[k] != k - 1 or multiple[k].
+    uint16_t cost[bytes + 1];
+    uint8_t start[bytes + 1];
+    bool multiple[bytes + 1];
+    cost[0] = 0;
+    for (uint8_t k = 1; k <= count; ++k) {
+        uint8_t diff = _occupancyState[changed[k - 1]] ^ _occupancyReported[changed[k - 1]];
+        cost[k] = cost[k - 1] + singleCost * __builtin_popcount(diff);
+        start[k] = k - 1;
+        multiple[k] = false;
+        for (uint8_t j = k; j >= 1; --j) {
+            uint8_t span = changed[k - 1] - changed[j - 1] + 1;
+            if (span > maxBitmap) { break; }
+            uint16_t c = cost[j - 1] + multipleCost + span;
+            if (c < cost[k]) {
+                cost[k] = c;
+                start[k] = j - 1;
+                multiple[k] = true;
+            }
+        }
+    }
+
+    // Walk the solution back to front, then send its groups in ascending detector order.
+    uint8_t groupStart[bytes];
+    uint8_t groupEnd[bytes];
+    uint8_t groups = 0;
+    for (uint8_t k = count; k > 0; k = start[k]) {
+        groupStart[groups] = multiple[k] ? start[k] : 0xFF; // 0xFF marks single reports
+        groupEnd[groups] = k - 1;
+        groups++;
+    }
+    while (groups-- > 0) {
+        uint8_t last = changed[groupEnd[groups]];
+        if (groupStart[groups] != 0xFF) {
+            uint8_t first = changed[groupStart[groups]];
+            sendOccupancyMultiple(first * 8, last - first + 1, &_occupancyState[first]);
+        } else {
+            uint8_t diff = _occupancyState[last] ^ _occupancyReported[last];
+            for (uint8_t bit = 0; bit < 8; ++bit) {
+                if (diff & (1 << bit)) { sendOccupancySingle(last * 8 + bit, (_occupancyState[last] >> bit) & 1); }
+            }
+        }
+    }
+    memcpy(_occupancyReported, _occupancyState, bytes);
+}
+
 // =============================================================================
 // Feature Management
 // =============================================================================
 
+uint8_t BiDiB::featureIndex(uint8_t feature_num) const {
+    uint8_t byte = feature_num >> 3;
+    uint8_t below = _featureMask[byte] & (uint8_t)((1 << (feature_num & 7)) - 1);
+    return _featureRank[byte] + __builtin_popcount(below);
+}
+
+bool BiDiB::hasFeature(uint8_t feature_num) const {
+    return (_featureMask[feature_num >> 3] & (1 << (feature_num & 7))) != 0;
+}
+
+const BiDiBFeature *BiDiB::getFeatureAt(uint8_t index) const {
+    return index < _feature_count ? &_features[index] : nullptr;
+}
+
 void BiDiB::setFeature(uint8_t feature_num, uint8_t value) {
+    uint8_t index = featureIndex(feature_num);
     // First, check if the feature already exists and update it.
-    for (int i = 0; i < _feature_count; ++i) {
-        if (_features[i].feature_num == feature_num) {
-            _features[i].value = value;
-            return;
-        }
+    if (hasFeature(feature_num)) {
+        _features[index].value = value;
+        return;
+    }
+    // If not, insert it at its sorted position if there's space.
+    if (_feature_count >= BIDIB_MAX_FEATURES) {
+        return;
     }
-    // If not, add it as a new feature if there's space.
-    if (_feature_count < BIDIB_MAX_FEATURES) {
-        _features[_feature_count].feature_num = feature_num;
-        _features[_feature_count].value = value;
-        _feature_count++;
+    memmove(&_features[index + 1], &_features[index], (_feature_count - index) * sizeof(BiDiBFeature));
+    _features[index].feature_num = feature_num;
+    _features[index].value = value;
+    _feature_count++;
+    _featureMask[feature_num >> 3] |= (uint8_t)(1 << (feature_num & 7));
+    for (uint8_t i = (feature_num >> 3) + 1; i < sizeof(_featureRank); ++i) {
+        _featureRank[i]++;
     }
 }
 
 uint8_t BiDiB::getFeature(uint8_t feature_num) {
-    for (int i = 0; i < _feature_count; ++i) {
-        if (_features[i].feature_num == feature_num) {
-            return _features[i].value;
-        }
+    if (!hasFeature(feature_num)) {
+        return 0; // Return 0 if the feature is not found.
     }
-    return 0; // Return 0 if the feature is not found.
+    return _features[featureIndex(feature_num)].value;
 }
 
 // =============================================================================
@@ -416,11 +894,30 @@ bool BiDiB::isLoggedIn() {
 // =============================================================================
 
 void BiDiB::handleMessages() {
-    if (!messageAvailable()) { return; }
+    // Drain the messages that are queued right now. Each slot stays untouched until it
+    // has been processed, so the message can be used in place.
+    uint8_t count = _rxQueueCount;
+    while (count-- > 0) {
+        processMessage(_rxQueue[_rxQueueHead]);
+        releaseMessage();
+    }
+
+    // Send the replies of this pass together if TX batching is enabled.
+    flushTxBatch();
+}
+
+void BiDiB::processMessage(const BiDiBMessage &msg) {
+    // A message that arrived twice is handled once.
+    if (_sequencing && !checkRxSequence(msg)) { return; }
 
-    // Once we start handling, we consume the message.
-    _messageAvailable = false;
-    BiDiBMessage msg = _lastMessage;
+    // It may be the answer somebody is waiting for. That is settled before flow control sends
+    // held requests, since an answer cannot belong to a request that was not sent yet.
+    if (_requestCount > 0) { completeRequest(msg); }
+
+#if BIDIB_FLOW_CONTROL
+    // An answer frees a slot in the receive buffer of the node that sent it.
+    if (_flowControl) { returnFlowCredit(msg); }
+#endif
 
     // Handle system enable/disable immediately, regardless of the current state.
     if (msg.msg_type == MSG_SYS_ENABLE) {
@@ -434,416 +931,1296 @@ void BiDiB::handleMessages() {
     // If the system is disabled, ignore all other messages.
     if (!_system_enabled) { return; }
 
-    switch (msg.msg_type) {
-        // --- Basic System Information ---
-        case MSG_SYS_GET_MAGIC: {
-            BiDiBMessage response;
-            response.length = 4;
-            response.address[0] = 0;
-            response.msg_num = msg.msg_num;
-            response.msg_type = MSG_SYS_MAGIC;
-            response.data[0] = 0xAF; // BiDiB magic value
-            sendMessage(response);
-            break;
-        }
-        case MSG_SYS_GET_P_VERSION: {
-            BiDiBMessage response;
-            response.length = 5;
-            response.address[0] = 0;
-            response.msg_num = msg.msg_num;
-            response.msg_type = MSG_SYS_P_VERSION;
-            response.data[0] = protocol_version[1]; // Minor version
-            response.data[1] = protocol_version[0]; // Major version
-            sendMessage(response);
-            break;
-        }
-        case MSG_SYS_GET_UNIQUE_ID: {
-            BiDiBMessage response;
-            response.length = 10;
-            response.address[0] = 0;
-            response.msg_num = msg.msg_num;
-            response.msg_type = MSG_SYS_UNIQUE_ID;
-            memcpy(response.data, unique_id, 7);
-            sendMessage(response);
-            break;
-        }
-
-        // --- Node and Logon Management ---
-        case MSG_NODETAB_GETALL: {
-            if (_isLoggedIn) {
-                BiDiBMessage response;
-                response.length = 5;
-                response.address[0] = 0;
-                response.msg_num = msg.msg_num;
-                response.msg_type = MSG_NODETAB_COUNT;
-                response.data[0] = node_table_version;
-                response.data[1] = _node_count;
-                sendMessage(response);
-            }
-            break;
-        }
-        case MSG_VENDOR_ACK: {
-            if (_vendorAckCallback != nullptr) {
-                _vendorAckCallback(msg.address[0], msg.data[0]);
-            }
-            break;
-        }
-        case MSG_VENDOR: {
-            if (_vendorDataCallback != nullptr) {
-                const char* data_str = (const char*)msg.data;
-                const char* separator = strchr(data_str, '=');
-                if (separator != nullptr) {
-                    char name[32];
-                    char value[32];
-                    strncpy(name, data_str, separator - data_str);
-                    name[separator - data_str] = '\0';
-                    strcpy(value, separator + 1);
-                    _vendorDataCallback(msg.address[0], name, value);
-                }
-            }
-            break;
-        }
-        case MSG_NODETAB_GETNEXT: {
-            uint8_t requested_node_index = msg.data[0];
-            if (_isLoggedIn && requested_node_index < _node_count) {
-                BiDiBMessage response;
-                response.length = 12;
-                response.address[0] = 0;
-                response.msg_num = msg.msg_num;
-                response.msg_type = MSG_NODETAB;
-                response.data[0] = node_table_version;
-                response.data[1] = requested_node_index;
-                memcpy(response.data + 2, _node_table[requested_node_index].unique_id, 7);
-                sendMessage(response);
-            } else {
-                // Node index is out of bounds
-                BiDiBMessage response;
-                response.length = 4;
-                response.address[0] = 0;
-                response.msg_num = msg.msg_num;
-                response.msg_type = MSG_NODE_NA;
-                response.data[0] = requested_node_index;
-                sendMessage(response);
-            }
-            break;
-        }
-        case MSG_LOGON: {
-            if (findNode(msg.data) != -1) { break; } // Ignore if node is already logged on.
-            if (_node_count >= BIDIB_MAX_NODES) { break; } // Ignore if the node table is full.
-
-            // 1. Add the new node to the local table.
-            BiDiBNode newNode;
-            memcpy(newNode.unique_id, msg.data, 7);
-            _node_table[_node_count] = newNode;
-
-            // 2. Send LOGON_ACK back to the new node.
-            BiDiBMessage ack;
-            ack.length = 12;
-            ack.address[0] = 0;
-            ack.msg_num = msg.msg_num;
-            ack.msg_type = MSG_LOGON_ACK;
-            ack.data[0] = node_table_version;
-            ack.data[1] = _node_count; // The new node's address
-            memcpy(ack.data + 2, msg.data, 7);
-            sendMessage(ack);
-
-            // 3. Announce the new node to all other nodes (broadcast).
-            BiDiBMessage nodeNew;
-            nodeNew.length = 12;
-            nodeNew.address[0] = 0; // Broadcast address
-            nodeNew.msg_num = 0;    // System message
-            nodeNew.msg_type = MSG_NODE_NEW;
-            nodeNew.data[0] = node_table_version;
-            nodeNew.data[1] = _node_count; // The new node's address
-            memcpy(nodeNew.data + 2, msg.data, 7);
-            sendMessage(nodeNew);
-
-            _node_count++;
-            break;
-        }
-        case MSG_LOGON_ACK: {
-            _isLoggedIn = true;
-            _node_count = 1; // Reset local node count, will be updated by NODETAB messages.
-            break;
-        }
-
-        // --- Feature Handling ---
-        case MSG_FEATURE_GETALL: {
-            _next_feature_index = 0; // Reset index for subsequent GETNEXT messages.
-            BiDiBMessage response;
-            response.length = 4;
-            response.address[0] = 0;
-            response.msg_num = msg.msg_num;
-            response.msg_type = MSG_FEATURE_COUNT;
-            response.data[0] = _feature_count;
-            sendMessage(response);
-            break;
-        }
-        case MSG_FEATURE_GETNEXT: {
-            if (_next_feature_index < _feature_count) {
-                BiDiBMessage response;
-                response.length = 5;
-                response.address[0] = 0;
-                response.msg_num = msg.msg_num;
-                response.msg_type = MSG_FEATURE;
-                response.data[0] = _features[_next_feature_index].feature_num;
-                response.data[1] = _features[_next_feature_index].value;
-                sendMessage(response);
-                _next_feature_index++;
-            } else {
-                // End of feature list
-                BiDiBMessage response;
-                response.length = 4;
-                response.address[0] = 0;
-                response.msg_num = msg.msg_num;
-                response.msg_type = MSG_FEATURE_NA;
-                response.data[0] = 255; // Indicates end of list
-                sendMessage(response);
-                _next_feature_index = 0; // Reset for next time
-            }
-            break;
-        }
-        case MSG_FEATURE_GET: {
-            uint8_t feature_num = msg.data[0];
-            bool found = false;
-            for (int i = 0; i < _feature_count; ++i) {
-                if (_features[i].feature_num == feature_num) {
-                    BiDiBMessage response;
-                    response.length = 5;
-                    response.address[0] = 0;
-                    response.msg_num = msg.msg_num;
-                    response.msg_type = MSG_FEATURE;
-                    response.data[0] = _features[i].feature_num;
-                    response.data[1] = _features[i].value;
-                    sendMessage(response);
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
-                BiDiBMessage response;
-                response.length = 4;
-                response.address[0] = 0;
-                response.msg_num = msg.msg_num;
-                response.msg_type = MSG_FEATURE_NA;
-                response.data[0] = feature_num;
-                sendMessage(response);
-            }
-            break;
-        }
-        case MSG_FEATURE_SET: {
-            uint8_t feature_num = msg.data[0];
-            uint8_t value = msg.data[1];
-            setFeature(feature_num, value);
-
-            // Acknowledge by sending the new value back.
-            BiDiBMessage response;
-            response.length = 5;
-            response.address[0] = 0;
-            response.msg_num = msg.msg_num;
-            response.msg_type = MSG_FEATURE;
-            response.data[0] = feature_num;
-            response.data[1] = getFeature(feature_num);
-            sendMessage(response);
-            break;
-        }
-
-        // --- Command Station State ---
-        case MSG_CS_STATE: {
-            _track_state = msg.data[0];
-            break;
-        }
-        case MSG_CS_DRIVE_ACK: {
-            if (_driveAckCallback != nullptr) {
-                uint16_t address = msg.data[0] | (msg.data[1] << 8);
-                uint8_t status = msg.data[2];
-                _driveAckCallback(address, status);
-            }
-            break;
-        }
-        case MSG_CS_ACCESSORY_ACK: {
-            if (_accessoryAckCallback != nullptr) {
-                uint16_t address = msg.data[0] | (msg.data[1] << 8);
-                uint8_t status = msg.data[2];
-                _accessoryAckCallback(address, status);
-            }
-            break;
-        }
-        case MSG_CS_POM_ACK: {
-            if (_pomAckCallback != nullptr) {
-                uint16_t address = msg.data[0] | (msg.data[1] << 8);
-                uint8_t status = msg.data[5];
-                _pomAckCallback(address, status);
-            }
-            break;
-        }
-
-        // --- Occupancy Reporting ---
-        case MSG_BM_OCC: {
-            if (_occupancyCallback != nullptr) {
-                uint8_t detectorNum = msg.data[0];
-                _occupancyCallback(detectorNum, true);
-            }
-            break;
-        }
-        case MSG_BM_FREE: {
-            if (_occupancyCallback != nullptr) {
-                uint8_t detectorNum = msg.data[0];
-                _occupancyCallback(detectorNum, false);
-            }
-            break;
-        }
-        case MSG_BM_MULTIPLE: {
-            if (_occupancyMultipleCallback != nullptr) {
-                uint8_t baseNum = msg.data[0];
-                uint8_t size = msg.data[1];
-                _occupancyMultipleCallback(baseNum, size, &msg.data[2]);
-            }
-            break;
-        }
-        case MSG_BM_ADDRESS: {
-            if (_addressCallback != nullptr) {
-                uint8_t detectorNum = msg.data[0];
-                uint16_t address = msg.data[2] | (msg.data[3] << 8);
-                _addressCallback(detectorNum, address);
-            }
-            break;
-        }
-        case MSG_BM_SPEED: {
-            if (_speedCallback != nullptr) {
-                uint16_t address = msg.data[0] | (msg.data[1] << 8);
-                uint16_t speed = msg.data[2] | (msg.data[3] << 8);
-                _speedCallback(address, speed);
-            }
-            break;
-        }
-        case MSG_BM_CV: {
-            if (_cvCallback != nullptr) {
-                uint16_t address = msg.data[0] | (msg.data[1] << 8);
-                uint16_t cv = msg.data[3] | (msg.data[4] << 8);
-                uint8_t value = msg.data[5];
-                _cvCallback(address, cv, value);
-            }
-            break;
-        }
-
-        // --- Accessory Control ---
-        case MSG_ACCESSORY_STATE:
-        case MSG_ACCESSORY_NOTIFY: {
-            if (_accessoryStateCallback != nullptr) {
-                uint8_t accessoryNum = msg.data[0];
-                uint8_t aspect = msg.data[1];
-                _accessoryStateCallback(accessoryNum, aspect);
-            }
-            break;
-        }
+    dispatchMessage(msg);
+}
 
-        // --- Booster Status ---
-        case MSG_BOOST_STAT: {
-            if (_boosterStatusCallback != nullptr) {
-                _boosterStatusCallback(msg.data[0]);
-            }
-            break;
-        }
-        case MSG_BOOST_DIAGNOSTIC: {
-            if (_boosterDiagnosticCallback != nullptr) {
-                int addr_len = 0;
-                for (int i=0; i<4; ++i) { if (msg.address[i] == 0) { addr_len = i + 1; break; } }
-                int data_len = msg.length - addr_len - 2;
-                int data_index = 0;
-                while (data_index < data_len) {
-                    uint8_t type = msg.data[data_index];
-                    uint16_t value = msg.data[data_index + 1] | (msg.data[data_index + 2] << 8);
-                    _boosterDiagnosticCallback(type, value);
-                    data_index += 3;
-                }
+void BiDiB::dispatchMessage(const BiDiBMessage &msg) {
+    // Application handlers only cost a bitmap test for types nobody has hooked.
+    uint8_t type = msg.msg_type;
+    if (_messageHandlerMask[type >> 3] & (1 << (type & 7))) {
+        bool replaced = false;
+        for (uint8_t i = 0; i < _messageHandlerCount; ++i) {
+            if (_messageHandlers[i].msg_type == type) {
+                _messageHandlers[i].handler(*this, msg);
+                replaced |= _messageHandlers[i].replace;
             }
-            break;
         }
+        if (replaced) { return; }
+    }
+    handleBuiltin(msg);
+}
 
-        // --- Firmware Update ---
-        case MSG_FW_UPDATE_STAT: {
-            if (_firmwareUpdateStatusCallback != nullptr) {
-                uint8_t addr_len = 0;
-                for (int i=0; i<4; ++i) { if (msg.address[i] == 0) { addr_len = i + 1; break; } }
+void BiDiB::handleBuiltin(const BiDiBMessage &msg) {
+    BuiltinHandler handler;
+#if defined(__AVR__)
+    memcpy_P(&handler, &_builtinHandlers[msg.msg_type], sizeof(handler));
+#else
+    handler = _builtinHandlers[msg.msg_type];
+#endif
+    (this->*handler)(msg);
+}
 
-                uint8_t status = msg.data[0];
-                uint8_t detail = (msg.length > (addr_len + 3)) ? msg.data[1] : 0;
-                _firmwareUpdateStatusCallback(status, detail);
-            }
-            break;
-        }
+bool BiDiB::onMessage(uint8_t msg_type, MessageHandler handler, bool replace) {
+    if (handler == nullptr || _messageHandlerCount >= BIDIB_MAX_MESSAGE_HANDLERS) { return false; }
+    MessageHandlerEntry &entry = _messageHandlers[_messageHandlerCount++];
+    entry.handler = handler;
+    entry.msg_type = msg_type;
+    entry.replace = replace;
+    _messageHandlerMask[msg_type >> 3] |= (1 << (msg_type & 7));
+    return true;
+}
 
-        // --- Secure-ACK Handling ---
-        case MSG_BM_MIRROR_OCC:
-        case MSG_BM_MIRROR_FREE: {
-            uint8_t expected_type = (msg.msg_type == MSG_BM_MIRROR_OCC) ? MSG_BM_OCC : MSG_BM_FREE;
-            for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) {
-                if (_pendingSecureAcks[i].active &&
-                    _pendingSecureAcks[i].message.msg_type == expected_type &&
-                    _pendingSecureAcks[i].message.data[0] == msg.data[0]) {
-                    _pendingSecureAcks[i].active = false; // ACK received
-                    break;
-                }
-            }
-            break;
-        }
-        case MSG_BM_MIRROR_MULTIPLE: {
-            for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) {
-                if (_pendingSecureAcks[i].active &&
-                    _pendingSecureAcks[i].message.msg_type == MSG_BM_MULTIPLE &&
-                    _pendingSecureAcks[i].message.data[0] == msg.data[0]) {
-                    _pendingSecureAcks[i].active = false; // ACK received
-                    break;
-                }
-            }
-            break;
-        }
+void BiDiB::removeMessageHandler(uint8_t msg_type, MessageHandler handler) {
+    bool hooked = false;
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < _messageHandlerCount; ++i) {
+        if (_messageHandlers[i].msg_type == msg_type && _messageHandlers[i].handler == handler) { continue; }
+        hooked |= (_messageHandlers[i].msg_type == msg_type);
+        _messageHandlers[kept++] = _messageHandlers[i];
     }
+    _messageHandlerCount = kept;
+    if (!hooked) { _messageHandlerMask[msg_type >> 3] &= ~(1 << (msg_type & 7)); }
+}
+
+void BiDiB::removeListener(void *context) {
+    _driveAckEvent.remove(context);
+    _accessoryAckEvent.remove(context);
+    _pomAckEvent.remove(context);
+    _boosterStatusEvent.remove(context);
+    _boosterDiagnosticEvent.remove(context);
+    _vendorAckEvent.remove(context);
+    _vendorDataEvent.remove(context);
+    _occupancyEvent.remove(context);
+    _occupancyMultipleEvent.remove(context);
+    _addressEvent.remove(context);
+    _speedEvent.remove(context);
+    _cvEvent.remove(context);
+    _accessoryStateEvent.remove(context);
+    _firmwareUpdateStatusEvent.remove(context);
 }
 
 // =============================================================================
-// Internal Helper Functions
+// Built-in Message Handlers
 // =============================================================================
 
-void BiDiB::addPendingSecureAck(const BiDiBMessage &msg) {
-    for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) {
-        if (!_pendingSecureAcks[i].active) {
-            _pendingSecureAcks[i].active = true;
-            _pendingSecureAcks[i].message = msg;
-            _pendingSecureAcks[i].timestamp = millis();
-            _pendingSecureAcks[i].retries = 0;
-            sendMessage(msg);
-            return; // Found a slot and sent the message
-        }
-    }
-    // If no slot is found, the message is dropped.
-    // An alternative could be to log an error.
+// The dispatch table is generated at compile time: one entry per MSG_TYPE, with every
+// type the library does not handle pointing at handleUnknown(). It lives in flash on AVR.
+constexpr BiDiB::BuiltinHandler BiDiB::builtinHandler(uint8_t type) {
+    return type == MSG_SYS_GET_MAGIC        ? &BiDiB::handleSysGetMagic
+         : type == MSG_SYS_GET_P_VERSION    ? &BiDiB::handleSysGetPVersion
+         : type == MSG_SYS_GET_UNIQUE_ID    ? &BiDiB::handleSysGetUniqueId
+         : type == MSG_NODETAB_GETALL       ? &BiDiB::handleNodeTabGetAll
+         : type == MSG_VENDOR_ACK           ? &BiDiB::handleVendorAck
+         : type == MSG_VENDOR               ? &BiDiB::handleVendor
+         : type == MSG_NODETAB_GETNEXT      ? &BiDiB::handleNodeTabGetNext
+         : type == MSG_LOGON                ? &BiDiB::handleLogon
+         : type == MSG_LOGON_ACK            ? &BiDiB::handleLogonAck
+         : type == MSG_FEATURE_GETALL       ? &BiDiB::handleFeatureGetAll
+         : type == MSG_FEATURE_GETNEXT      ? &BiDiB::handleFeatureGetNext
+         : type == MSG_FEATURE_GET          ? &BiDiB::handleFeatureGet
+         : type == MSG_FEATURE_SET          ? &BiDiB::handleFeatureSet
+         : type == MSG_CS_STATE             ? &BiDiB::handleCsState
+         : type == MSG_CS_DRIVE_ACK         ? &BiDiB::handleCsDriveAck
+         : type == MSG_CS_ACCESSORY_ACK     ? &BiDiB::handleCsAccessoryAck
+         : type == MSG_CS_POM_ACK           ? &BiDiB::handleCsPomAck
+         : type == MSG_BM_OCC               ? &BiDiB::handleBmOcc
+         : type == MSG_BM_FREE              ? &BiDiB::handleBmFree
+         : type == MSG_BM_MULTIPLE          ? &BiDiB::handleBmMultiple
+         : type == MSG_BM_ADDRESS           ? &BiDiB::handleBmAddress
+         : type == MSG_BM_SPEED             ? &BiDiB::handleBmSpeed
+         : type == MSG_BM_CV                ? &BiDiB::handleBmCv
+         : type == MSG_ACCESSORY_STATE      ? &BiDiB::handleAccessoryState
+         : type == MSG_ACCESSORY_NOTIFY     ? &BiDiB::handleAccessoryState
+         : type == MSG_BOOST_STAT           ? &BiDiB::handleBoostStat
+         : type == MSG_BOOST_DIAGNOSTIC     ? &BiDiB::handleBoostDiagnostic
+         : type == MSG_FW_UPDATE_STAT       ? &BiDiB::handleFwUpdateStat
+         : type == MSG_BM_MIRROR_OCC        ? &BiDiB::handleBmMirror
+         : type == MSG_BM_MIRROR_FREE       ? &BiDiB::handleBmMirror
+         : type == MSG_BM_MIRROR_MULTIPLE   ? &BiDiB::handleBmMirrorMultiple
+         : &BiDiB::handleUnknown;
 }
 
-int BiDiB::findNode(const uint8_t* unique_id) {
-    for (int i = 0; i < _node_count; ++i) {
-        if (memcmp(_node_table[i].unique_id, unique_id, 7) == 0) {
-            return i; // Node found at index i
-        }
+#define BIDIB_HANDLER_R4(i) builtinHandler(i), builtinHandler(i + 1), builtinHandler(i + 2), builtinHandler(i + 3)
+#define BIDIB_HANDLER_R16(i) BIDIB_HANDLER_R4(i), BIDIB_HANDLER_R4(i + 4), BIDIB_HANDLER_R4(i + 8), BIDIB_HANDLER_R4(i + 12)
+#define BIDIB_HANDLER_R64(i) BIDIB_HANDLER_R16(i), BIDIB_HANDLER_R16(i + 16), BIDIB_HANDLER_R16(i + 32), BIDIB_HANDLER_R16(i + 48)
+
+const BiDiB::BuiltinHandler BiDiB::_builtinHandlers[256]
+#if defined(__AVR__)
+    PROGMEM
+#endif
+    = { BIDIB_HANDLER_R64(0), BIDIB_HANDLER_R64(64), BIDIB_HANDLER_R64(128), BIDIB_HANDLER_R64(192) };
+
+void BiDiB::handleUnknown(const BiDiBMessage &) {}
+
+// --- Basic System Information ---
+
+void BiDiB::handleSysGetMagic(const BiDiBMessage &msg) {
+    BiDiBMessage response;
+    response.length = 4;
+    response.address[0] = 0;
+    response.msg_num = msg.msg_num;
+    response.msg_type = MSG_SYS_MAGIC;
+    response.data[0] = 0xAF; // BiDiB magic value
+    sendMessage(response);
+}
+
+void BiDiB::handleSysGetPVersion(const BiDiBMessage &msg) {
+    BiDiBMessage response;
+    response.length = 5;
+    response.address[0] = 0;
+    response.msg_num = msg.msg_num;
+    response.msg_type = MSG_SYS_P_VERSION;
+    response.data[0] = protocol_version[1]; // Minor version
+    response.data[1] = protocol_version[0]; // Major version
+    sendMessage(response);
+}
+
+void BiDiB::handleSysGetUniqueId(const BiDiBMessage &msg) {
+    BiDiBMessage response;
+    response.length = 10;
+    response.address[0] = 0;
+    response.msg_num = msg.msg_num;
+    response.msg_type = MSG_SYS_UNIQUE_ID;
+    memcpy(response.data, unique_id, 7);
+    sendMessage(response);
+}
+
+// --- Node and Logon Management ---
+
+void BiDiB::handleNodeTabGetAll(const BiDiBMessage &msg) {
+    if (_isLoggedIn) {
+        BiDiBMessage response;
+        response.length = 5;
+        response.address[0] = 0;
+        response.msg_num = msg.msg_num;
+        response.msg_type = MSG_NODETAB_COUNT;
+        response.data[0] = node_table_version;
+        // The count is a single byte, and MSG_NODETAB_GETNEXT can reach only the first 255 entries.
+        response.data[1] = _node_count < 255 ? (uint8_t)_node_count : 255;
+        sendMessage(response);
+    }
+}
+
+void BiDiB::handleVendorAck(const BiDiBMessage &msg) {
+    if (!_vendorAckEvent.empty()) {
+        _vendorAckEvent(msg.address[0], msg.data[0]);
+    }
+}
+
+void BiDiB::handleVendor(const BiDiBMessage &msg) {
+    if (!_vendorDataEvent.empty()) {
+        const char* data_str = (const char*)msg.data;
+        const char* separator = strchr(data_str, '=');
+        if (separator != nullptr) {
+            char name[32];
+            char value[32];
+            strncpy(name, data_str, separator - data_str);
+            name[separator - data_str] = '\0';
+            strcpy(value, separator + 1);
+            _vendorDataEvent(msg.address[0], name, value);
+        }
+    }
+}
+
+void BiDiB::handleNodeTabGetNext(const BiDiBMessage &msg) {
+    uint8_t requested_node_index = msg.data[0];
+    if (_isLoggedIn && requested_node_index < _node_count) {
+        BiDiBMessage response;
+        response.length = 12;
+        response.address[0] = 0;
+        response.msg_num = msg.msg_num;
+        response.msg_type = MSG_NODETAB;
+        response.data[0] = node_table_version;
+        response.data[1] = _node_table[requested_node_index].address[0];
+        memcpy(response.data + 2, _node_table[requested_node_index].unique_id, 7);
+        sendMessage(response);
+    } else {
+        // Node index is out of bounds
+        BiDiBMessage response;
+        response.length = 4;
+        response.address[0] = 0;
+        response.msg_num = msg.msg_num;
+        response.msg_type = MSG_NODE_NA;
+        response.data[0] = requested_node_index;
+        sendMessage(response);
+    }
+}
+
+void BiDiB::handleLogon(const BiDiBMessage &msg) {
+    if (findNode(msg.data) != -1) { return; } // Ignore if node is already logged on.
+    if (_node_count >= BIDIB_MAX_NODES) { return; } // Ignore if the node table is full.
+    // A node on this bus gets the lowest local address that is still free; ignore it if none is left.
+    uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {1, 0, 0, 0};
+    while (findNodeByAddress(address) != -1) {
+        if (address[0] == 255) { return; }
+        address[0]++;
+    }
+
+    // 1. Add the new node to the local table.
+    insertNode(msg.data, address);
+
+    // 2. Send LOGON_ACK back to the new node.
+    BiDiBMessage ack;
+    ack.length = 12;
+    ack.address[0] = 0;
+    ack.msg_num = msg.msg_num;
+    ack.msg_type = MSG_LOGON_ACK;
+    ack.data[0] = node_table_version;
+    ack.data[1] = address[0]; // The new node's address
+    memcpy(ack.data + 2, msg.data, 7);
+    sendMessage(ack);
+
+    // 3. Announce the new node to all other nodes (broadcast).
+    BiDiBMessage nodeNew;
+    nodeNew.length = 12;
+    nodeNew.address[0] = 0; // Broadcast address
+    nodeNew.msg_num = 0;    // System message
+    nodeNew.msg_type = MSG_NODE_NEW;
+    nodeNew.data[0] = node_table_version;
+    nodeNew.data[1] = address[0]; // The new node's address
+    memcpy(nodeNew.data + 2, msg.data, 7);
+    sendMessage(nodeNew);
+}
+
+void BiDiB::handleLogonAck(const BiDiBMessage &) {
+    _isLoggedIn = true;
+    resetNodeTable(); // Only this node is known now, the others will be updated by NODETAB messages.
+}
+
+// --- Feature Handling ---
+
+void BiDiB::handleFeatureGetAll(const BiDiBMessage &msg) {
+    _next_feature_index = 0; // Reset index for subsequent GETNEXT messages.
+    BiDiBMessage response;
+    response.length = 4;
+    response.address[0] = 0;
+    response.msg_num = msg.msg_num;
+    response.msg_type = MSG_FEATURE_COUNT;
+    response.data[0] = _feature_count;
+    sendMessage(response);
+}
+
+void BiDiB::handleFeatureGetNext(const BiDiBMessage &msg) {
+    if (_next_feature_index < _feature_count) {
+        BiDiBMessage response;
+        response.length = 5;
+        response.address[0] = 0;
+        response.msg_num = msg.msg_num;
+        response.msg_type = MSG_FEATURE;
+        response.data[0] = _features[_next_feature_index].feature_num;
+        response.data[1] = _features[_next_feature_index].value;
+        sendMessage(response);
+        _next_feature_index++;
+    } else {
+        // End of feature list
+        BiDiBMessage response;
+        response.length = 4;
+        response.address[0] = 0;
+        response.msg_num = msg.msg_num;
+        response.msg_type = MSG_FEATURE_NA;
+        response.data[0] = 255; // Indicates end of list
+        sendMessage(response);
+        _next_feature_index = 0; // Reset for next time
+    }
+}
+
+void BiDiB::handleFeatureGet(const BiDiBMessage &msg) {
+    uint8_t feature_num = msg.data[0];
+    BiDiBMessage response;
+    response.address[0] = 0;
+    response.msg_num = msg.msg_num;
+    if (hasFeature(feature_num)) {
+        response.length = 5;
+        response.msg_type = MSG_FEATURE;
+        response.data[0] = feature_num;
+        response.data[1] = _features[featureIndex(feature_num)].value;
+    } else {
+        response.length = 4;
+        response.msg_type = MSG_FEATURE_NA;
+        response.data[0] = feature_num;
+    }
+    sendMessage(response);
+}
+
+void BiDiB::handleFeatureSet(const BiDiBMessage &msg) {
+    uint8_t feature_num = msg.data[0];
+    uint8_t value = msg.data[1];
+    setFeature(feature_num, value);
+
+    // Acknowledge by sending the new value back.
+    BiDiBMessage response;
+    response.length = 5;
+    response.address[0] = 0;
+    response.msg_num = msg.msg_num;
+    response.msg_type = MSG_FEATURE;
+    response.data[0] = feature_num;
+    response.data[1] = getFeature(feature_num);
+    sendMessage(response);
+}
+
+// --- Command Station State ---
+
+void BiDiB::handleCsState(const BiDiBMessage &msg) {
+    _track_state = msg.data[0];
+}
+
+void BiDiB::handleCsDriveAck(const BiDiBMessage &msg) {
+    if (!_driveAckEvent.empty()) {
+        uint16_t address = msg.data[0] | (msg.data[1] << 8);
+        uint8_t status = msg.data[2];
+        _driveAckEvent(address, status);
+    }
+}
+
+void BiDiB::handleCsAccessoryAck(const BiDiBMessage &msg) {
+    if (!_accessoryAckEvent.empty()) {
+        uint16_t address = msg.data[0] | (msg.data[1] << 8);
+        uint8_t status = msg.data[2];
+        _accessoryAckEvent(address, status);
+    }
+}
+
+void BiDiB::handleCsPomAck(const BiDiBMessage &msg) {
+    if (!_pomAckEvent.empty()) {
+        uint16_t address = msg.data[0] | (msg.data[1] << 8);
+        uint8_t status = msg.data[5];
+        _pomAckEvent(address, status);
+    }
+}
+
+// --- Occupancy Reporting ---
+
+void BiDiB::handleBmOcc(const BiDiBMessage &msg) {
+    if (!_occupancyEvent.empty()) {
+        uint8_t detectorNum = msg.data[0];
+        _occupancyEvent(detectorNum, true);
+    }
+}
+
+void BiDiB::handleBmFree(const BiDiBMessage &msg) {
+    if (!_occupancyEvent.empty()) {
+        uint8_t detectorNum = msg.data[0];
+        _occupancyEvent(detectorNum, false);
+    }
+}
+
+void BiDiB::handleBmMultiple(const BiDiBMessage &msg) {
+    if (!_occupancyMultipleEvent.empty()) {
+        uint8_t baseNum = msg.data[0];
+        uint8_t size = msg.data[1];
+        _occupancyMultipleEvent(baseNum, size, &msg.data[2]);
+    }
+}
+
+void BiDiB::handleBmAddress(const BiDiBMessage &msg) {
+    if (!_addressEvent.empty()) {
+        uint8_t detectorNum = msg.data[0];
+        uint16_t address = msg.data[2] | (msg.data[3] << 8);
+        _addressEvent(detectorNum, address);
+    }
+}
+
+void BiDiB::handleBmSpeed(const BiDiBMessage &msg) {
+    if (!_speedEvent.empty()) {
+        uint16_t address = msg.data[0] | (msg.data[1] << 8);
+        uint16_t speed = msg.data[2] | (msg.data[3] << 8);
+        _speedEvent(address, speed);
+    }
+}
+
+void BiDiB::handleBmCv(const BiDiBMessage &msg) {
+    if (!_cvEvent.empty()) {
+        uint16_t address = msg.data[0] | (msg.data[1] << 8);
+        uint16_t cv = msg.data[3] | (msg.data[4] << 8);
+        uint8_t value = msg.data[5];
+        _cvEvent(address, cv, value);
+    }
+}
+
+// --- Accessory Control ---
+
+void BiDiB::handleAccessoryState(const BiDiBMessage &msg) {
+    if (!_accessoryStateEvent.empty()) {
+        uint8_t accessoryNum = msg.data[0];
+        uint8_t aspect = msg.data[1];
+        _accessoryStateEvent(accessoryNum, aspect);
+    }
+}
+
+// --- Booster Status ---
+
+void BiDiB::handleBoostStat(const BiDiBMessage &msg) {
+    if (!_boosterStatusEvent.empty()) {
+        _boosterStatusEvent(msg.data[0]);
+    }
+}
+
+void BiDiB::handleBoostDiagnostic(const BiDiBMessage &msg) {
+    if (!_boosterDiagnosticEvent.empty()) {
+        int addr_len = 0;
+        for (int i=0; i<4; ++i) { if (msg.address[i] == 0) { addr_len = i + 1; break; } }
+        int data_len = msg.length - addr_len - 2;
+        int data_index = 0;
+        while (data_index < data_len) {
+            uint8_t type = msg.data[data_index];
+            uint16_t value = msg.data[data_index + 1] | (msg.data[data_index + 2] << 8);
+            _boosterDiagnosticEvent(type, value);
+            data_index += 3;
+        }
+    }
+}
+
+// --- Firmware Update ---
+
+void BiDiB::handleFwUpdateStat(const BiDiBMessage &msg) {
+    if (!_firmwareUpdateStatusEvent.empty()) {
+        uint8_t addr_len = 0;
+        for (int i=0; i<4; ++i) { if (msg.address[i] == 0) { addr_len = i + 1; break; } }
+
+        uint8_t status = msg.data[0];
+        uint8_t detail = (msg.length > (addr_len + 3)) ? msg.data[1] : 0;
+        _firmwareUpdateStatusEvent(status, detail);
+    }
+}
+
+// --- Secure-ACK Handling ---
+
+void BiDiB::handleBmMirror(const BiDiBMessage &msg) {
+    int index = findPendingSecureAck(MSG_BM_OCC, msg.data[0]);
+    // After an overwrite the mirror may still answer the old content; wait for the next resend.
+    if (index < 0 || _pendingSecureAcks[index].overwritten) { return; }
+    uint8_t expected_type = (msg.msg_type == MSG_BM_MIRROR_OCC) ? MSG_BM_OCC : MSG_BM_FREE;
+    unsigned long now = millis();
+    if (_pendingSecureAcks[index].msg_type == expected_type) {
+        sampleSecureAckRtt(index, now);
+        removePendingSecureAck(index); // ACK received
+    } else {
+        resendPendingSecureAck(index, now, false); // The master has the wrong state, correct it right away.
     }
+}
+
+void BiDiB::handleBmMirrorMultiple(const BiDiBMessage &msg) {
+    int index = findPendingSecureAck(MSG_BM_MULTIPLE, msg.data[0]);
+    if (index < 0 || _pendingSecureAcks[index].overwritten) { return; }
+    // The mirror must repeat the range and bitmap exactly.
+    const uint8_t *data = pendingSecureAckData(index);
+    unsigned long now = millis();
+    if (msg.data[1] == data[1] && memcmp(&msg.data[2], &data[2], data[1]) == 0) {
+        sampleSecureAckRtt(index, now);
+        removePendingSecureAck(index); // ACK received
+    } else {
+        resendPendingSecureAck(index, now, false);
+    }
+}
+
+// =============================================================================
+// Internal Helper Functions
+// =============================================================================
+
+void BiDiB::addPendingSecureAck(const BiDiBMessage &msg) {
+    // The encoded message takes MSG_LENGTH + 1 bytes; new messages are appended at the end of the arena.
+    if (msg.length > BIDIB_MAX_MESSAGE_LENGTH) { return; }
+
+    // Latest state wins: a pending report about the same detector(s) is stale now.
+    if (msg.msg_type == MSG_BM_MULTIPLE) {
+        // Single reports and older ranges within the new range are covered by it. Older ranges
+        // with another base that only overlap it take over its bits for the shared detectors.
+        uint16_t start = msg.data[0];
+        uint16_t end = start + 8 * msg.data[1];
+        uint8_t i = 0;
+        while (i < _pendingSecureAckCount) {
+            const PendingSecureAck &ack = _pendingSecureAcks[i];
+            if (ack.msg_type != MSG_BM_MULTIPLE) {
+                if (ack.key >= start && ack.key < end) {
+                    removePendingSecureAck(i);
+                    continue;
+                }
+            } else if (ack.key != start) {
+                uint8_t *data = pendingSecureAckData(i);
+                uint16_t old_end = data[0] + 8 * data[1];
+                if (data[0] >= start && old_end <= end) {
+                    removePendingSecureAck(i);
+                    continue;
+                }
+                uint16_t from = data[0] > start ? data[0] : start;
+                uint16_t to = old_end < end ? old_end : end;
+                for (uint16_t detector = from; detector < to; ++detector) {
+                    uint8_t offset = detector - data[0];
+                    uint8_t mask = (uint8_t)(1 << (offset % 8));
+                    uint8_t before = data[2 + offset / 8];
+                    if (msg.data[2 + (detector - start) / 8] & (1 << ((detector - start) % 8))) {
+                        data[2 + offset / 8] |= mask;
+                    } else {
+                        data[2 + offset / 8] &= (uint8_t)~mask;
+                    }
+                    if (data[2 + offset / 8] != before) { markSecureAckOverwritten(i); }
+                }
+            }
+            i++;
+        }
+    } else {
+        // A pending range that contains the detector must not resend its old bit.
+        for (uint8_t i = 0; i < _pendingSecureAckCount; ++i) {
+            if (_pendingSecureAcks[i].msg_type != MSG_BM_MULTIPLE) { continue; }
+            uint8_t *data = pendingSecureAckData(i);
+            uint8_t offset = msg.data[0] - data[0];
+            if (msg.data[0] < data[0] || offset >= 8 * data[1]) { continue; }
+            uint8_t before = data[2 + offset / 8];
+            if (msg.msg_type == MSG_BM_OCC) {
+                data[2 + offset / 8] |= (uint8_t)(1 << (offset % 8));
+            } else {
+                data[2 + offset / 8] &= (uint8_t)~(1 << (offset % 8));
+            }
+            if (data[2 + offset / 8] != before) { markSecureAckOverwritten(i); }
+        }
+    }
+    int existing = findPendingSecureAck(msg.msg_type, msg.data[0]);
+    if (existing >= 0) {
+        PendingSecureAck &ack = _pendingSecureAcks[existing];
+        if (ack.length == msg.length + 1) {
+            // Same size: overwrite in place and restart the retry cycle.
+            encodeMessage(msg, &_secureAckArena[ack.offset]);
+            ack.msg_type = msg.msg_type;
+            ack.timeout = _secureAckTimeout;
+            ack.deadline = (uint16_t)(millis() + ack.timeout);
+            ack.retries = 0;
+            markSecureAckOverwritten(existing);
+            siftSecureAck(_secureAckHeapPos[existing]);
+            sendMessage(msg);
+            return;
+        }
+        removePendingSecureAck(existing);
+    }
+
+    if (_pendingSecureAckCount >= MAX_PENDING_SECURE_ACKS ||
+        _secureAckArenaUsed + msg.length + 1 > BIDIB_SECACK_ARENA_SIZE) {
+        // If no slot is found, the message is dropped.
+        // An alternative could be to log an error.
+        return;
+    }
+
+    uint8_t index = _pendingSecureAckCount++;
+    PendingSecureAck &ack = _pendingSecureAcks[index];
+    ack.offset = _secureAckArenaUsed;
+    ack.length = encodeMessage(msg, &_secureAckArena[_secureAckArenaUsed]);
+    ack.msg_type = msg.msg_type;
+    ack.key = msg.data[0];
+    ack.timeout = _secureAckTimeout;
+    ack.deadline = (uint16_t)(millis() + ack.timeout);
+    ack.retries = 0;
+    ack.measurable = true;
+    ack.overwritten = false;
+    _secureAckArenaUsed += ack.length;
+
+    _secureAckHeap[index] = index;
+    _secureAckHeapPos[index] = index;
+    siftSecureAck(index);
+#if BIDIB_SECACK_DETECTOR_INDEX
+    (msg.msg_type == MSG_BM_MULTIPLE ? _secureAckRangeSlot : _secureAckSingleSlot)[ack.key] = index + 1;
+#endif
+
+    sendMessage(msg);
+}
+
+void BiDiB::removePendingSecureAck(uint8_t index) {
+    // Take the entry out of the heap; the last heap element fills its place.
+    uint8_t last = _pendingSecureAckCount - 1;
+    uint8_t pos = _secureAckHeapPos[index];
+    if (pos != last) {
+        _secureAckHeap[pos] = _secureAckHeap[last];
+        _secureAckHeapPos[_secureAckHeap[pos]] = pos;
+    }
+
+#if BIDIB_SECACK_DETECTOR_INDEX
+    uint8_t *slots = _pendingSecureAcks[index].msg_type == MSG_BM_MULTIPLE ? _secureAckRangeSlot : _secureAckSingleSlot;
+    slots[_pendingSecureAcks[index].key] = 0;
+#endif
+
+    // Close the gap in the arena; the entries after this one keep their order and move down.
+    uint16_t offset = _pendingSecureAcks[index].offset;
+    uint8_t length = _pendingSecureAcks[index].length;
+    memmove(&_secureAckArena[offset], &_secureAckArena[offset + length],
+            _secureAckArenaUsed - offset - length);
+    _secureAckArenaUsed -= length;
+
+    for (uint8_t i = index + 1; i < _pendingSecureAckCount; ++i) {
+        _pendingSecureAcks[i - 1] = _pendingSecureAcks[i];
+        _pendingSecureAcks[i - 1].offset -= length;
+        _secureAckHeapPos[i - 1] = _secureAckHeapPos[i];
+#if BIDIB_SECACK_DETECTOR_INDEX
+        (_pendingSecureAcks[i - 1].msg_type == MSG_BM_MULTIPLE ? _secureAckRangeSlot : _secureAckSingleSlot)[_pendingSecureAcks[i - 1].key] = i;
+#endif
+    }
+    _pendingSecureAckCount--;
+
+    // Renumbering keeps the relative order of the entries, so the heap stays valid apart from the moved element.
+    for (uint8_t p = 0; p < _pendingSecureAckCount; ++p) {
+        if (_secureAckHeap[p] > index) { _secureAckHeap[p]--; }
+    }
+    if (pos < _pendingSecureAckCount) { siftSecureAck(pos); }
+}
+
+void BiDiB::resendPendingSecureAck(uint8_t index, unsigned long now, bool backoff) {
+    PendingSecureAck &ack = _pendingSecureAcks[index];
+    if (ack.retries < SECURE_ACK_RETRIES) {
+        // Resend the message
+        ack.retries++;
+        ack.measurable = false;
+        ack.overwritten = false; // Mirrors of the old content have had a timeout to arrive
+        _secureAckRetransmits++;
+        uint16_t jitter = 0;
+        if (backoff) {
+            // Exponential backoff, spread by up to a quarter of the timeout so that reports lost
+            // together are not resent together.
+            ack.timeout = ack.timeout < BIDIB_SECACK_MAX_TIMEOUT / 2 ? ack.timeout * 2 : BIDIB_SECACK_MAX_TIMEOUT;
+            _secureAckJitter ^= _secureAckJitter << 7;
+            _secureAckJitter ^= _secureAckJitter >> 9;
+            _secureAckJitter ^= _secureAckJitter << 8;
+            jitter = _secureAckJitter % (ack.timeout / 4 + 1);
+        } else {
+            ack.timeout = _secureAckTimeout;
+        }
+        ack.deadline = (uint16_t)(now + ack.timeout + jitter);
+        siftSecureAck(_secureAckHeapPos[index]);
+        BiDiBMessage msg;
+        decodeMessage(&_secureAckArena[ack.offset], msg);
+        sendMessage(msg);
+    } else {
+        // Max retries reached, give up
+        _secureAckFailures++;
+        removePendingSecureAck(index);
+    }
+}
+
+void BiDiB::markSecureAckOverwritten(uint8_t index) {
+    _pendingSecureAcks[index].measurable = false;
+    _pendingSecureAcks[index].overwritten = true;
+}
+
+void BiDiB::sampleSecureAckRtt(uint8_t index, unsigned long now) {
+    const PendingSecureAck &ack = _pendingSecureAcks[index];
+    if (!ack.measurable) { return; } // Karn's rule
+    uint32_t rtt = (uint16_t)((uint16_t)now - ack.deadline + ack.timeout);
+    if (rtt > BIDIB_SECACK_MAX_TIMEOUT) { rtt = BIDIB_SECACK_MAX_TIMEOUT; }
+
+    if (!_secureAckRttValid) {
+        _secureAckSrtt8 = rtt << 3;
+        _secureAckRttVar4 = rtt << 1;
+        _secureAckRttValid = true;
+    } else {
+        // SRTT += (RTT - SRTT) / 8, RTTVAR += (|RTT - SRTT| - RTTVAR) / 4
+        int32_t err = (int32_t)rtt - (int32_t)(_secureAckSrtt8 >> 3);
+        _secureAckSrtt8 += err;
+        if (err < 0) { err = -err; }
+        _secureAckRttVar4 = _secureAckRttVar4 - (_secureAckRttVar4 >> 2) + err;
+    }
+
+    // RTO = SRTT + max(G, 4 * RTTVAR) with a clock granularity G of 1 ms
+    uint32_t timeout = (_secureAckSrtt8 >> 3) + (_secureAckRttVar4 > 1 ? _secureAckRttVar4 : 1);
+    if (timeout < BIDIB_SECACK_MIN_TIMEOUT) { timeout = BIDIB_SECACK_MIN_TIMEOUT; }
+    if (timeout > BIDIB_SECACK_MAX_TIMEOUT) { timeout = BIDIB_SECACK_MAX_TIMEOUT; }
+    _secureAckTimeout = timeout;
+}
+
+void BiDiB::resetSecureAckRtt() {
+    _secureAckSrtt8 = 0;
+    _secureAckRttVar4 = 0;
+    _secureAckRttValid = false;
+    _secureAckTimeout = SECURE_ACK_TIMEOUT < BIDIB_SECACK_MAX_TIMEOUT ? SECURE_ACK_TIMEOUT : BIDIB_SECACK_MAX_TIMEOUT;
+    _secureAckRetransmits = 0;
+    _secureAckFailures = 0;
+    _secureAckJitter = 0xACE1;
+    _secureAckNudged = false;
+}
+
+uint16_t BiDiB::getSecureAckRtt() {
+    return _secureAckSrtt8 >> 3;
+}
+
+uint16_t BiDiB::getSecureAckRttVariance() {
+    return _secureAckRttVar4 >> 2;
+}
+
+uint16_t BiDiB::getSecureAckTimeout() {
+    return _secureAckTimeout;
+}
+
+uint16_t BiDiB::getSecureAckRetransmitCount() {
+    return _secureAckRetransmits;
+}
+
+uint16_t BiDiB::getSecureAckFailureCount() {
+    return _secureAckFailures;
+}
+
+int BiDiB::findPendingSecureAck(uint8_t msg_type, uint8_t key) {
+    // MSG_BM_OCC and MSG_BM_FREE report the same detector; MSG_BM_MULTIPLE is matched by its base number.
+    bool multiple = msg_type == MSG_BM_MULTIPLE;
+#if BIDIB_SECACK_DETECTOR_INDEX
+    return (multiple ? _secureAckRangeSlot : _secureAckSingleSlot)[key] - 1;
+#else
+    for (uint8_t i = 0; i < _pendingSecureAckCount; ++i) {
+        if ((_pendingSecureAcks[i].msg_type == MSG_BM_MULTIPLE) == multiple && _pendingSecureAcks[i].key == key) {
+            return i;
+        }
+    }
+    return -1;
+#endif
+}
+
+uint8_t *BiDiB::pendingSecureAckData(uint8_t index) {
+    // Skip MSG_LENGTH and the address (up to and including its terminating 0), then MSG_NUM and MSG_TYPE.
+    uint8_t *p = &_secureAckArena[_pendingSecureAcks[index].offset + 1];
+    for (int i = 0; i < BIDIB_MAX_ADDRESS_LENGTH; i++) {
+        if (*p++ == 0) break;
+    }
+    return p + 2;
+}
+
+bool BiDiB::secureAckBefore(uint8_t a, uint8_t b) const {
+    int16_t diff = (int16_t)(_pendingSecureAcks[a].deadline - _pendingSecureAcks[b].deadline);
+    return diff < 0 || (diff == 0 && a < b);
+}
+
+void BiDiB::siftSecureAck(uint8_t pos) {
+    uint8_t entry = _secureAckHeap[pos];
+    // Up, while the parent is due later ...
+    while (pos > 0) {
+        uint8_t parent = (pos - 1) / 2;
+        if (!secureAckBefore(entry, _secureAckHeap[parent])) { break; }
+        _secureAckHeap[pos] = _secureAckHeap[parent];
+        _secureAckHeapPos[_secureAckHeap[pos]] = pos;
+        pos = parent;
+    }
+    // ... or down, while a child is due earlier.
+    for (;;) {
+        uint16_t child = 2 * pos + 1;
+        if (child >= _pendingSecureAckCount) { break; }
+        if (child + 1 < _pendingSecureAckCount && secureAckBefore(_secureAckHeap[child + 1], _secureAckHeap[child])) {
+            child++;
+        }
+        if (!secureAckBefore(_secureAckHeap[child], entry)) { break; }
+        _secureAckHeap[pos] = _secureAckHeap[child];
+        _secureAckHeapPos[_secureAckHeap[pos]] = pos;
+        pos = child;
+    }
+    _secureAckHeap[pos] = entry;
+    _secureAckHeapPos[entry] = pos;
+}
+
+uint8_t BiDiB::getPendingSecureAckCount() {
+    return _pendingSecureAckCount;
+}
+
+#if BIDIB_NODE_INDEX
+// The unique ID starts with class and vendor bytes shared by many nodes, so all seven bytes go
+// into the hash (FNV-1a). Addresses are packed into a word and spread with a multiplicative hash.
+static uint16_t hashUniqueId(const uint8_t *unique_id) {
+    uint32_t hash = 2166136261UL;
+    for (int i = 0; i < 7; ++i) {
+        hash = (hash ^ unique_id[i]) * 16777619UL;
+    }
+    return (uint16_t)(hash ^ (hash >> 16)) & (BIDIB_NODE_INDEX_SIZE - 1);
+}
+#endif
+
+static uint32_t packAddress(const uint8_t *address) {
+    uint32_t packed = 0;
+    for (int i = 0; i < BIDIB_MAX_ADDRESS_LENGTH; ++i) {
+        packed = (packed << 8) | address[i];
+        if (address[i] == 0) {
+            packed <<= 8 * (BIDIB_MAX_ADDRESS_LENGTH - 1 - i);
+            break;
+        }
+    }
+    return packed;
+}
+
+#if BIDIB_NODE_INDEX
+static uint16_t hashAddress(uint32_t packed) {
+    return (uint16_t)((packed * 2654435761UL) >> 16) & (BIDIB_NODE_INDEX_SIZE - 1);
+}
+#endif
+
+void BiDiB::resetNodeTable() {
+#if BIDIB_NODE_INDEX
+    memset(_nodeUidIndex, 0, sizeof(_nodeUidIndex));
+    memset(_nodeAddrIndex, 0, sizeof(_nodeAddrIndex));
+#endif
+    _node_count = 0;
+    memset(_local_node.address, 0, sizeof(_local_node.address));
+
+    // Held requests were addressed with the old table and may mean another node now. Their
+    // sendRequest() entries start the timeout, as no answer is going to come.
+#if BIDIB_FLOW_CONTROL
+    for (uint8_t i = 0; i < _flowHeldCount; ++i) {
+        if (_flowHeldTracked[i]) { releaseRequest(_flowHeld[i]); }
+    }
+#endif
+    _flowHeldCount = 0;
+    _flowInFlight = 0;
+    insertNode(_local_node.unique_id, _local_node.address);
+}
+
+uint16_t BiDiB::insertNode(const uint8_t *unique_id, const uint8_t *address) {
+    uint16_t slot = _node_count++;
+    memcpy(_node_table[slot].unique_id, unique_id, 7);
+    memset(_node_table[slot].address, 0, sizeof(_node_table[slot].address));
+    for (int i = 0; i < BIDIB_MAX_ADDRESS_LENGTH && address[i] != 0; ++i) {
+        _node_table[slot].address[i] = address[i];
+    }
+#if BIDIB_FLOW_CONTROL
+    _nodeFlow[slot].credits = BIDIB_FLOW_DEFAULT_CREDITS;
+    _nodeFlow[slot].in_flight = 0;
+    _nodeFlow[slot].flow_stamp = 0;
+    _nodeFlow[slot].window_asked = false;
+#endif
+    if (slot < BIDIB_SEQUENCE_NODES) {
+        _nodeSequence[slot].tx_num = 0;
+        _nodeSequence[slot].rx_num = 0;
+        _nodeSequence[slot].rx_lost = 0;
+        _nodeSequence[slot].rx_duplicates = 0;
+    }
+
+#if BIDIB_NODE_INDEX
+    uint16_t bucket = hashUniqueId(unique_id);
+    while (_nodeUidIndex[bucket] != 0) { bucket = (bucket + 1) & (BIDIB_NODE_INDEX_SIZE - 1); }
+    _nodeUidIndex[bucket] = (NodeSlot)(slot + 1);
+
+    bucket = hashAddress(packAddress(address));
+    while (_nodeAddrIndex[bucket] != 0) { bucket = (bucket + 1) & (BIDIB_NODE_INDEX_SIZE - 1); }
+    _nodeAddrIndex[bucket] = (NodeSlot)(slot + 1);
+#endif
+    return slot;
+}
+
+int BiDiB::findNode(const uint8_t* unique_id) {
+#if BIDIB_NODE_INDEX
+    for (uint16_t bucket = hashUniqueId(unique_id); _nodeUidIndex[bucket] != 0;
+         bucket = (bucket + 1) & (BIDIB_NODE_INDEX_SIZE - 1)) {
+        uint16_t slot = _nodeUidIndex[bucket] - 1;
+        if (memcmp(_node_table[slot].unique_id, unique_id, 7) == 0) {
+            return slot; // Node found at this slot
+        }
+    }
+#else
+    for (uint16_t slot = 0; slot < _node_count; ++slot) {
+        if (memcmp(_node_table[slot].unique_id, unique_id, 7) == 0) {
+            return slot; // Node found at this slot
+        }
+    }
+#endif
     return -1; // Node not found
 }
 
-uint8_t BiDiB::calculateCrc(const uint8_t* data, size_t size) {
-    uint8_t crc = 0;
-    for (size_t i = 0; i < size; ++i) {
-        updateCrc(data[i], crc);
+int BiDiB::findNodeByAddress(const uint8_t *address) {
+    uint32_t packed = packAddress(address);
+#if BIDIB_NODE_INDEX
+    for (uint16_t bucket = hashAddress(packed); _nodeAddrIndex[bucket] != 0;
+         bucket = (bucket + 1) & (BIDIB_NODE_INDEX_SIZE - 1)) {
+        uint16_t slot = _nodeAddrIndex[bucket] - 1;
+        if (packAddress(_node_table[slot].address) == packed) {
+            return slot;
+        }
     }
-    return crc;
+#else
+    for (uint16_t slot = 0; slot < _node_count; ++slot) {
+        if (packAddress(_node_table[slot].address) == packed) {
+            return slot;
+        }
+    }
+#endif
+    return -1;
+}
+
+int BiDiB::addNode(const uint8_t *unique_id, const uint8_t *address) {
+    if (_node_count >= BIDIB_MAX_NODES) { return -1; }
+    if (findNode(unique_id) != -1 || findNodeByAddress(address) != -1) { return -1; }
+    return insertNode(unique_id, address);
+}
+
+uint16_t BiDiB::getNodeCount() const {
+    return _node_count;
+}
+
+const BiDiBNode *BiDiB::getNode(uint16_t index) const {
+    return index < _node_count ? &_node_table[index] : nullptr;
+}
+
+// =============================================================================
+// Request Correlation
+// =============================================================================
+
+bool BiDiB::sendRequest(const BiDiBMessage &msg, uint8_t reply_type, RequestCallback callback, void *context) {
+    if (callback == nullptr) {
+        sendMessage(msg);
+        return true;
+    }
+    if (_requestCount >= BIDIB_MAX_PENDING_REQUESTS) { return false; }
+
+    PendingRequest &request = _requests[_requestCount++];
+    request.address = packAddress(msg.address);
+    request.deadline = millis() + _requestTimeout;
+    request.callback = callback;
+    request.context = context;
+    request.msg_num = msg.msg_num;
+    request.reply_type = reply_type;
+    request.held = false;
+
+#if BIDIB_FLOW_CONTROL
+    // If flow control holds the request back, the timeout starts when it is sent.
+    uint8_t held = _flowHeldCount;
+    sendMessage(msg);
+    if (_flowHeldCount > held) {
+        _flowHeldTracked[_flowHeldCount - 1] = true;
+        request.held = true;
+    }
+#else
+    sendMessage(msg);
+#endif
+    return true;
+}
+
+void BiDiB::setRequestTimeout(uint16_t timeout) {
+    _requestTimeout = timeout;
+}
+
+uint8_t BiDiB::getPendingRequestCount() {
+    return _requestCount;
+}
+
+/// @brief Returns true if a message of type actual answers a request that expects type expected.
+static bool answersRequest(uint8_t expected, uint8_t actual) {
+    return actual == expected
+        || (expected == MSG_FEATURE && actual == MSG_FEATURE_NA)
+        || (expected == MSG_NODETAB && actual == MSG_NODE_NA);
+}
+
+void BiDiB::completeRequest(const BiDiBMessage &msg) {
+    uint32_t address = packAddress(msg.address);
+    int match = -1;
+    for (uint8_t i = 0; i < _requestCount; ++i) {
+        const PendingRequest &request = _requests[i];
+        if (request.held || request.address != address || !answersRequest(request.reply_type, msg.msg_type)) { continue; }
+        if (match < 0) { match = i; }
+        // With sequencing, the answer carries the node's own number, so only the order counts.
+        if (!_sequencing && msg.msg_num != 0 && request.msg_num == msg.msg_num) {
+            match = i;
+            break;
+        }
+    }
+    if (match < 0) { return; }
+
+    // The callback may send the next request, so the entry is removed first.
+    RequestCallback callback = _requests[match].callback;
+    void *context = _requests[match].context;
+    removeRequest(match);
+    callback(context, &msg);
+}
+
+void BiDiB::expireRequests(unsigned long now) {
+    uint8_t i = 0;
+    while (i < _requestCount) {
+        const PendingRequest &request = _requests[i];
+        if (request.held || (long)(now - request.deadline) < 0) {
+            i++;
+            continue;
+        }
+        // Requests sent from the callback are appended behind the ones still to check.
+        RequestCallback callback = request.callback;
+        void *context = request.context;
+        removeRequest(i);
+        callback(context, nullptr);
+    }
+}
+
+void BiDiB::removeRequest(uint8_t index) {
+    for (uint8_t i = index + 1; i < _requestCount; ++i) { _requests[i - 1] = _requests[i]; }
+    _requestCount--;
+}
+
+void BiDiB::releaseRequest(const BiDiBMessage &msg) {
+    // Held requests to a node are sent in order, so the oldest held entry is the one.
+    uint32_t address = packAddress(msg.address);
+    for (uint8_t i = 0; i < _requestCount; ++i) {
+        PendingRequest &request = _requests[i];
+        if (request.held && request.address == address) {
+            request.held = false;
+            request.deadline = millis() + _requestTimeout;
+            return;
+        }
+    }
+}
+
+// =============================================================================
+// MSG_NUM Sequencing
+// =============================================================================
+
+void BiDiB::setSequencing(bool enabled) {
+    for (uint16_t i = 0; i < _node_count && i < BIDIB_SEQUENCE_NODES; ++i) {
+        _nodeSequence[i].tx_num = 0;
+        _nodeSequence[i].rx_num = 0;
+    }
+    _sequencing = enabled;
+}
+
+bool BiDiB::getSequenceStats(const uint8_t *address, uint16_t &lost, uint16_t &duplicates) {
+    int slot = findNodeByAddress(address);
+    if (slot < 0 || slot >= BIDIB_SEQUENCE_NODES) { return false; }
+    lost = _nodeSequence[slot].rx_lost;
+    duplicates = _nodeSequence[slot].rx_duplicates;
+    return true;
+}
+
+uint16_t BiDiB::getRxLostCount() {
+    return _rxLost;
+}
+
+uint16_t BiDiB::getRxDuplicateCount() {
+    return _rxDuplicates;
+}
+
+bool BiDiB::checkRxSequence(const BiDiBMessage &msg) {
+    int slot = findNodeByAddress(msg.address);
+    if (slot < 0 || slot >= BIDIB_SEQUENCE_NODES) { return true; }
+    NodeSequenceState &node = _nodeSequence[slot];
+
+    // 0 means the sender does not number this message; the next number starts a new sequence.
+    uint8_t num = msg.msg_num;
+    if (num == 0) {
+        node.rx_num = 0;
+        return true;
+    }
+    if (node.rx_num == 0) {
+        node.rx_num = num;
+        return true;
+    }
+    if (num == node.rx_num) {
+        // The sender never reuses a number before 254 others, so this is the same message again.
+        node.rx_duplicates++;
+        _rxDuplicates++;
+        return false;
+    }
+
+    // Numbers run 1..255, so the distance is taken modulo 255.
+    uint8_t expected = node.rx_num == 255 ? 1 : node.rx_num + 1;
+    node.rx_num = num;
+    if (num == expected) { return true; }
+    uint8_t missing = (uint8_t)((num + 255 - expected) % 255);
+    node.rx_lost += missing;
+    _rxLost += missing;
+
+    // Mirrors come from the interface. If one was among its lost messages, waiting for the
+    // Secure-ACK timeout is pointless, so the pending reports go out once more, at most once per
+    // timeout. That is not a retry: it neither uses one up nor restarts the timeout.
+    if (msg.address[0] == 0 && _pendingSecureAckCount > 0) {
+        uint16_t now = (uint16_t)millis();
+        if (!_secureAckNudged || (uint16_t)(now - _secureAckNudgeStamp) >= _secureAckTimeout) {
+            _secureAckNudged = true;
+            _secureAckNudgeStamp = now;
+            for (uint8_t i = 0; i < _pendingSecureAckCount; ++i) {
+                BiDiBMessage report;
+                decodeMessage(&_secureAckArena[_pendingSecureAcks[i].offset], report);
+                _pendingSecureAcks[i].measurable = false;
+                _secureAckRetransmits++;
+                sendMessage(report);
+            }
+        }
+    }
+    return true;
+}
+
+// =============================================================================
+// Flow Control
+// =============================================================================
+
+#if BIDIB_FLOW_CONTROL
+/// @brief Returns true for the requests a node answers, i.e. the ones that occupy its receive buffer.
+static bool isFlowRequest(uint8_t type) {
+    switch (type) {
+        case MSG_SYS_GET_MAGIC:
+        case MSG_SYS_GET_P_VERSION:
+        case MSG_SYS_GET_UNIQUE_ID:
+        case MSG_NODETAB_GETALL:
+        case MSG_NODETAB_GETNEXT:
+        case MSG_FEATURE_GETALL:
+        case MSG_FEATURE_GETNEXT:
+        case MSG_FEATURE_GET:
+        case MSG_FEATURE_SET:
+        case MSG_VENDOR_ENABLE:
+        case MSG_VENDOR_DISABLE:
+        case MSG_VENDOR_SET:
+        case MSG_VENDOR_GET:
+        case MSG_BOOST_QUERY:
+        case MSG_ACCESSORY_SET:
+        case MSG_ACCESSORY_GET:
+        case MSG_FW_UPDATE_OP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// @brief Returns true for the messages that answer one of the requests above.
+static bool isFlowAnswer(uint8_t type) {
+    switch (type) {
+        case MSG_SYS_MAGIC:
+        case MSG_SYS_P_VERSION:
+        case MSG_SYS_UNIQUE_ID:
+        case MSG_NODETAB_COUNT:
+        case MSG_NODETAB:
+        case MSG_NODE_NA:
+        case MSG_FEATURE_COUNT:
+        case MSG_FEATURE:
+        case MSG_FEATURE_NA:
+        case MSG_VENDOR_ACK:
+        case MSG_VENDOR:
+        case MSG_BOOST_STAT:
+        case MSG_ACCESSORY_STATE:
+        case MSG_FW_UPDATE_STAT:
+            return true;
+        default:
+            return false;
+    }
+}
+#endif
+
+void BiDiB::queryFeature(uint8_t node_addr, uint8_t feature_num) {
+    queryFeature(node_addr, feature_num, nullptr);
+}
+
+bool BiDiB::queryFeature(uint8_t node_addr, uint8_t feature_num, RequestCallback callback, void *context) {
+    BiDiBMessage msg;
+    msg.address[0] = node_addr;
+    msg.address[1] = 0;
+    msg.length = (node_addr == 0) ? 4 : 5;
+    msg.msg_num = 0;
+    msg.msg_type = MSG_FEATURE_GET;
+    msg.data[0] = feature_num;
+    return sendRequest(msg, MSG_FEATURE, callback, context);
+}
+
+void BiDiB::setFlowControl(bool enabled) {
+#if BIDIB_FLOW_CONTROL
+    // Nothing that was accepted gets lost; the accounting starts over either way.
+    for (uint8_t i = 0; i < _flowHeldCount; ++i) {
+        if (_flowHeldTracked[i]) { releaseRequest(_flowHeld[i]); }
+        writeMessage(_flowHeld[i]);
+    }
+    _flowHeldCount = 0;
+    for (uint16_t i = 0; i < _node_count; ++i) { _nodeFlow[i].in_flight = 0; }
+    _flowInFlight = 0;
+    _flowControl = enabled;
+#else
+    (void)enabled;
+#endif
+}
+
+uint8_t BiDiB::getFlowHeldCount() {
+    return _flowHeldCount;
+}
+
+uint16_t BiDiB::getFlowTimeoutCount() {
+    return _flowTimeouts;
+}
+
+#if BIDIB_FLOW_CONTROL
+bool BiDiB::admitFlowRequest(const BiDiBMessage &msg) {
+    if (!isFlowRequest(msg.msg_type)) { return true; }
+    int slot = findNodeByAddress(msg.address);
+    if (slot < 0) { return true; }
+
+    // Requests to a node keep their order, so nothing overtakes a held one.
+    NodeFlowState &node = _nodeFlow[slot];
+    if (msg.msg_type == MSG_FEATURE_GET && msg.data[0] == BIDIB_FEATURE_MSG_RECEIVE_COUNT) { node.window_asked = true; }
+    bool waiting = false;
+    for (uint8_t i = 0; i < _flowHeldCount && !waiting; ++i) { waiting = _flowHeldNode[i] == (uint16_t)slot; }
+
+    if (waiting || node.in_flight >= node.credits) {
+        if (_flowHeldCount < BIDIB_FLOW_HOLD_SIZE) {
+            _flowHeld[_flowHeldCount] = msg;
+            _flowHeldNode[_flowHeldCount] = slot;
+            _flowHeldTracked[_flowHeldCount] = false;
+            _flowHeldCount++;
+            return false;
+        }
+        // No room to hold it back; sending beats losing the request.
+        if (node.in_flight == 255) { return true; }
+    }
+    if (node.in_flight == 0) { node.flow_stamp = (uint16_t)millis(); }
+    node.in_flight++;
+    _flowInFlight++;
+    return true;
+}
+
+void BiDiB::returnFlowCredit(const BiDiBMessage &msg) {
+    if (!isFlowAnswer(msg.msg_type)) { return; }
+    int slot = findNodeByAddress(msg.address);
+    if (slot < 0) { return; }
+
+    NodeFlowState &node = _nodeFlow[slot];
+    // Feature 2 is FEATURE_BM_SECACK_AVAILABLE on occupancy nodes, so the window is only taken from
+    // the answer to a query of it sent from here.
+    if (msg.msg_type == MSG_FEATURE && msg.data[0] == BIDIB_FEATURE_MSG_RECEIVE_COUNT && node.window_asked) {
+        node.credits = msg.data[1] > 0 ? msg.data[1] : 1;
+        node.window_asked = false;
+    }
+    if (node.in_flight > 0) {
+        node.in_flight--;
+        _flowInFlight--;
+        node.flow_stamp = (uint16_t)millis();
+    }
+    releaseFlowRequests(slot);
+}
+
+void BiDiB::releaseFlowRequests(uint16_t slot) {
+    NodeFlowState &node = _nodeFlow[slot];
+    uint8_t i = 0;
+    while (i < _flowHeldCount && node.in_flight < node.credits) {
+        if (_flowHeldNode[i] != slot) {
+            i++;
+            continue;
+        }
+        BiDiBMessage msg = _flowHeld[i];
+        bool tracked = _flowHeldTracked[i];
+        for (uint8_t j = i + 1; j < _flowHeldCount; ++j) {
+            _flowHeld[j - 1] = _flowHeld[j];
+            _flowHeldNode[j - 1] = _flowHeldNode[j];
+            _flowHeldTracked[j - 1] = _flowHeldTracked[j];
+        }
+        _flowHeldCount--;
+        if (tracked) { releaseRequest(msg); }
+
+        if (node.in_flight == 0) { node.flow_stamp = (uint16_t)millis(); }
+        node.in_flight++;
+        _flowInFlight++;
+        writeMessage(msg);
+    }
+}
+
+void BiDiB::expireFlowRequests() {
+    uint16_t now = (uint16_t)millis();
+    for (uint16_t slot = 0; slot < _node_count && _flowInFlight > 0; ++slot) {
+        NodeFlowState &node = _nodeFlow[slot];
+        if (node.in_flight == 0 || (uint16_t)(now - node.flow_stamp) < BIDIB_FLOW_TIMEOUT) { continue; }
+        // The answers are not coming any more; the node has forgotten these requests.
+        _flowInFlight -= node.in_flight;
+        node.in_flight = 0;
+        _flowTimeouts++;
+        releaseFlowRequests(slot);
+    }
+}
+#endif
+
+uint8_t BiDiB::calculateCrc(const uint8_t* data, size_t size) {
+    return crc8_update(0, data, size);
 }
 
 void BiDiB::updateCrc(uint8_t byte, uint8_t &crc) {
-    crc = crc8_table[crc ^ byte];
+    crc = crc8_update(crc, byte);
 }
 
-void BiDiB::sendByte(uint8_t byte, uint8_t &crc) {
-    updateCrc(byte, crc);
+void BiDiB::sendByte(uint8_t byte) {
     if (byte == BIDIB_MAGIC || byte == BIDIB_ESCAPE) {
         bidib_serial->write(BIDIB_ESCAPE);
         bidib_serial->write(byte ^ 0x20);
@@ -852,80 +2229,560 @@ void BiDiB::sendByte(uint8_t byte, uint8_t &crc) {
     }
 }
 
-void BiDiB::sendMessage(const BiDiBMessage& msg) {
-    uint8_t crc = 0;
-
-    bidib_serial->write(BIDIB_MAGIC);
+uint8_t BiDiB::encodeMessage(const BiDiBMessage &msg, uint8_t *buffer) {
+    uint8_t pos = 0;
+    buffer[pos++] = msg.length;
 
-    // Send length, address, message number, and type
-    sendByte(msg.length, crc);
+    // Copy length, address, message number, and type
     uint8_t addr_len = 0;
-    for (int i = 0; i < 4; i++) {
+    for (int i = 0; i < BIDIB_MAX_ADDRESS_LENGTH; i++) {
+        buffer[pos++] = msg.address[i];
         addr_len++;
         if (msg.address[i] == 0) break;
     }
-    for (int i = 0; i < addr_len; ++i) { sendByte(msg.address[i], crc); }
-    sendByte(msg.msg_num, crc);
-    sendByte(msg.msg_type, crc);
+    buffer[pos++] = msg.msg_num;
+    buffer[pos++] = msg.msg_type;
 
-    // Send data payload
+    // Copy data payload
     uint8_t data_len = msg.length - addr_len - 2;
-    for (int i = 0; i < data_len; ++i) { sendByte(msg.data[i], crc); }
+    memcpy(&buffer[pos], msg.data, data_len);
+    return pos + data_len;
+}
+
+void BiDiB::decodeMessage(const uint8_t *buffer, BiDiBMessage &msg) {
+    uint8_t pos = 0;
+    msg.length = buffer[pos++];
+
+    uint8_t addr_len = 0;
+    for (int i = 0; i < BIDIB_MAX_ADDRESS_LENGTH; i++) {
+        msg.address[i] = buffer[pos++];
+        addr_len++;
+        if (msg.address[i] == 0) break;
+    }
+    msg.msg_num = buffer[pos++];
+    msg.msg_type = buffer[pos++];
+    memcpy(msg.data, &buffer[pos], msg.length - addr_len - 2);
+}
+
+void BiDiB::sendMessage(const BiDiBMessage& msg) {
+#if BIDIB_FLOW_CONTROL
+    if (_flowControl && !admitFlowRequest(msg)) { return; }
+#endif
+    writeMessage(msg);
+}
+
+void BiDiB::writeMessage(const BiDiBMessage &msg) {
+    // A message that claims more than a BiDiBMessage can hold cannot be serialized.
+    if (msg.length > BIDIB_MAX_MESSAGE_LENGTH) { return; }
+
+    // Start a new packet if this message does not fit behind the ones already collected.
+    if (_txLength + msg.length + 1 > BIDIB_TX_BATCH_SIZE) { flushTxBatch(); }
+    uint8_t start = _txLength;
+    _txLength += encodeMessage(msg, &_txBuffer[start]);
+
+    if (_sequencing) {
+        // MSG_NUM follows the address stack and its terminator. Nodes outside the table (or beyond
+        // BIDIB_SEQUENCE_NODES) get 0, which tells them not to check.
+        int slot = findNodeByAddress(msg.address);
+        uint8_t num = 0;
+        if (slot >= 0 && slot < BIDIB_SEQUENCE_NODES) {
+            NodeSequenceState &node = _nodeSequence[slot];
+            node.tx_num = node.tx_num == 255 ? 1 : node.tx_num + 1;
+            num = node.tx_num;
+            _txSequenced = true;
+        }
+        uint8_t pos = start + 1;
+        while (pos - start - 1 < BIDIB_MAX_ADDRESS_LENGTH && _txBuffer[pos++] != 0) {}
+        _txBuffer[pos] = num;
+    }
+
+    // A packet is queued with the class of its most urgent message.
+    uint8_t priority = txPriority(msg);
+    if (priority < _txClass) { _txClass = priority; }
+
+    if (!_txBatching) { flushTxBatch(); }
+}
+
+uint8_t BiDiB::txPriority(const BiDiBMessage &msg) {
+    switch (msg.msg_type) {
+        case MSG_SYS_GET_MAGIC:
+        case MSG_SYS_GET_P_VERSION:
+        case MSG_SYS_GET_UNIQUE_ID:
+        case MSG_SYS_ENABLE:
+        case MSG_SYS_DISABLE:
+        case MSG_SYS_MAGIC:
+        case MSG_SYS_P_VERSION:
+        case MSG_SYS_UNIQUE_ID:
+        case MSG_LOGON:
+        case MSG_LOGON_ACK:
+        case MSG_NODE_NA:
+        case MSG_NODE_NEW:
+        case MSG_NODE_LOST:
+        case MSG_CS_SET_STATE:
+        case MSG_CS_STATE:
+        case MSG_BOOST_ON:
+        case MSG_BOOST_OFF:
+        case MSG_BOOST_STAT:
+            return BIDIB_TX_PRIORITY_SYSTEM;
+        case MSG_CS_DRIVE:
+            // An emergency stop of a single loco is as urgent as stopping the track.
+            return (msg.data[3] & 0x7F) == 1 ? BIDIB_TX_PRIORITY_SYSTEM : BIDIB_TX_PRIORITY_REALTIME;
+        case MSG_NODETAB_GETALL:
+        case MSG_NODETAB_GETNEXT:
+        case MSG_NODETAB_COUNT:
+        case MSG_NODETAB:
+        case MSG_FEATURE_GETALL:
+        case MSG_FEATURE_GETNEXT:
+        case MSG_FEATURE_GET:
+        case MSG_FEATURE_SET:
+        case MSG_FEATURE_COUNT:
+        case MSG_FEATURE:
+        case MSG_FEATURE_NA:
+        case MSG_VENDOR_ENABLE:
+        case MSG_VENDOR_DISABLE:
+        case MSG_VENDOR_SET:
+        case MSG_VENDOR_GET:
+        case MSG_VENDOR:
+        case MSG_VENDOR_ACK:
+        case MSG_FW_UPDATE_OP:
+        case MSG_FW_UPDATE_STAT:
+            return BIDIB_TX_PRIORITY_BULK;
+        default:
+            return BIDIB_TX_PRIORITY_REALTIME;
+    }
+}
+
+void BiDiB::setTxBatching(bool enabled) {
+    _txBatching = enabled;
+    if (!enabled) { flushTxBatch(); }
+}
+
+void BiDiB::flushTxBatch() {
+    if (_txLength == 0) { return; }
+
+    uint8_t crc = calculateCrc(_txBuffer, _txLength);
+#if BIDIB_TX_QUEUE_SIZE > 0
+    if (_txQueueing) {
+        if (!queueTxPacket(crc)) { _txDropCount++; }
+        _txLength = 0;
+        _txClass = BIDIB_TX_PRIORITY_BULK;
+        _txSequenced = false;
+        drainTxQueue();
+        return;
+    }
+#endif
+    writeTxPacket(crc);
+    _txLength = 0;
+    _txClass = BIDIB_TX_PRIORITY_BULK;
+    _txSequenced = false;
+}
 
-    // Send the calculated CRC
+void BiDiB::writeTxPacket(uint8_t crc) {
+#if BIDIB_TX_SCRATCH_SIZE > 0
+    // Frame and escape the packet into the scratch buffer and hand it to the stream in bulk.
+    // Runs of bytes that need no escaping are copied as a block; the closing CRC and MAGIC
+    // need at most three bytes.
+    uint16_t n = 0;
+    _txFrame[n++] = BIDIB_MAGIC;
+    uint8_t i = 0;
+    while (i < _txLength) {
+        uint16_t run = bidib_escape_scan(&_txBuffer[i], _txLength - i);
+        while (run > 0) {
+            if (n == BIDIB_TX_SCRATCH_SIZE) {
+                bidib_serial->write(_txFrame, n);
+                n = 0;
+            }
+            uint16_t chunk = BIDIB_TX_SCRATCH_SIZE - n;
+            if (chunk > run) { chunk = run; }
+            memcpy(&_txFrame[n], &_txBuffer[i], chunk);
+            n += chunk;
+            i += chunk;
+            run -= chunk;
+        }
+        if (i < _txLength) {
+            if (n + 2 > BIDIB_TX_SCRATCH_SIZE) {
+                bidib_serial->write(_txFrame, n);
+                n = 0;
+            }
+            _txFrame[n++] = BIDIB_ESCAPE;
+            _txFrame[n++] = _txBuffer[i++] ^ 0x20;
+        }
+    }
+    if (n + 3 > BIDIB_TX_SCRATCH_SIZE) {
+        bidib_serial->write(_txFrame, n);
+        n = 0;
+    }
     if (crc == BIDIB_MAGIC || crc == BIDIB_ESCAPE) {
-        bidib_serial->write(BIDIB_ESCAPE);
-        bidib_serial->write(crc ^ 0x20);
+        _txFrame[n++] = BIDIB_ESCAPE;
+        _txFrame[n++] = crc ^ 0x20;
     } else {
-        bidib_serial->write(crc);
+        _txFrame[n++] = crc;
+    }
+    _txFrame[n++] = BIDIB_MAGIC;
+    bidib_serial->write(_txFrame, n);
+#else
+    bidib_serial->write(BIDIB_MAGIC);
+
+    // Send the MESSAGE_SEQ followed by the CRC that all of its messages share. Runs that
+    // need no escaping go to the stream straight from the packet buffer.
+    uint8_t i = 0;
+    while (i < _txLength) {
+        uint8_t run = bidib_escape_scan(&_txBuffer[i], _txLength - i);
+        if (run > 0) {
+            bidib_serial->write(&_txBuffer[i], run);
+            i += run;
+        }
+        if (i < _txLength) { sendByte(_txBuffer[i++]); }
     }
+    sendByte(crc);
 
     bidib_serial->write(BIDIB_MAGIC);
+#endif
 }
 
-bool BiDiB::receiveMessage(BiDiBMessage& msg) {
-    if (bidib_serial->read() != BIDIB_MAGIC) { return false; }
+#if BIDIB_TX_QUEUE_SIZE > 0
+/// @brief Gets where the ring of a priority class starts in _txQueue.
+static inline uint16_t txQueueOffset(uint8_t priority) {
+    return priority == BIDIB_TX_PRIORITY_SYSTEM ? 0
+         : priority == BIDIB_TX_PRIORITY_REALTIME ? BIDIB_TX_SYSTEM_QUEUE_SIZE
+         : BIDIB_TX_SYSTEM_QUEUE_SIZE + BIDIB_TX_QUEUE_SIZE;
+}
+
+/// @brief Gets the size of the ring of a priority class.
+static inline uint16_t txQueueCapacity(uint8_t priority) {
+    return priority == BIDIB_TX_PRIORITY_SYSTEM ? BIDIB_TX_SYSTEM_QUEUE_SIZE
+         : priority == BIDIB_TX_PRIORITY_REALTIME ? BIDIB_TX_QUEUE_SIZE
+         : BIDIB_TX_BULK_QUEUE_SIZE;
+}
+#endif
 
-    uint8_t crc = 0;
+/// @brief Gets the ring a priority class is queued in: its own, or the realtime ring if its own is left out.
+static inline uint8_t txQueueRing(uint8_t priority) {
+    return (priority == BIDIB_TX_PRIORITY_SYSTEM && BIDIB_TX_SYSTEM_QUEUE_SIZE == 0) ||
+           (priority == BIDIB_TX_PRIORITY_BULK && BIDIB_TX_BULK_QUEUE_SIZE == 0) ? BIDIB_TX_PRIORITY_REALTIME : priority;
+}
 
-    // Helper lambda to read a byte from the serial stream and handle escaping.
-    auto readContentByte = [&]() {
-        uint8_t byte = bidib_serial->read();
-        if (byte == BIDIB_ESCAPE) { byte = bidib_serial->read() ^ 0x20; }
-        return byte;
+bool BiDiB::queueTxPacket(uint8_t crc) {
+#if BIDIB_TX_QUEUE_SIZE > 0
+    // The rings drain out of order, so numbered packets all take the realtime ring to keep MSG_NUM in sequence.
+    uint8_t priority = txQueueRing(_txSequenced ? BIDIB_TX_PRIORITY_REALTIME : _txClass);
+    uint8_t *ring = &_txQueue[txQueueOffset(priority)];
+    uint16_t capacity = txQueueCapacity(priority);
+
+    // Work out the size on the wire first; a packet is queued completely or not at all.
+    uint16_t size = 2 + _txLength + bidib_escape_count(_txBuffer, _txLength);
+    bool escape_crc = bidib_needs_escape(crc);
+    size += escape_crc ? 2 : 1;
+    if (size > capacity - _txQueueFill[priority]) { return false; }
+
+    uint16_t tail = (_txQueueHead[priority] + _txQueueFill[priority]) % capacity;
+    auto put = [&](uint8_t byte) {
+        ring[tail] = byte;
+        if (++tail == capacity) { tail = 0; }
+    };
+    // Copies a run that needs no escaping, in two pieces if it wraps around the ring.
+    auto putRun = [&](const uint8_t *data, uint16_t length) {
+        uint16_t first = capacity - tail;
+        if (first > length) { first = length; }
+        memcpy(&ring[tail], data, first);
+        memcpy(&ring[0], data + first, length - first);
+        tail = (tail + length) % capacity;
     };
 
-    msg.length = readContentByte();
-    updateCrc(msg.length, crc);
+    put(BIDIB_MAGIC);
+    uint8_t i = 0;
+    while (i < _txLength) {
+        uint8_t run = bidib_escape_scan(&_txBuffer[i], _txLength - i);
+        putRun(&_txBuffer[i], run);
+        i += run;
+        if (i < _txLength) {
+            put(BIDIB_ESCAPE);
+            put(_txBuffer[i++] ^ 0x20);
+        }
+    }
+    if (escape_crc) {
+        put(BIDIB_ESCAPE);
+        put(crc ^ 0x20);
+    } else {
+        put(crc);
+    }
+    put(BIDIB_MAGIC);
+
+    _txQueueFill[priority] += size;
+    _txQueueCount += size;
+    if (_txQueueCount > _txQueueHighWater) { _txQueueHighWater = _txQueueCount; }
+    return true;
+#else
+    (void)crc;
+    return false;
+#endif
+}
 
-    // Read address, message number, and type
-    uint8_t addr_len = 0;
-    for (int i = 0; i < 4; ++i) {
-        msg.address[i] = readContentByte();
-        updateCrc(msg.address[i], crc);
-        addr_len++;
-        if (msg.address[i] == 0) break;
+uint16_t BiDiB::writeTxQueue(uint16_t room) {
+    uint16_t total = 0;
+#if BIDIB_TX_QUEUE_SIZE > 0
+    while (room > 0 && _txQueueCount > 0) {
+        if (_txPacketLeft == 0) {
+            // Between packets: the most urgent class goes next, except that waiting bulk packets
+            // get every BIDIB_TX_BULK_SHARE-th turn so they cannot starve.
+            uint8_t next = BIDIB_TX_PRIORITY_SYSTEM;
+            while (_txQueueFill[next] == 0) { next++; }
+            if (_txQueueFill[BIDIB_TX_PRIORITY_BULK] > 0 && next != BIDIB_TX_PRIORITY_BULK) {
+                if (_txBulkSkips >= BIDIB_TX_BULK_SHARE) {
+                    next = BIDIB_TX_PRIORITY_BULK;
+                } else {
+                    _txBulkSkips++;
+                }
+            }
+            if (next == BIDIB_TX_PRIORITY_BULK) { _txBulkSkips = 0; }
+
+            // The packet runs up to the MAGIC that closes it; escaping keeps MAGIC out of the content.
+            const uint8_t *ring = &_txQueue[txQueueOffset(next)];
+            uint16_t capacity = txQueueCapacity(next);
+            uint16_t pos = _txQueueHead[next];
+            uint16_t length = 1;
+            do {
+                if (++pos == capacity) { pos = 0; }
+                length++;
+            } while (ring[pos] != BIDIB_MAGIC && length < _txQueueFill[next]);
+            _txPacketClass = next;
+            _txPacketLeft = length;
+        }
+
+        // Write the contiguous part up to the end of the ring, bounded by the packet and the free room.
+        uint8_t priority = _txPacketClass;
+        uint16_t capacity = txQueueCapacity(priority);
+        uint16_t head = _txQueueHead[priority];
+        uint16_t chunk = capacity - head;
+        if (chunk > _txPacketLeft) { chunk = _txPacketLeft; }
+        if (chunk > room) { chunk = room; }
+
+        size_t written = bidib_serial->write(&_txQueue[txQueueOffset(priority) + head], chunk);
+        if (written == 0) { break; }
+        _txQueueHead[priority] = (head + written) % capacity;
+        _txQueueFill[priority] -= written;
+        _txQueueCount -= written;
+        _txPacketLeft -= written;
+        room -= written;
+        total += written;
     }
-    msg.msg_num = readContentByte();
-    updateCrc(msg.msg_num, crc);
-    msg.msg_type = readContentByte();
-    updateCrc(msg.msg_type, crc);
+#else
+    (void)room;
+#endif
+    return total;
+}
 
-    // Read data payload
-    uint8_t data_len = msg.length - addr_len - 2;
-    for (int i = 0; i < data_len; ++i) {
-        msg.data[i] = readContentByte();
-        updateCrc(msg.data[i], crc);
+void BiDiB::drainTxQueue() {
+    if (_txQueueCount == 0) { return; }
+
+    int room = bidib_serial->availableForWrite();
+    if (room > 0) { writeTxQueue(room > 0xFFFF ? 0xFFFF : (uint16_t)room); }
+}
+
+void BiDiB::setTxQueueing(bool enabled) {
+    // Packets already collected keep the order they were sent in.
+    flushTxBatch();
+    _txQueueing = enabled;
+
+    if (!enabled) {
+        // Write out whatever is still queued, blocking if necessary.
+        while (_txQueueCount > 0 && writeTxQueue(_txQueueCount) > 0) {}
     }
+}
+
+uint16_t BiDiB::getTxQueueCount() {
+    return _txQueueCount;
+}
+
+uint16_t BiDiB::getTxQueueCount(uint8_t priority) {
+    return priority < BIDIB_TX_PRIORITIES ? _txQueueFill[txQueueRing(priority)] : 0;
+}
 
-    // Read and verify the CRC
-    uint8_t received_crc = bidib_serial->read();
-    if (received_crc == BIDIB_ESCAPE) { received_crc = bidib_serial->read() ^ 0x20; }
-    updateCrc(received_crc, crc); // The CRC of the full message (including CRC byte) must be 0
+uint16_t BiDiB::getTxQueueHighWater() {
+    return _txQueueHighWater;
+}
 
-    if (bidib_serial->read() != BIDIB_MAGIC) { return false; }
+uint16_t BiDiB::getTxDropCount() {
+    return _txDropCount;
+}
 
-    return crc == 0;
+bool BiDiB::queueMessage(const BiDiBMessage &msg) {
+    if (_rxQueueCount >= BIDIB_RX_QUEUE_SIZE) {
+        _rxOverflowCount++;
+        return false;
+    }
+    _rxQueue[(_rxQueueHead + _rxQueueCount) % BIDIB_RX_QUEUE_SIZE] = msg;
+    _rxQueueCount++;
+    return true;
+}
+
+void BiDiB::receiveMessages() {
+    // Pull what is available into a local chunk, so that runs without MAGIC or ESCAPE can be
+    // checked and stored as a block instead of byte by byte.
+    uint8_t chunk[BIDIB_RX_CHUNK_SIZE];
+    int available;
+    while ((available = bidib_serial->available()) > 0) {
+        uint8_t count = 0;
+        while (count < BIDIB_RX_CHUNK_SIZE && count < available) {
+            int c = bidib_serial->read();
+            if (c < 0) { break; }
+            chunk[count++] = (uint8_t)c;
+        }
+        if (count == 0) { break; }
+        receiveBytes(chunk, count);
+    }
+}
+
+void BiDiB::receiveBytes(const uint8_t *data, uint8_t size) {
+    uint8_t i = 0;
+    while (i < size) {
+        uint8_t byte = data[i];
+
+        if (byte == BIDIB_MAGIC) {
+            // A MAGIC always closes the current packet and opens the next one.
+            if (_rxState == RX_END && _rxCrc == 0) {
+                // The messages were decoded in place; publishing them only takes a count update.
+                _rxQueueCount += _rxPending;
+                _rxOverflowCount += _rxDropped;
+            }
+            _rxPending = 0;
+            _rxDropped = 0;
+            _rxState = RX_LENGTH;
+            _rxCrc = 0;
+            _rxEscaped = false;
+            i++;
+            continue;
+        }
+
+        if (_rxState == RX_WAIT_MAGIC) {
+            i++;
+            continue;
+        }
+
+        if (byte == BIDIB_ESCAPE) {
+            _rxEscaped = true;
+            i++;
+            continue;
+        }
+
+        // The CRC of the full packet (including the CRC byte) must be 0.
+        if (_rxEscaped) {
+            byte ^= 0x20;
+            _rxEscaped = false;
+            updateCrc(byte, _rxCrc);
+            parseContentByte(byte);
+            i++;
+            continue;
+        }
+
+        // Everything up to the next MAGIC or ESCAPE is plain content.
+        uint8_t run = bidib_escape_scan(&data[i], size - i);
+        _rxCrc = crc8_update(_rxCrc, &data[i], run);
+        parseContentRun(&data[i], run);
+        i += run;
+    }
+}
+
+void BiDiB::parseContentRun(const uint8_t *data, uint8_t size) {
+    while (size > 0) {
+        if (_rxState == RX_WAIT_MAGIC) { return; }
+
+        // Payload bytes before the last one only need storing; the last one completes the
+        // message and goes through the state machine.
+        if (_rxState == RX_DATA && _rxDataLength - _rxIndex > 1) {
+            uint8_t n = _rxDataLength - _rxIndex - 1;
+            if (n > size) { n = size; }
+            if (_rxTarget != nullptr) { memcpy(&_rxTarget->data[_rxIndex], data, n); }
+            _rxIndex += n;
+            data += n;
+            size -= n;
+            continue;
+        }
+
+        parseContentByte(*data++);
+        size--;
+    }
+}
+
+bool BiDiB::beginRxMessage(uint8_t length) {
+    // Smallest message is a single address byte plus msg_num and msg_type.
+    if (length < 3 || length > BIDIB_MAX_MESSAGE_LENGTH) { return false; }
+
+    // Decode straight into the next free queue slot. If there is none, the message is
+    // still parsed so that it can be counted as an overflow once the CRC checks out.
+    uint8_t used = _rxQueueCount + _rxPending;
+    _rxTarget = (used < BIDIB_RX_QUEUE_SIZE)
+        ? &_rxQueue[(_rxQueueHead + used) % BIDIB_RX_QUEUE_SIZE]
+        : nullptr;
+    if (_rxTarget != nullptr) { _rxTarget->length = length; }
+    _rxLength = length;
+    _rxIndex = 0;
+    return true;
+}
+
+void BiDiB::parseContentByte(uint8_t byte) {
+    switch (_rxState) {
+        case RX_LENGTH:
+            _rxState = beginRxMessage(byte) ? RX_ADDRESS : RX_WAIT_MAGIC;
+            break;
+
+        case RX_ADDRESS:
+            if (_rxTarget != nullptr) { _rxTarget->address[_rxIndex] = byte; }
+            _rxIndex++;
+            if (byte == 0 || _rxIndex == BIDIB_MAX_ADDRESS_LENGTH) {
+                // Address stack complete; whatever is left after msg_num and msg_type is payload.
+                if (_rxLength < _rxIndex + 2 ||
+                    _rxLength - _rxIndex - 2 > BIDIB_MAX_DATA_LENGTH) {
+                    _rxState = RX_WAIT_MAGIC;
+                    break;
+                }
+                _rxDataLength = _rxLength - _rxIndex - 2;
+                _rxState = RX_MSG_NUM;
+            }
+            break;
+
+        case RX_MSG_NUM:
+            if (_rxTarget != nullptr) { _rxTarget->msg_num = byte; }
+            _rxState = RX_MSG_TYPE;
+            break;
+
+        case RX_MSG_TYPE:
+            if (_rxTarget != nullptr) { _rxTarget->msg_type = byte; }
+            _rxIndex = 0;
+            _rxState = RX_DATA;
+            if (_rxDataLength > 0) { break; }
+            // fall through - a message without payload is already complete
+        case RX_DATA:
+            if (_rxIndex < _rxDataLength) {
+                if (_rxTarget != nullptr) { _rxTarget->data[_rxIndex] = byte; }
+                _rxIndex++;
+            }
+            if (_rxIndex == _rxDataLength) {
+                if (_rxTarget != nullptr) { _rxPending++; } else { _rxDropped++; }
+                _rxState = RX_CRC_OR_LENGTH;
+            }
+            break;
+
+        case RX_CRC_OR_LENGTH:
+            // Only the next byte tells whether this one was the CRC or starts another message.
+            _rxLastByte = byte;
+            _rxState = RX_END;
+            break;
+
+        case RX_END:
+            // More content follows, so the held-back byte was MSG_LENGTH of the next message.
+            if (!beginRxMessage(_rxLastByte)) {
+                _rxState = RX_WAIT_MAGIC;
+                break;
+            }
+            _rxState = RX_ADDRESS;
+            parseContentByte(byte);
+            break;
+
+        default:
+            _rxState = RX_WAIT_MAGIC;
+            break;
+    }
 }
 
 // =============================================================================
@@ -934,42 +2791,112 @@ bool BiDiB::receiveMessage(BiDiBMessage& msg) {
 
 void BiDiB::begin(Stream &serial) {
     bidib_serial = &serial;
+
+    // Anything collected or queued for the previous stream is discarded.
+    _txLength = 0;
+    _txClass = BIDIB_TX_PRIORITY_BULK;
+    _txSequenced = false;
+    for (uint8_t i = 0; i < BIDIB_TX_PRIORITIES; i++) {
+        _txQueueHead[i] = 0;
+        _txQueueFill[i] = 0;
+    }
+    _txQueueCount = 0;
+    _txPacketLeft = 0;
+    _txPacketClass = BIDIB_TX_PRIORITY_SYSTEM;
+    _txBulkSkips = 0;
+    _txQueueHighWater = 0;
+    _txDropCount = 0;
+
+    // Drive commands held back by the scheduler were meant for the previous stream as well.
+    _driveSlotCount = 0;
+    _drivePending = 0;
+    _driveCursor = 0;
+
+    // Start with an empty queue and a clean parser; the first MAGIC on the line opens a frame.
+    _rxQueueHead = 0;
+    _rxQueueCount = 0;
+    _rxOverflowCount = 0;
+    _rxTarget = nullptr;
+    _rxState = RX_WAIT_MAGIC;
+    _rxPending = 0;
+    _rxDropped = 0;
+    _rxCrc = 0;
+    _rxEscaped = false;
+
+    // The round trip is a property of the link, so it is measured anew.
+    resetSecureAckRtt();
 }
 
 void BiDiB::update() {
-    // 1. Process incoming serial data
-    if (bidib_serial->available() > 0) {
-        if (receiveMessage(_lastMessage)) {
-            _messageAvailable = true;
+    // 1. Process incoming serial data. Complete messages are queued for handleMessages(),
+    //    partial frames are kept by the parser until the next call.
+    receiveMessages();
+
+    // 2. Take over the debounced detector inputs and report the detectors that changed since the last pass.
+    if (_debounceEnabled) {
+        unsigned long now = millis();
+        if (now - _debounceLastTick >= BIDIB_DEBOUNCE_TICK_MS) {
+            _debounceLastTick = now;
+            tickOccupancyDebounce();
         }
     }
+    flushOccupancy();
 
-    // 2. Handle timeouts for Secure-ACKs
-    if (getFeature(FEATURE_BM_SECACK_ON)) {
+    // 3. Send the drive commands that the scheduler holds back, as far as the budget allows.
+    if (_drivePending > 0) {
+        refillDriveTokens(millis());
+        drainDriveSlots();
+    }
+
+    // 4. Give the credits of requests that were never answered back, and time out the requests
+    //    that wait for an answer.
+#if BIDIB_FLOW_CONTROL
+    if (_flowControl && _flowInFlight > 0) { expireFlowRequests(); }
+#endif
+    if (_requestCount > 0) { expireRequests(millis()); }
+
+    // 5. Handle timeouts for Secure-ACKs. Only the earliest deadline is checked; overdue
+    //    messages are resent (or given up) in deadline order.
+    if (_pendingSecureAckCount > 0 && getFeature(FEATURE_BM_SECACK_ON)) {
         unsigned long now = millis();
-        for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) {
-            if (_pendingSecureAcks[i].active) {
-                if (now - _pendingSecureAcks[i].timestamp > SECURE_ACK_TIMEOUT) {
-                    if (_pendingSecureAcks[i].retries < SECURE_ACK_RETRIES) {
-                        // Resend the message
-                        _pendingSecureAcks[i].retries++;
-                        _pendingSecureAcks[i].timestamp = now;
-                        sendMessage(_pendingSecureAcks[i].message);
-                    } else {
-                        // Max retries reached, give up
-                        _pendingSecureAcks[i].active = false;
-                    }
-                }
-            }
+        while (_pendingSecureAckCount > 0) {
+            uint8_t i = _secureAckHeap[0];
+            if ((int16_t)((uint16_t)now - _pendingSecureAcks[i].deadline) <= 0) { break; }
+            resendPendingSecureAck(i, now, true);
         }
     }
+
+    // 6. Send the messages collected during this pass if TX batching is enabled,
+    //    and hand as much of the transmit queue to the stream as it accepts.
+    flushTxBatch();
+    drainTxQueue();
 }
 
 bool BiDiB::messageAvailable() {
-    return _messageAvailable;
+    return _rxQueueCount > 0;
 }
 
 BiDiBMessage BiDiB::getLastMessage() {
-    _messageAvailable = false;
-    return _lastMessage;
+    BiDiBMessage msg = _rxQueue[_rxQueueHead];
+    releaseMessage();
+    return msg;
+}
+
+BiDiBMessageView BiDiB::peekMessage() {
+    if (_rxQueueCount == 0) { return BiDiBMessageView(); }
+    return BiDiBMessageView(&_rxQueue[_rxQueueHead]);
+}
+
+void BiDiB::releaseMessage() {
+    if (_rxQueueCount == 0) { return; }
+    _rxQueueHead = (_rxQueueHead + 1) % BIDIB_RX_QUEUE_SIZE;
+    _rxQueueCount--;
+}
+
+uint8_t BiDiB::getRxQueueCount() {
+    return _rxQueueCount;
+}
+
+uint16_t BiDiB::getRxOverflowCount() {
+    return _rxOverflowCount;
 }
@@ -15,7 +15,6 @@ const uint8_t BIDIB_ESCAPE = 0xFD; ///< Escape character for MAGIC byte
 //================================================================================
 
 // --- System Messages ---
-const uint8_t BIDIB_MAX_NODES = 32;
 const uint8_t MSG_SYS_GET_MAGIC = 1;
 const uint8_t MSG_SYS_GET_P_VERSION = 2;
 const uint8_t MSG_SYS_GET_UNIQUE_ID = 3;
@@ -129,17 +128,72 @@ const uint8_t BIDIB_MSG_FW_UPDATE_STAT_ERROR = 255;  ///< Error occurred
 // BiDiB Data Structures
 //================================================================================
 
+const uint8_t BIDIB_MAX_ADDRESS_LENGTH = 4; ///< Maximum number of bytes in the address stack
+const uint8_t BIDIB_MAX_DATA_LENGTH = 64;   ///< Maximum payload size of a single message
+/// Largest MSG_LENGTH value that still fits into a BiDiBMessage (address stack + msg_num + msg_type + data).
+const uint8_t BIDIB_MAX_MESSAGE_LENGTH = BIDIB_MAX_ADDRESS_LENGTH + 2 + BIDIB_MAX_DATA_LENGTH;
+
 /// @brief Structure representing a BiDiB message.
 struct BiDiBMessage
 {
     uint8_t length;
-    uint8_t address[4];
+    uint8_t address[BIDIB_MAX_ADDRESS_LENGTH];
     uint8_t msg_num;
     uint8_t msg_type;
-    uint8_t data[64]; // Assuming a maximum data length
+    uint8_t data[BIDIB_MAX_DATA_LENGTH];
 };
 
-const uint8_t BIDIB_MAX_FEATURES = 16;
+/// @brief Read-only view of a received message that is still held in the receive queue.
+/// The view is a single pointer, so it can be passed around instead of copying the message.
+/// It stays valid until the message is released with BiDiB::releaseMessage() or begin() is called.
+class BiDiBMessageView
+{
+public:
+    BiDiBMessageView() : _msg(nullptr) {}
+    explicit BiDiBMessageView(const BiDiBMessage *msg) : _msg(msg) {}
+
+    /// @brief Checks if the view refers to a message.
+    bool valid() const { return _msg != nullptr; }
+
+    /// @brief MSG_LENGTH: the number of bytes following the length byte.
+    uint8_t length() const { return _msg->length; }
+
+    /// @brief The address stack, terminated by 0 unless all BIDIB_MAX_ADDRESS_LENGTH bytes are used.
+    const uint8_t *address() const { return _msg->address; }
+
+    /// @brief The number of address bytes including the terminating 0.
+    uint8_t addressLength() const {
+        uint8_t len = 0;
+        while (len < BIDIB_MAX_ADDRESS_LENGTH && _msg->address[len++] != 0) {}
+        return len;
+    }
+
+    uint8_t msgNum() const { return _msg->msg_num; }
+    uint8_t msgType() const { return _msg->msg_type; }
+
+    /// @brief The message payload.
+    const uint8_t *data() const { return _msg->data; }
+
+    /// @brief The number of payload bytes.
+    uint8_t dataLength() const { return _msg->length - addressLength() - 2; }
+
+    /// @brief The underlying message, for APIs that take a BiDiBMessage.
+    const BiDiBMessage &message() const { return *_msg; }
+
+private:
+    const BiDiBMessage *_msg;
+};
+
+/// Number of features the node can hold. Lookups do not depend on this (they go through a
+/// 256-bit presence map), it only bounds the compact value array; must not exceed 255.
+#ifndef BIDIB_MAX_FEATURES
+#if defined(__AVR__)
+#define BIDIB_MAX_FEATURES 16
+#else
+#define BIDIB_MAX_FEATURES 128
+#endif
+#endif
+static_assert(BIDIB_MAX_FEATURES > 0 && BIDIB_MAX_FEATURES <= 255, "BIDIB_MAX_FEATURES must be between 1 and 255");
 
 // --- Feature Constants ---
 const uint8_t BIDIB_FEATURE_FW_UPDATE_SUPPORT = 0;     ///< 1 if firmware update is supported
@@ -148,10 +202,46 @@ const uint8_t BIDIB_FEATURE_MSG_RECEIVE_COUNT = 2;     ///< How many messages ca
 const uint8_t FEATURE_BM_SECACK_AVAILABLE = 2;         ///< Indicates if Secure-ACK is supported
 const uint8_t FEATURE_BM_SECACK_ON = 3;                ///< Enables the Secure-ACK mechanism
 
+//================================================================================
+// Node Table Configuration
+//================================================================================
+
+/// Number of nodes the node table can hold, including this node. Nodes on this bus get the
+/// lowest free local address, so at most 255 of them log on directly; a host that tracks the nodes
+/// behind hubs can raise the limit (e.g. -DBIDIB_MAX_NODES=4096) and register them with addNode().
+/// An entry takes 11 bytes, so AVR keeps 16.
+#ifndef BIDIB_MAX_NODES
+#if defined(__AVR__)
+#define BIDIB_MAX_NODES 16
+#else
+#define BIDIB_MAX_NODES 256
+#endif
+#endif
+static_assert(BIDIB_MAX_NODES >= 2 && BIDIB_MAX_NODES <= 21845, "BIDIB_MAX_NODES must be between 2 and 21845");
+
+/// Set to 1 to find nodes through two hash indexes (unique ID and node address) instead of a scan
+/// of the table. Costs two buckets per node and a half; a table of 16 nodes is scanned quickly,
+/// so it is off on AVR by default.
+#ifndef BIDIB_NODE_INDEX
+#if defined(__AVR__)
+#define BIDIB_NODE_INDEX 0
+#else
+#define BIDIB_NODE_INDEX 1
+#endif
+#endif
+
+/// @brief Number of buckets of the node table hash indexes: a power of two that keeps them at most two thirds full.
+constexpr uint32_t bidib_node_index_size(uint32_t capacity, uint32_t size = 4) {
+    return size * 2 >= capacity * 3 ? size : bidib_node_index_size(capacity, size * 2);
+}
+static_assert(bidib_node_index_size(BIDIB_MAX_NODES) <= 32768, "The node table hash indexes must fit 16-bit bucket numbers");
+const uint16_t BIDIB_NODE_INDEX_SIZE = bidib_node_index_size(BIDIB_MAX_NODES);
+
 /// @brief Structure representing a node on the BiDiB bus.
 struct BiDiBNode
 {
     uint8_t unique_id[7];
+    uint8_t address[BIDIB_MAX_ADDRESS_LENGTH]; ///< Node address, terminated by 0 if shorter than 4 bytes; all 0 for this node
 };
 
 /// @brief Structure representing a feature of a BiDiB node.
@@ -161,94 +251,533 @@ struct BiDiBFeature
     uint8_t value;
 };
 
+//================================================================================
+// Event Listeners
+//================================================================================
+
+/// Number of listeners with context that each event (onOccupancy(), onDriveAck(), ...) can hold
+/// in addition to its plain callback.
+#ifndef BIDIB_MAX_LISTENERS
+#if defined(__AVR__)
+#define BIDIB_MAX_LISTENERS 1
+#else
+#define BIDIB_MAX_LISTENERS 4
+#endif
+#endif
+
+/// @brief Fan-out of one event to a plain callback and a fixed number of listeners.
+/// A listener is a function plus a context pointer, so it can reach an object without globals.
+/// Nothing is allocated; the list is bounded by BIDIB_MAX_LISTENERS.
+template <typename... Args>
+class BiDiBEvent
+{
+public:
+    typedef void (*Callback)(Args... args);                 ///< Plain callback, as set by the on*() functions
+    typedef void (*Listener)(void *context, Args... args);  ///< Listener with user context
+
+    BiDiBEvent() : _callback(nullptr), _count(0) {}
+
+    /// @brief Sets the plain callback, replacing the previous one (nullptr clears it).
+    void set(Callback callback) { _callback = callback; }
+
+    /// @brief Adds a listener; listeners run after the plain callback, in the order they were added.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool add(Listener listener, void *context) {
+        if (listener == nullptr || _count >= BIDIB_MAX_LISTENERS) { return false; }
+        _listeners[_count].listener = listener;
+        _listeners[_count].context = context;
+        _count++;
+        return true;
+    }
+
+    /// @brief Removes every listener registered with the given context.
+    void remove(void *context) {
+        uint8_t kept = 0;
+        for (uint8_t i = 0; i < _count; ++i) {
+            if (_listeners[i].context != context) { _listeners[kept++] = _listeners[i]; }
+        }
+        _count = kept;
+    }
+
+    /// @brief Checks if neither a callback nor a listener is registered.
+    bool empty() const { return _callback == nullptr && _count == 0; }
+
+    /// @brief Calls the callback and all listeners.
+    void operator()(Args... args) const {
+        if (_callback != nullptr) { _callback(args...); }
+        for (uint8_t i = 0; i < _count; ++i) { _listeners[i].listener(_listeners[i].context, args...); }
+    }
+
+private:
+    struct Entry
+    {
+        Listener listener;
+        void *context;
+    };
+
+    Callback _callback;
+    Entry _listeners[BIDIB_MAX_LISTENERS > 0 ? BIDIB_MAX_LISTENERS : 1];
+    uint8_t _count;
+};
+
 /// @brief Callback function type for drive acknowledgements.
 /// @param address The DCC address of the locomotive.
 /// @param status The acknowledgement status.
 typedef void (*DriveAckCallback)(uint16_t address, uint8_t status);
+typedef BiDiBEvent<uint16_t, uint8_t> DriveAckEvent;
 
 /// @brief Callback function type for accessory acknowledgements.
 /// @param address The DCC address of the accessory.
 /// @param status The acknowledgement status.
 typedef void (*AccessoryAckCallback)(uint16_t address, uint8_t status);
+typedef BiDiBEvent<uint16_t, uint8_t> AccessoryAckEvent;
 
 /// @brief Callback function type for PoM acknowledgements.
 /// @param address The DCC address of the decoder.
 /// @param status The acknowledgement status.
 typedef void (*PomAckCallback)(uint16_t address, uint8_t status);
+typedef BiDiBEvent<uint16_t, uint8_t> PomAckEvent;
 
 /// @brief Callback function type for single occupancy detector events.
 /// @param detectorNum The number of the detector.
 /// @param occupied True if the detector is occupied (MSG_BM_OCC), false if it is free (MSG_BM_FREE).
 typedef void (*OccupancyCallback)(uint8_t detectorNum, bool occupied);
+typedef BiDiBEvent<uint8_t, bool> OccupancyEvent;
 
 /// @brief Callback function type for a range of occupancy detectors.
 /// @param baseNum The base number of the first detector.
 /// @param size The number of detectors reported.
 /// @param data Pointer to the bitmap data representing the states.
 typedef void (*OccupancyMultipleCallback)(uint8_t baseNum, uint8_t size, const uint8_t* data);
+typedef BiDiBEvent<uint8_t, uint8_t, const uint8_t*> OccupancyMultipleEvent;
 
 /// @brief Callback function type for address reporting events.
 /// @param detectorNum The number of the detector.
 /// @param address The DCC address of the decoder.
 typedef void (*AddressCallback)(uint8_t detectorNum, uint16_t address);
+typedef BiDiBEvent<uint8_t, uint16_t> AddressEvent;
 
 /// @brief Callback function type for speed reporting events.
 /// @param address The DCC address of the locomotive.
 /// @param speed The speed of the locomotive.
 typedef void (*SpeedCallback)(uint16_t address, uint16_t speed);
+typedef BiDiBEvent<uint16_t, uint16_t> SpeedEvent;
 
 /// @brief Callback function type for CV reporting events.
 /// @param address The DCC address of the decoder.
 /// @param cv The CV number.
 /// @param value The value of the CV.
 typedef void (*CvCallback)(uint16_t address, uint16_t cv, uint8_t value);
+typedef BiDiBEvent<uint16_t, uint16_t, uint8_t> CvEvent;
 
 /// @brief Callback function type for native accessory state reports.
 /// @param accessoryNum The number of the accessory.
 /// @param aspect The current aspect (state) of the accessory.
 typedef void (*AccessoryStateCallback)(uint8_t accessoryNum, uint8_t aspect);
+typedef BiDiBEvent<uint8_t, uint8_t> AccessoryStateEvent;
 
 /// @brief Callback function type for booster status reports.
 /// @param status The current status of the booster (see BIDIB_BST_STATE_* constants).
 typedef void (*BoosterStatusCallback)(uint8_t status);
+typedef BiDiBEvent<uint8_t> BoosterStatusEvent;
 
 /// @brief Callback function type for booster diagnostic reports.
 /// @param type The type of diagnostic value (see BIDIB_BST_DIAG_* constants).
 /// @param value The diagnostic value.
 typedef void (*BoosterDiagnosticCallback)(uint8_t type, uint16_t value);
+typedef BiDiBEvent<uint8_t, uint16_t> BoosterDiagnosticEvent;
 
 /// @brief Callback function type for vendor ACK reports.
 /// @param node_addr The address of the node that sent the ACK.
 /// @param status The acknowledgement status.
 typedef void (*VendorAckCallback)(uint8_t node_addr, uint8_t status);
+typedef BiDiBEvent<uint8_t, uint8_t> VendorAckEvent;
 
 /// @brief Callback function type for vendor data reports.
 /// @param node_addr The address of the node that sent the data.
 /// @param name The name of the vendor-specific value.
 /// @param value The value of the vendor-specific parameter.
 typedef void (*VendorDataCallback)(uint8_t node_addr, const char* name, const char* value);
+typedef BiDiBEvent<uint8_t, const char*, const char*> VendorDataEvent;
 
 /// @brief Callback function type for firmware update status reports.
 /// @param status The status of the firmware update (see BIDIB_MSG_FW_UPDATE_STAT_* constants).
 /// @param detail Additional detail for the status (e.g., error code).
 typedef void (*FirmwareUpdateStatusCallback)(uint8_t status, uint8_t detail);
+typedef BiDiBEvent<uint8_t, uint8_t> FirmwareUpdateStatusEvent;
+
+class BiDiB;
+
+/// @brief Handler function type for a received message type (see BiDiB::onMessage()).
+/// @param bidib The instance that received the message, e.g. to reply with sendMessage().
+/// @param msg The received message.
+typedef void (*MessageHandler)(BiDiB &bidib, const BiDiBMessage &msg);
+
+/// @brief Completion callback of a request (see BiDiB::sendRequest()).
+/// @param context The context pointer passed with the request.
+/// @param reply The answer, or nullptr if none arrived within the request timeout.
+typedef void (*RequestCallback)(void *context, const BiDiBMessage *reply);
+
+
+//================================================================================
+// Message Dispatch Configuration
+//================================================================================
+
+/// Number of application handlers that can be installed with BiDiB::onMessage().
+#ifndef BIDIB_MAX_MESSAGE_HANDLERS
+#if defined(__AVR__)
+#define BIDIB_MAX_MESSAGE_HANDLERS 4
+#else
+#define BIDIB_MAX_MESSAGE_HANDLERS 16
+#endif
+#endif
+
+//================================================================================
+// Occupancy Engine Configuration
+//================================================================================
 
+/// Number of detectors whose state the occupancy engine (setOccupancy()) tracks, starting at
+/// detector 0. Must be a multiple of 8 between 8 and 256; each 8 detectors cost 2 bytes.
+#ifndef BIDIB_OCCUPANCY_DETECTORS
+#if defined(__AVR__)
+#define BIDIB_OCCUPANCY_DETECTORS 64
+#else
+#define BIDIB_OCCUPANCY_DETECTORS 256
+#endif
+#endif
+static_assert(BIDIB_OCCUPANCY_DETECTORS >= 8 && BIDIB_OCCUPANCY_DETECTORS <= 256 && BIDIB_OCCUPANCY_DETECTORS % 8 == 0,
+              "BIDIB_OCCUPANCY_DETECTORS must be a multiple of 8 between 8 and 256");
+
+/// Bits of the per-detector debounce counters; on and off delays can be 1 to 2^BITS - 1 ticks.
+/// Each bit costs 3 bytes per 8 detectors.
+#ifndef BIDIB_DEBOUNCE_BITS
+#if defined(__AVR__)
+#define BIDIB_DEBOUNCE_BITS 3
+#else
+#define BIDIB_DEBOUNCE_BITS 4
+#endif
+#endif
+static_assert(BIDIB_DEBOUNCE_BITS >= 1 && BIDIB_DEBOUNCE_BITS <= 7, "BIDIB_DEBOUNCE_BITS must be between 1 and 7");
+
+/// Milliseconds between two debounce ticks when update() drives the debounce stage.
+#ifndef BIDIB_DEBOUNCE_TICK_MS
+#define BIDIB_DEBOUNCE_TICK_MS 10
+#endif
+
+//================================================================================
+// Receive Queue Configuration
+//================================================================================
+
+/// Number of decoded messages that update() can buffer until handleMessages() drains them.
+/// Each one costs a BiDiBMessage, so AVR keeps just two: one being handled and one arriving.
+/// Override with a build flag (e.g. -DBIDIB_RX_QUEUE_SIZE=16); must not exceed 255.
+#ifndef BIDIB_RX_QUEUE_SIZE
+#if defined(__AVR__)
+#define BIDIB_RX_QUEUE_SIZE 2
+#else
+#define BIDIB_RX_QUEUE_SIZE 32
+#endif
+#endif
+
+/// Number of bytes update() reads from the stream at a time. Runs without MAGIC or ESCAPE
+/// inside such a chunk are checked and copied as a block. The chunk lives on the stack.
+#ifndef BIDIB_RX_CHUNK_SIZE
+#if defined(__AVR__)
+#define BIDIB_RX_CHUNK_SIZE 16
+#else
+#define BIDIB_RX_CHUNK_SIZE 64
+#endif
+#endif
+
+static_assert(BIDIB_RX_CHUNK_SIZE > 0 && BIDIB_RX_CHUNK_SIZE <= 255, "BIDIB_RX_CHUNK_SIZE must be between 1 and 255");
+
+//================================================================================
+// Transmit Configuration
+//================================================================================
+
+/// Size of the transmit packet buffer. With TX batching enabled, all messages that fit are
+/// sent as one MESSAGE_SEQ sharing a single CRC. Must hold at least one maximum-size message
+/// and must not exceed 255.
+#ifndef BIDIB_TX_BATCH_SIZE
+#if defined(__AVR__)
+#define BIDIB_TX_BATCH_SIZE 72
+#else
+#define BIDIB_TX_BATCH_SIZE 128
+#endif
+#endif
+
+static_assert(BIDIB_TX_BATCH_SIZE > BIDIB_MAX_MESSAGE_LENGTH, "BIDIB_TX_BATCH_SIZE must hold a complete message");
+
+/// Size of the scratch buffer in which packets are framed and escaped before they are handed to
+/// Stream::write(buffer, size). The default holds a worst-case packet (every byte escaped), so
+/// each packet is a single write call. Smaller sizes write the packet in chunks; 0 disables the
+/// scratch buffer and writes byte by byte, which is cheapest in RAM on small AVR nodes.
+#ifndef BIDIB_TX_SCRATCH_SIZE
+#if defined(__AVR__)
+#define BIDIB_TX_SCRATCH_SIZE 0
+#else
+#define BIDIB_TX_SCRATCH_SIZE (2 * BIDIB_TX_BATCH_SIZE + 4)
+#endif
+#endif
+
+static_assert(BIDIB_TX_SCRATCH_SIZE == 0 || BIDIB_TX_SCRATCH_SIZE >= 8, "BIDIB_TX_SCRATCH_SIZE is too small");
+
+/// Size in bytes of the ring buffer used by the non-blocking transmit queue (see setTxQueueing()).
+/// Holds framed and escaped packets until Stream::availableForWrite() reports room. 0 removes the
+/// queue with all of its rings; it is opt-in, so it is left out on AVR by default.
+/// This is the ring of the realtime class; system and bulk packets have rings of their own.
+/// Each ring must hold a worst-case packet (every byte escaped), 2 * BIDIB_TX_BATCH_SIZE + 4 bytes.
+#ifndef BIDIB_TX_QUEUE_SIZE
+#if defined(__AVR__)
+#define BIDIB_TX_QUEUE_SIZE 0
+#else
+#define BIDIB_TX_QUEUE_SIZE 1024
+#endif
+#endif
+
+/// Sizes in bytes of the transmit queue rings for system/safety and bulk packets. 0 removes a ring;
+/// its packets then share the realtime ring and lose their priority.
+#ifndef BIDIB_TX_SYSTEM_QUEUE_SIZE
+#if defined(__AVR__)
+#define BIDIB_TX_SYSTEM_QUEUE_SIZE 0
+#else
+#define BIDIB_TX_SYSTEM_QUEUE_SIZE 260
+#endif
+#endif
+#ifndef BIDIB_TX_BULK_QUEUE_SIZE
+#if defined(__AVR__)
+#define BIDIB_TX_BULK_QUEUE_SIZE 0
+#else
+#define BIDIB_TX_BULK_QUEUE_SIZE 1024
+#endif
+#endif
+
+static_assert(BIDIB_TX_QUEUE_SIZE == 0 || (BIDIB_TX_QUEUE_SIZE >= 2 * BIDIB_TX_BATCH_SIZE + 4 &&
+                                           (BIDIB_TX_SYSTEM_QUEUE_SIZE == 0 || BIDIB_TX_SYSTEM_QUEUE_SIZE >= 2 * BIDIB_TX_BATCH_SIZE + 4) &&
+                                           (BIDIB_TX_BULK_QUEUE_SIZE == 0 || BIDIB_TX_BULK_QUEUE_SIZE >= 2 * BIDIB_TX_BATCH_SIZE + 4)),
+              "Each transmit queue ring must hold a worst-case packet of 2 * BIDIB_TX_BATCH_SIZE + 4 bytes");
+static_assert(BIDIB_TX_SYSTEM_QUEUE_SIZE + BIDIB_TX_QUEUE_SIZE + BIDIB_TX_BULK_QUEUE_SIZE <= 65535,
+              "The transmit queue rings must not exceed 65535 bytes together");
+
+/// Number of system or realtime packets the transmit queue writes while bulk packets wait before
+/// it lets one bulk packet through.
+#ifndef BIDIB_TX_BULK_SHARE
+#define BIDIB_TX_BULK_SHARE 4
+#endif
+
+static_assert(BIDIB_TX_BULK_SHARE >= 1 && BIDIB_TX_BULK_SHARE <= 255, "BIDIB_TX_BULK_SHARE must be between 1 and 255");
+
+/// Transmit priority classes, from most to least urgent.
+const uint8_t BIDIB_TX_PRIORITY_SYSTEM = 0;   ///< System and safety messages (track state, booster off, logon)
+const uint8_t BIDIB_TX_PRIORITY_REALTIME = 1; ///< Realtime control (drive, accessory, occupancy)
+const uint8_t BIDIB_TX_PRIORITY_BULK = 2;     ///< Bulk traffic (firmware, vendor, feature and node tables)
+const uint8_t BIDIB_TX_PRIORITIES = 3;
+
+//================================================================================
+// Drive Scheduler Configuration
+//================================================================================
+
+/// Number of locomotives the drive scheduler (setDriveScheduling()) keeps a pending command for.
+/// Must not exceed 255.
+#ifndef BIDIB_DRIVE_SLOTS
+#if defined(__AVR__)
+#define BIDIB_DRIVE_SLOTS 8
+#else
+#define BIDIB_DRIVE_SLOTS 32
+#endif
+#endif
+
+/// Default drive command budget of the scheduler in commands per second, and how many commands
+/// it may send back to back after a quiet period.
+#ifndef BIDIB_DRIVE_RATE
+#define BIDIB_DRIVE_RATE 50
+#endif
+#ifndef BIDIB_DRIVE_BURST
+#define BIDIB_DRIVE_BURST 4
+#endif
+
+/// @brief The latest drive command for one locomotive, waiting for the scheduler.
+struct DriveSlot
+{
+    uint16_t address;  ///< DCC address of the locomotive
+    int8_t speed;      ///< Latest speed
+    uint8_t functions; ///< Latest functions
+    bool pending;      ///< True if the command has not been sent yet
+};
+
+//================================================================================
+// Flow Control Configuration
+//================================================================================
+
+/// Set to 0 to leave flow control (setFlowControl()) out. It costs five bytes per node table entry
+/// plus the hold buffer; an AVR node answers its interface rather than querying other nodes, so it
+/// is off there by default.
+#ifndef BIDIB_FLOW_CONTROL
+#if defined(__AVR__)
+#define BIDIB_FLOW_CONTROL 0
+#else
+#define BIDIB_FLOW_CONTROL 1
+#endif
+#endif
+
+/// Requests a node is assumed to accept at once until its BIDIB_FEATURE_MSG_RECEIVE_COUNT is known.
+#ifndef BIDIB_FLOW_DEFAULT_CREDITS
+#define BIDIB_FLOW_DEFAULT_CREDITS 1
+#endif
+
+/// Number of requests flow control (setFlowControl()) can hold back while their node has no
+/// credit left. Each one costs a BiDiBMessage.
+#ifndef BIDIB_FLOW_HOLD_SIZE
+#if defined(__AVR__)
+#define BIDIB_FLOW_HOLD_SIZE 2
+#else
+#define BIDIB_FLOW_HOLD_SIZE 16
+#endif
+#endif
+
+/// Time in milliseconds after which a node's unanswered requests count as lost and their
+/// credits are given back.
+#ifndef BIDIB_FLOW_TIMEOUT
+#define BIDIB_FLOW_TIMEOUT 1000
+#endif
+
+static_assert(BIDIB_FLOW_DEFAULT_CREDITS >= 1 && BIDIB_FLOW_DEFAULT_CREDITS <= 255, "BIDIB_FLOW_DEFAULT_CREDITS must be between 1 and 255");
+static_assert(BIDIB_FLOW_HOLD_SIZE >= 1 && BIDIB_FLOW_HOLD_SIZE <= 255, "BIDIB_FLOW_HOLD_SIZE must be between 1 and 255");
+static_assert(BIDIB_FLOW_TIMEOUT >= 1 && BIDIB_FLOW_TIMEOUT < 32768, "BIDIB_FLOW_TIMEOUT must be between 1 and 32767");
+
+/// @brief Flow control state of a node table entry.
+struct NodeFlowState
+{
+    uint8_t credits;     ///< Requests the node accepts at once (its BIDIB_FEATURE_MSG_RECEIVE_COUNT)
+    uint8_t in_flight;   ///< Requests sent to the node and not answered yet
+    uint16_t flow_stamp; ///< Low 16 bits of millis() when the last answer or request was seen
+    bool window_asked;   ///< A query of BIDIB_FEATURE_MSG_RECEIVE_COUNT was sent; its answer sets credits
+};
+
+//================================================================================
+// MSG_NUM Sequencing Configuration
+//================================================================================
+
+/// Number of node table entries, starting with slot 0 (address 0, the link to the interface),
+/// whose messages setSequencing() numbers and checks. Messages to the other nodes carry MSG_NUM 0
+/// and theirs are not checked. Each entry costs six bytes, so AVR keeps only the first.
+#ifndef BIDIB_SEQUENCE_NODES
+#if defined(__AVR__)
+#define BIDIB_SEQUENCE_NODES 1
+#else
+#define BIDIB_SEQUENCE_NODES BIDIB_MAX_NODES
+#endif
+#endif
+
+static_assert(BIDIB_SEQUENCE_NODES >= 1 && BIDIB_SEQUENCE_NODES <= BIDIB_MAX_NODES, "BIDIB_SEQUENCE_NODES must be between 1 and BIDIB_MAX_NODES");
+
+/// @brief MSG_NUM state of a node table entry.
+struct NodeSequenceState
+{
+    uint8_t tx_num;         ///< MSG_NUM of the last message sent to the node, 0 if none yet
+    uint8_t rx_num;         ///< MSG_NUM of the last message received from the node, 0 if unknown
+    uint16_t rx_lost;       ///< Messages from the node that never arrived, judged by gaps in MSG_NUM
+    uint16_t rx_duplicates; ///< Messages from the node that arrived twice and were dropped
+};
+
+//================================================================================
+// Request Correlation Configuration
+//================================================================================
+
+/// Number of requests with a completion callback that can wait for their answer at once.
+/// Each one costs a PendingRequest (15 bytes on AVR). Must not exceed 255.
+#ifndef BIDIB_MAX_PENDING_REQUESTS
+#if defined(__AVR__)
+#define BIDIB_MAX_PENDING_REQUESTS 2
+#else
+#define BIDIB_MAX_PENDING_REQUESTS 32
+#endif
+#endif
+
+/// Default time in milliseconds a request waits for its answer (see setRequestTimeout()).
+#ifndef BIDIB_REQUEST_TIMEOUT
+#define BIDIB_REQUEST_TIMEOUT 500
+#endif
+
+static_assert(BIDIB_MAX_PENDING_REQUESTS >= 1 && BIDIB_MAX_PENDING_REQUESTS <= 255, "BIDIB_MAX_PENDING_REQUESTS must be between 1 and 255");
+
+/// @brief A request waiting for its answer.
+struct PendingRequest
+{
+    uint32_t address;         ///< Packed address of the node the request went to
+    unsigned long deadline;   ///< millis() value at which the request times out
+    RequestCallback callback;
+    void *context;
+    uint8_t msg_num;          ///< MSG_NUM of the request
+    uint8_t reply_type;       ///< MSG_TYPE of the expected answer
+    bool held;                ///< Still held back by flow control; the timeout starts once it is sent
+};
 
 //================================================================================
 // Secure ACK Configuration
 //================================================================================
 
-const unsigned long SECURE_ACK_TIMEOUT = 1000; ///< Timeout in milliseconds for Secure-ACK
+/// Maximum number of parallel Secure-ACKs. Each one costs a PendingSecureAck (12 bytes on AVR);
+/// the messages themselves are kept encoded in the shared arena below. Must not exceed 255.
+#ifndef BIDIB_SECACK_MAX_PENDING
+#if defined(__AVR__)
+#define BIDIB_SECACK_MAX_PENDING 8
+#else
+#define BIDIB_SECACK_MAX_PENDING 32
+#endif
+#endif
+
+/// Bytes shared by the encoded messages awaiting a Secure-ACK. A single occupancy report takes
+/// 5 bytes, a MSG_BM_MULTIPLE 7 plus its bitmap.
+#ifndef BIDIB_SECACK_ARENA_SIZE
+#if defined(__AVR__)
+#define BIDIB_SECACK_ARENA_SIZE 128
+#else
+#define BIDIB_SECACK_ARENA_SIZE 1024
+#endif
+#endif
+
+/// Set to 1 to find pending Secure-ACKs through two 256-entry slot maps (detector number and
+/// MULTIPLE base number) instead of a scan. Costs 512 bytes, so it is off on AVR by default.
+#ifndef BIDIB_SECACK_DETECTOR_INDEX
+#if defined(__AVR__)
+#define BIDIB_SECACK_DETECTOR_INDEX 0
+#else
+#define BIDIB_SECACK_DETECTOR_INDEX 1
+#endif
+#endif
+
+static_assert(BIDIB_SECACK_ARENA_SIZE >= BIDIB_MAX_MESSAGE_LENGTH + 1, "BIDIB_SECACK_ARENA_SIZE must hold a complete message");
+
+/// Bounds of the adaptive Secure-ACK timeout in milliseconds. The timeout follows the measured
+/// report->mirror round trip (smoothed RTT + 4 * RTT variance) and doubles on every retry.
+#ifndef BIDIB_SECACK_MIN_TIMEOUT
+#define BIDIB_SECACK_MIN_TIMEOUT 20
+#endif
+#ifndef BIDIB_SECACK_MAX_TIMEOUT
+#define BIDIB_SECACK_MAX_TIMEOUT 8000
+#endif
+// Deadlines are kept as 16-bit millis() stamps, so a timeout plus its jitter (up to a quarter) must stay below 32768.
+static_assert(BIDIB_SECACK_MIN_TIMEOUT > 0 && BIDIB_SECACK_MIN_TIMEOUT <= BIDIB_SECACK_MAX_TIMEOUT &&
+              BIDIB_SECACK_MAX_TIMEOUT <= 26000, "Secure-ACK timeout bounds must satisfy 0 < MIN <= MAX <= 26000");
+
+const unsigned long SECURE_ACK_TIMEOUT = 1000; ///< Timeout in milliseconds for Secure-ACK until the first round trip is measured
 const uint8_t SECURE_ACK_RETRIES = 3;          ///< Number of retries for a Secure-ACK message
-const uint8_t MAX_PENDING_SECURE_ACKS = 8;     ///< Maximum number of parallel Secure-ACKs
+const uint8_t MAX_PENDING_SECURE_ACKS = BIDIB_SECACK_MAX_PENDING; ///< Maximum number of parallel Secure-ACKs
 
 /// @brief Structure to hold information about a pending Secure-ACK message.
+/// The message is stored encoded (as on the wire, without framing) in the Secure-ACK arena.
 struct PendingSecureAck
 {
-    bool active;
-    BiDiBMessage message;
-    unsigned long timestamp;
-    uint8_t retries;
+    uint16_t deadline;       ///< Low 16 bits of millis() at which the message is resent unless mirrored
+    uint16_t timeout;        ///< Timeout of the last transmission, without jitter; doubles on every retry
+    uint16_t offset;         ///< Start of the encoded message in the arena
+    uint8_t length;          ///< Encoded size of the message
+    uint8_t msg_type;        ///< Message type, matched against the mirror
+    uint8_t key;             ///< First data byte (detector or base number), matched against the mirror
+    uint8_t retries;         ///< Retransmissions so far
+    bool measurable;         ///< Sent once and neither resent nor overwritten since, so its mirror times a round trip
+    bool overwritten;        ///< Changed in place since the last resend; mirrors may answer the old content and are ignored
 };
 
 
@@ -270,21 +799,116 @@ public:
     /// @brief Processes incoming data from the serial port. This must be called regularly in the main loop.
     void update();
 
-    /// @brief Handles the last fully received message.
+    /// @brief Handles all messages that are waiting in the receive queue.
     void handleMessages();
 
+    /// @brief Installs an application handler for a message type.
+    /// Handlers for the same type run in the order they were installed. By default the library's
+    /// built-in handling runs afterwards; with replace set it is skipped, and the handler can
+    /// still call handleBuiltin() to wrap it.
+    /// @param msg_type The MSG_TYPE to handle.
+    /// @param handler The function to be called.
+    /// @param replace True to replace the built-in handling of the type.
+    /// @return False if all BIDIB_MAX_MESSAGE_HANDLERS slots are in use.
+    bool onMessage(uint8_t msg_type, MessageHandler handler, bool replace = false);
+
+    /// @brief Removes a handler installed with onMessage().
+    /// @param msg_type The MSG_TYPE the handler was installed for.
+    /// @param handler The function to remove.
+    void removeMessageHandler(uint8_t msg_type, MessageHandler handler);
+
+    /// @brief Runs the library's built-in handling of a message, bypassing application handlers.
+    /// @param msg The message to handle.
+    void handleBuiltin(const BiDiBMessage &msg);
+
+    /// @brief Removes all event listeners registered with a context, e.g. before that object is destroyed.
+    /// @param context The context pointer passed to the on*() functions.
+    void removeListener(void *context);
+
     /// @brief Sends a complete, formatted BiDiB message.
     /// @param msg The BiDiBMessage object to send.
     virtual void sendMessage(const BiDiBMessage &msg);
 
+    /// @brief Enables or disables TX batching. While enabled, messages sent during one update() or
+    /// handleMessages() pass are packed into a single MESSAGE_SEQ packet with one CRC. The packet
+    /// is sent at the end of the pass or as soon as the next message no longer fits.
+    /// @param enabled True to batch outgoing messages, false to send each message immediately.
+    void setTxBatching(bool enabled);
+
+    /// @brief Sends all messages collected in the current TX batch as one packet.
+    void flushTxBatch();
+
+    /// @brief Enables or disables the non-blocking transmit queue. While enabled, sendMessage() only
+    /// appends the framed packet to a ring buffer and update() writes as many bytes as
+    /// Stream::availableForWrite() allows, so a full UART buffer never stalls the loop.
+    /// Disabling the queue writes out everything still queued.
+    /// @param enabled True to queue outgoing packets, false to write them immediately.
+    void setTxQueueing(bool enabled);
+
+    /// @brief Gets the number of bytes waiting in the transmit queue.
+    /// @return The number of queued bytes.
+    uint16_t getTxQueueCount();
+
+    /// @brief Gets the number of bytes waiting in the transmit queue of one priority class.
+    /// The queue writes system packets before realtime packets before bulk packets; a packet that
+    /// is partly written is always finished first, so an emergency stop waits for at most one packet.
+    /// @param priority BIDIB_TX_PRIORITY_SYSTEM, BIDIB_TX_PRIORITY_REALTIME or BIDIB_TX_PRIORITY_BULK.
+    /// @return The number of queued bytes of that class, or of the realtime ring if the class shares it.
+    uint16_t getTxQueueCount(uint8_t priority);
+
+    /// @brief Gets the highest number of bytes that were waiting in the transmit queue at once.
+    /// @return The high-water mark since begin().
+    uint16_t getTxQueueHighWater();
+
+    /// @brief Gets the number of packets dropped because the transmit queue was full.
+    /// @return The drop counter since begin().
+    uint16_t getTxDropCount();
+
     /// @brief Checks if a message has been received and is waiting to be processed.
     /// @return True if a message is available, false otherwise.
     bool messageAvailable();
 
-    /// @brief Gets the last received message.
-    /// @return The last BiDiBMessage object received.
+    /// @brief Removes the oldest received message from the receive queue.
+    /// Returns a copy; peekMessage() and releaseMessage() avoid it.
+    /// @return The oldest BiDiBMessage object waiting to be processed.
     BiDiBMessage getLastMessage();
 
+    /// @brief Gives access to the oldest received message without copying it.
+    /// update() decodes into free slots only, so the view survives further update() calls.
+    /// @return A view of the message, or an invalid view if the receive queue is empty.
+    BiDiBMessageView peekMessage();
+
+    /// @brief Removes the oldest received message from the receive queue; its view becomes invalid.
+    void releaseMessage();
+
+    /// @brief Gets the number of received messages waiting to be processed.
+    /// @return The number of messages in the receive queue.
+    uint8_t getRxQueueCount();
+
+    /// @brief Gets the number of valid messages dropped because the receive queue was full.
+    /// @return The overflow counter since begin().
+    uint16_t getRxOverflowCount();
+
+    /// @brief Gets the number of messages waiting for a Secure-ACK mirror.
+    uint8_t getPendingSecureAckCount();
+
+    /// @brief Gets the smoothed report->mirror round-trip time.
+    /// @return The estimate in milliseconds, or 0 while no round trip has been measured since begin().
+    uint16_t getSecureAckRtt();
+
+    /// @brief Gets the smoothed mean deviation of the report->mirror round-trip time in milliseconds.
+    uint16_t getSecureAckRttVariance();
+
+    /// @brief Gets the timeout that a new report waits for its mirror before it is resent.
+    /// @return The timeout in milliseconds; SECURE_ACK_TIMEOUT until the first round trip is measured.
+    uint16_t getSecureAckTimeout();
+
+    /// @brief Gets the number of Secure-ACK retransmissions (timeouts and corrections) since begin().
+    uint16_t getSecureAckRetransmitCount();
+
+    /// @brief Gets the number of reports given up after SECURE_ACK_RETRIES retransmissions since begin().
+    uint16_t getSecureAckFailureCount();
+
     /// @brief Helper function to calculate the CRC8 checksum for a data block.
     /// @param data Pointer to the data array.
     /// @param size The size of the data array.
@@ -315,9 +939,22 @@ public:
 
     /// @brief Gets the current value of a feature for this node.
     /// @param feature_num The feature number to get.
-    /// @return The value of the feature.
+    /// @return The value of the feature, or 0 if the node does not have it.
     uint8_t getFeature(uint8_t feature_num);
 
+    /// @brief Checks whether the node has a feature.
+    /// @param feature_num The feature number to check.
+    /// @return True if the feature has been set.
+    bool hasFeature(uint8_t feature_num) const;
+
+    /// @brief Gets the number of features of this node.
+    uint8_t getFeatureCount() const { return _feature_count; }
+
+    /// @brief Gets a feature by its position; features are kept in ascending order of their number.
+    /// @param index The position, 0 to getFeatureCount() - 1.
+    /// @return Pointer to the feature, or nullptr if the index is out of range.
+    const BiDiBFeature *getFeatureAt(uint8_t index) const;
+
     // --- Command Station Functions ---
 
     /// @brief Sets the state of the DCC track power.
@@ -330,10 +967,34 @@ public:
     /// @param functions A bitmask representing the active functions (F0-F7).
     void drive(uint16_t address, int8_t speed, uint8_t functions);
 
+    /// @brief Enables or disables the drive scheduler. While enabled, drive() keeps only the latest
+    /// command per locomotive and update() sends the pending ones round-robin within the budget set
+    /// by setDriveRate(). A command is sent right away if nothing is waiting and the budget allows
+    /// it, and emergency stops (speed step 1) are always sent right away.
+    /// Disabling the scheduler sends everything still pending.
+    /// @param enabled True to schedule drive commands, false to send them immediately.
+    void setDriveScheduling(bool enabled);
+
+    /// @brief Sets the drive command budget of the scheduler.
+    /// @param commandsPerSecond Drive commands the scheduler may send per second on average.
+    /// @param burst Commands it may send back to back after a quiet period.
+    void setDriveRate(uint16_t commandsPerSecond, uint8_t burst = BIDIB_DRIVE_BURST);
+
+    /// @brief Gets the number of locomotives with a drive command waiting in the scheduler.
+    uint8_t getDrivePendingCount();
+
+    /// @brief Gets the number of drive commands replaced by a newer one before they were sent.
+    /// @return The counter since the scheduler was enabled.
+    uint16_t getDriveCoalescedCount();
+
     /// @brief Registers a callback function to be called when a drive acknowledgement is received.
     /// @param callback The function to be called.
     void onDriveAck(DriveAckCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onDriveAck(DriveAckEvent::Listener listener, void *context);
+
     /// @brief Sends a command to a DCC accessory.
     /// @param address The DCC address of the accessory.
     /// @param output The output to control (0-3).
@@ -344,6 +1005,10 @@ public:
     /// @param callback The function to be called.
     void onAccessoryAck(AccessoryAckCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onAccessoryAck(AccessoryAckEvent::Listener listener, void *context);
+
     /// @brief Writes a single byte to a CV on the main track (PoM).
     /// @param address The DCC address of the decoder.
     /// @param cv The CV number to write to (1-1024).
@@ -354,6 +1019,10 @@ public:
     /// @param callback The function to be called.
     void onPomAck(PomAckCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onPomAck(PomAckEvent::Listener listener, void *context);
+
     // --- Booster Functions ---
 
     /// @brief Sets the state of a booster (on or off).
@@ -365,14 +1034,26 @@ public:
     /// @param node_addr The address of the booster to query. Use 0 for a broadcast to all boosters.
     void queryBooster(uint8_t node_addr = 0);
 
+    /// @brief Queries the status of a booster and calls back with the MSG_BOOST_STAT answer.
+    /// @return False if the request table is full; nothing is sent then.
+    bool queryBooster(uint8_t node_addr, RequestCallback callback, void *context = nullptr);
+
     /// @brief Registers a callback function to be called when a booster status report is received.
     /// @param callback The function to be called.
     void onBoosterStatus(BoosterStatusCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onBoosterStatus(BoosterStatusEvent::Listener listener, void *context);
+
     /// @brief Registers a callback function to be called when a booster diagnostic report is received.
     /// @param callback The function to be called.
     void onBoosterDiagnostic(BoosterDiagnosticCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onBoosterDiagnostic(BoosterDiagnosticEvent::Listener listener, void *context);
+
     // --- Vendor-Specific Functions ---
 
     /// @brief Enables vendor-specific configuration mode on a node.
@@ -387,11 +1068,19 @@ public:
     /// @param callback The function to be called.
     void onVendorAck(VendorAckCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onVendorAck(VendorAckEvent::Listener listener, void *context);
+
     /// @brief Reads a vendor-specific parameter from a node.
     /// @param node_addr The address of the target node.
     /// @param name The name of the parameter to read.
     void vendorGet(uint8_t node_addr, const char* name);
 
+    /// @brief Reads a vendor-specific parameter and calls back with the MSG_VENDOR answer.
+    /// @return False if the request table is full; nothing is sent then.
+    bool vendorGet(uint8_t node_addr, const char* name, RequestCallback callback, void *context = nullptr);
+
     /// @brief Sets a vendor-specific parameter on a node.
     /// @param node_addr The address of the target node.
     /// @param name The name of the parameter to set.
@@ -402,6 +1091,10 @@ public:
     /// @param callback The function to be called.
     void onVendorData(VendorDataCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onVendorData(VendorDataEvent::Listener listener, void *context);
+
     // --- Firmware Update Functions ---
 
     /// @brief Sends a firmware update operation to a node.
@@ -438,6 +1131,10 @@ public:
     /// @param callback The function to be called.
     void onFirmwareUpdateStatus(FirmwareUpdateStatusCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onFirmwareUpdateStatus(FirmwareUpdateStatusEvent::Listener listener, void *context);
+
     // --- Accessory Control Functions ---
 
     /// @brief Sets the state (aspect) of a native BiDiB accessory.
@@ -449,32 +1146,60 @@ public:
     /// @param accessoryNum The number of the accessory to query.
     void getAccessory(uint8_t accessoryNum);
 
+    /// @brief Requests the state of a native BiDiB accessory and calls back with the MSG_ACCESSORY_STATE answer.
+    /// @return False if the request table is full; nothing is sent then.
+    bool getAccessory(uint8_t accessoryNum, RequestCallback callback, void *context = nullptr);
+
     /// @brief Registers a callback function to be called when a native accessory state report is received.
     /// @param callback The function to be called.
     void onAccessoryState(AccessoryStateCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onAccessoryState(AccessoryStateEvent::Listener listener, void *context);
+
     // --- Occupancy Reporting ---
 
     /// @brief Registers a callback function to be called for single occupancy detector events (occupied/free).
     /// @param callback The function to be called.
     void onOccupancy(OccupancyCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onOccupancy(OccupancyEvent::Listener listener, void *context);
+
     /// @brief Registers a callback function to be called for multiple occupancy detector reports.
     /// @param callback The function to be called.
     void onOccupancyMultiple(OccupancyMultipleCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onOccupancyMultiple(OccupancyMultipleEvent::Listener listener, void *context);
+
     /// @brief Registers a callback function to be called for address reporting events (e.g., from Railcom detectors).
     /// @param callback The function to be called.
     void onAddress(AddressCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onAddress(AddressEvent::Listener listener, void *context);
+
     /// @brief Registers a callback function to be called for speed reporting events.
     /// @param callback The function to be called.
     void onSpeedUpdate(SpeedCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onSpeedUpdate(SpeedEvent::Listener listener, void *context);
+
     /// @brief Registers a callback function to be called for CV reporting events.
     /// @param callback The function to be called.
     void onCvUpdate(CvCallback callback);
 
+    /// @brief Adds a listener with context for the same event; see BiDiBEvent.
+    /// @return False if all BIDIB_MAX_LISTENERS slots are in use.
+    bool onCvUpdate(CvEvent::Listener listener, void *context);
+
     /// @brief Sends an occupancy report for a single detector. If Secure-ACK is enabled, this will be handled automatically.
     /// @param detectorNum The number of the detector (0-255).
     /// @param occupied True if the detector is occupied, false if it is free.
@@ -486,68 +1211,568 @@ public:
     /// @param data A pointer to the bitmap data representing the detector states.
     void sendOccupancyMultiple(uint8_t baseNum, uint8_t size, const uint8_t* data);
 
+    /// @brief Sets the state of a detector in the occupancy engine. Nothing is sent right away:
+    /// update() compares the states with the ones last reported and sends only the changes.
+    /// With debouncing on, the state bypasses the delay and also becomes the detector's input.
+    /// @param detectorNum The number of the detector (0 to BIDIB_OCCUPANCY_DETECTORS - 1; others are ignored).
+    /// @param occupied True if the detector is occupied, false if it is free.
+    void setOccupancy(uint8_t detectorNum, bool occupied);
+
+    /// @brief Sets the states of a range of detectors in the occupancy engine, e.g. from an input port.
+    /// @param baseNum The number of the first detector.
+    /// @param size The number of bitmap bytes (8 detectors each).
+    /// @param data The bitmap; bit 0 of the first byte is detector baseNum.
+    void setOccupancyBitmap(uint8_t baseNum, uint8_t size, const uint8_t* data);
+
+    /// @brief Gets the state of a detector as last set in the occupancy engine.
+    bool getOccupancy(uint8_t detectorNum);
+
+    /// @brief Sets the delays of the debounce stage for one detector, in ticks of BIDIB_DEBOUNCE_TICK_MS.
+    /// A changed input is taken over once it has shown the new level on that many consecutive ticks;
+    /// a longer off delay holds a detector occupied across short dropouts. Inputs pass straight
+    /// through until the first call.
+    /// @param detectorNum The number of the detector.
+    /// @param onTicks Ticks before free -> occupied is taken over (1 to 2^BIDIB_DEBOUNCE_BITS - 1).
+    /// @param offTicks Ticks before occupied -> free is taken over (1 to 2^BIDIB_DEBOUNCE_BITS - 1).
+    void setOccupancyDebounce(uint8_t detectorNum, uint8_t onTicks, uint8_t offTicks);
+
+    /// @brief Sets the debounce delays of all detectors.
+    void setOccupancyDebounce(uint8_t onTicks, uint8_t offTicks);
+
+    /// @brief Feeds the raw state of a detector input into the debounce stage.
+    /// @param detectorNum The number of the detector.
+    /// @param occupied The raw input level.
+    void setOccupancyInput(uint8_t detectorNum, bool occupied);
+
+    /// @brief Feeds the raw states of a range of detector inputs into the debounce stage.
+    /// @param baseNum The number of the first detector.
+    /// @param size The number of bitmap bytes (8 detectors each).
+    /// @param data The bitmap; bit 0 of the first byte is detector baseNum.
+    void setOccupancyInputBitmap(uint8_t baseNum, uint8_t size, const uint8_t* data);
+
+    /// @brief Advances the debounce stage by one tick and takes over the inputs that are stable.
+    /// update() calls this every BIDIB_DEBOUNCE_TICK_MS once debouncing is configured; call it
+    /// from a timer instead if update() does not run often enough.
+    void tickOccupancyDebounce();
+
+    /// @brief Reports the detectors whose state differs from the last report. Single changes are
+    /// sent as MSG_BM_OCC/FREE, denser ones as MSG_BM_MULTIPLE, whichever takes fewer bytes.
+    /// update() calls this; call it directly to report without waiting for the next update().
+    void flushOccupancy();
+
+    // --- Node Table ---
+    /// @brief Finds a node in the internal node table by its unique ID.
+    /// @param unique_id A pointer to the 7-byte unique ID of the node to find.
+    /// @return The index of the node in the table, or -1 if not found.
+    int findNode(const uint8_t *unique_id);
+
+    /// @brief Finds a node in the internal node table by its address.
+    /// @param address The node address, terminated by 0 if shorter than BIDIB_MAX_ADDRESS_LENGTH bytes.
+    /// @return The index of the node in the table, or -1 if not found.
+    int findNodeByAddress(const uint8_t *address);
+
+    /// @brief Registers a node that did not log on to this bus directly, e.g. one behind a hub.
+    /// @param unique_id The 7-byte unique ID of the node.
+    /// @param address The node address, terminated by 0 if shorter than BIDIB_MAX_ADDRESS_LENGTH bytes.
+    /// @return The index of the node in the table, or -1 if the table is full or the unique ID
+    ///         or address belongs to another node already.
+    int addNode(const uint8_t *unique_id, const uint8_t *address);
+
+    /// @brief Gets the number of nodes in the node table, including this node.
+    uint16_t getNodeCount() const;
+
+    /// @brief Gets a node of the node table. The table is read-only from outside, so its indexes stay
+    /// consistent; nodes are added through logon or addNode().
+    /// @param index The index of the node (0 is this node), as returned by findNode() or addNode().
+    /// @return The node, or nullptr if the index is out of range.
+    const BiDiBNode *getNode(uint16_t index) const;
+
+    /// @brief Asks a node for the value of one of its features; the answer arrives as MSG_FEATURE.
+    /// @param node_addr The address of the node. Use 0 for the interface node.
+    /// @param feature_num The number of the feature.
+    void queryFeature(uint8_t node_addr, uint8_t feature_num);
+
+    /// @brief Asks a node for a feature and calls back with the MSG_FEATURE or MSG_FEATURE_NA answer.
+    /// @return False if the request table is full; nothing is sent then.
+    bool queryFeature(uint8_t node_addr, uint8_t feature_num, RequestCallback callback, void *context = nullptr);
+
+    /// @brief Sends a request and remembers it until its answer arrives, so that many requests can
+    /// be outstanding at once and each answer reaches the code that asked. An answer is matched by
+    /// the sender's address and its type (MSG_FEATURE_NA and MSG_NODE_NA also answer requests for
+    /// MSG_FEATURE and MSG_NODETAB); answers of the same type from one node complete the requests
+    /// in the order they were sent. Without sequencing, an answer that echoes the MSG_NUM of a
+    /// request completes exactly that request. Regular callbacks and handlers still see the answer.
+    /// A request held back by flow control starts its timeout when it is actually sent.
+    /// @param msg The request.
+    /// @param reply_type The MSG_TYPE of the expected answer.
+    /// @param callback Called with the answer, or with nullptr once the request timeout has passed.
+    ///                 nullptr just sends the request.
+    /// @param context Passed to the callback.
+    /// @return False if BIDIB_MAX_PENDING_REQUESTS requests are outstanding; nothing is sent then.
+    bool sendRequest(const BiDiBMessage &msg, uint8_t reply_type, RequestCallback callback, void *context = nullptr);
+
+    /// @brief Sets how long requests sent from now on wait for their answer.
+    /// @param timeout The timeout in milliseconds.
+    void setRequestTimeout(uint16_t timeout);
+
+    /// @brief Gets the number of requests waiting for their answer.
+    uint8_t getPendingRequestCount();
+
+    /// @brief Enables or disables credit-based flow control. While enabled, requests to nodes of the
+    /// node table (feature, vendor, booster and accessory queries, firmware operations, ...) are
+    /// only sent while fewer of them are unanswered than the node's BIDIB_FEATURE_MSG_RECEIVE_COUNT
+    /// allows; further requests are held back and sent as answers come in. The count is learnt
+    /// from the node's answer to queryFeature() of that feature only, as occupancy nodes report
+    /// FEATURE_BM_SECACK_AVAILABLE under the same number; until then the node gets
+    /// BIDIB_FLOW_DEFAULT_CREDITS. Disabling flow control sends everything still held back.
+    /// Without BIDIB_FLOW_CONTROL (the AVR default) flow control stays disabled.
+    /// @param enabled True to hold requests back, false to send them immediately.
+    void setFlowControl(bool enabled);
+
+    /// @brief Enables or disables MSG_NUM sequencing. While enabled, messages to a node of the node
+    /// table are numbered 1..255 (0 is skipped) per node, and the numbers of received messages are
+    /// checked per node: a gap counts the missing messages as lost, and a message that repeats the
+    /// previous number arrived twice and is dropped before dispatch. A gap also triggers an early
+    /// retransmission of pending Secure-ACK reports if it is in the messages from the interface
+    /// (address 0), as their mirror may have been among the lost messages. Messages numbered 0 restart the check. Enabling starts all counters over.
+    /// While the transmit queue is in use, numbered packets all go through the realtime ring so they
+    /// leave in the order they were numbered; they lose the system and bulk priorities.
+    /// @param enabled True to number and check messages, false to send MSG_NUM 0 and check nothing.
+    void setSequencing(bool enabled);
+
+    /// @brief Gets the sequence statistics of a node.
+    /// @param address The node address, terminated by 0 if shorter than BIDIB_MAX_ADDRESS_LENGTH bytes.
+    /// @param lost Set to the number of messages from the node that never arrived.
+    /// @param duplicates Set to the number of messages from the node that arrived twice.
+    /// @return True if the node is in the node table within BIDIB_SEQUENCE_NODES, false otherwise.
+    bool getSequenceStats(const uint8_t *address, uint16_t &lost, uint16_t &duplicates);
+
+    /// @brief Gets the number of messages from all nodes that never arrived.
+    uint16_t getRxLostCount();
+
+    /// @brief Gets the number of messages from all nodes that arrived twice and were dropped.
+    uint16_t getRxDuplicateCount();
+
+    /// @brief Gets the number of requests held back by flow control.
+    uint8_t getFlowHeldCount();
+
+    /// @brief Gets the number of times a node's requests stayed unanswered for BIDIB_FLOW_TIMEOUT
+    /// and their credits were given back.
+    uint16_t getFlowTimeoutCount();
+
     // --- Node Properties ---
     uint8_t unique_id[7];       ///< The unique ID of this node.
     uint8_t node_table_version; ///< The version of the node table.
 
 protected:
-    BiDiBMessage _lastMessage;
-    bool _messageAvailable;
+    /// @brief Appends a message to the receive queue as if it had been received.
+    /// @param msg The message to queue.
+    /// @return True if the message was queued, false if the queue is full.
+    bool queueMessage(const BiDiBMessage &msg);
+
+    /// @brief Processes a single received message.
+    /// @param msg The message to process.
+    void processMessage(const BiDiBMessage &msg);
+
+    /// @brief Passes a message to the application handlers and the built-in handler of its type.
+    /// @param msg The message to dispatch.
+    void dispatchMessage(const BiDiBMessage &msg);
+
     bool _system_enabled;
-    BiDiBFeature _features[BIDIB_MAX_FEATURES];
+    BiDiBFeature _features[BIDIB_MAX_FEATURES]; ///< Present features, sorted by feature number
+    uint8_t _featureMask[32];                    ///< Bit n is set if feature n is present
+    uint8_t _featureRank[32];                    ///< Features with a number below 8 * i, i.e. the index of the first feature of mask byte i
     uint8_t _feature_count;
-    uint8_t _next_feature_index;
+    uint8_t _next_feature_index;                 ///< GETNEXT cursor into _features
+
+    /// @brief Gets the index in _features that feature_num has, or would get when inserted.
+    uint8_t featureIndex(uint8_t feature_num) const;
     BiDiBNode _local_node;
-public:
     BiDiBNode _node_table[BIDIB_MAX_NODES];
-    uint8_t _node_count;
-protected:
+    uint16_t _node_count;
+#if BIDIB_NODE_INDEX
+    /// Slot of a node plus one, or 0 for an empty bucket. Each index is an open-addressing
+    /// hash table with linear probing; nodes are never removed one by one, so no tombstones are needed.
+#if BIDIB_MAX_NODES < 255
+    typedef uint8_t NodeSlot;
+#else
+    typedef uint16_t NodeSlot;
+#endif
+    NodeSlot _nodeUidIndex[BIDIB_NODE_INDEX_SIZE];  ///< Keyed on the unique ID
+    NodeSlot _nodeAddrIndex[BIDIB_NODE_INDEX_SIZE]; ///< Keyed on the node address
+#endif
+
+    /// @brief Empties the node table and registers this node as node 0.
+    void resetNodeTable();
+
+    /// @brief Adds a node to the table (and both indexes); the caller checks for duplicates.
+    /// @return The slot of the node.
+    uint16_t insertNode(const uint8_t *unique_id, const uint8_t *address);
+
+    /// @brief Gets the priority class a message is queued with. Override to reclassify messages,
+    /// e.g. application vendor traffic.
+    /// @param msg The message about to be sent.
+    /// @return One of the BIDIB_TX_PRIORITY_* classes.
+    virtual uint8_t txPriority(const BiDiBMessage &msg);
+
     bool _isLoggedIn;
     uint8_t _track_state;
-    DriveAckCallback _driveAckCallback;
-    AccessoryAckCallback _accessoryAckCallback;
-    PomAckCallback _pomAckCallback;
-    BoosterStatusCallback _boosterStatusCallback;
-    BoosterDiagnosticCallback _boosterDiagnosticCallback;
-    VendorAckCallback _vendorAckCallback;
-    VendorDataCallback _vendorDataCallback;
-    OccupancyCallback _occupancyCallback;
-    OccupancyMultipleCallback _occupancyMultipleCallback;
-    AddressCallback _addressCallback;
-    SpeedCallback _speedCallback;
-    CvCallback _cvCallback;
-    AccessoryStateCallback _accessoryStateCallback;
-    FirmwareUpdateStatusCallback _firmwareUpdateStatusCallback;
+    DriveAckEvent _driveAckEvent;
+    AccessoryAckEvent _accessoryAckEvent;
+    PomAckEvent _pomAckEvent;
+    BoosterStatusEvent _boosterStatusEvent;
+    BoosterDiagnosticEvent _boosterDiagnosticEvent;
+    VendorAckEvent _vendorAckEvent;
+    VendorDataEvent _vendorDataEvent;
+    OccupancyEvent _occupancyEvent;
+    OccupancyMultipleEvent _occupancyMultipleEvent;
+    AddressEvent _addressEvent;
+    SpeedEvent _speedEvent;
+    CvEvent _cvEvent;
+    AccessoryStateEvent _accessoryStateEvent;
+    FirmwareUpdateStatusEvent _firmwareUpdateStatusEvent;
 
 private:
-    /// @brief Receives and validates an incoming BiDiB message from the serial stream.
-    /// @param msg A reference to a BiDiBMessage object to store the received message.
-    /// @return True if a complete and valid message was received, false otherwise.
-    bool receiveMessage(BiDiBMessage &msg);
-
-    /// @brief Finds a node in the internal node table by its unique ID.
-    /// @param unique_id A pointer to the 7-byte unique ID of the node to find.
-    /// @return The index of the node in the table, or -1 if not found.
-    int findNode(const uint8_t *unique_id);
+    /// @brief Built-in handler of a message type; see builtinHandler().
+    typedef void (BiDiB::*BuiltinHandler)(const BiDiBMessage &msg);
+
+    /// @brief An application handler installed with onMessage().
+    struct MessageHandlerEntry
+    {
+        MessageHandler handler;
+        uint8_t msg_type;
+        bool replace;
+    };
+
+    /// @brief Maps a MSG_TYPE to its built-in handler; used to generate _builtinHandlers at compile time.
+    static constexpr BuiltinHandler builtinHandler(uint8_t type);
+
+    static const BuiltinHandler _builtinHandlers[256]; ///< Built-in handler per MSG_TYPE (in flash on AVR)
+
+    // --- Built-in handlers, one per handled MSG_TYPE ---
+    void handleUnknown(const BiDiBMessage &msg); ///< Shared no-op for unhandled types
+    void handleSysGetMagic(const BiDiBMessage &msg);
+    void handleSysGetPVersion(const BiDiBMessage &msg);
+    void handleSysGetUniqueId(const BiDiBMessage &msg);
+    void handleNodeTabGetAll(const BiDiBMessage &msg);
+    void handleVendorAck(const BiDiBMessage &msg);
+    void handleVendor(const BiDiBMessage &msg);
+    void handleNodeTabGetNext(const BiDiBMessage &msg);
+    void handleLogon(const BiDiBMessage &msg);
+    void handleLogonAck(const BiDiBMessage &msg);
+    void handleFeatureGetAll(const BiDiBMessage &msg);
+    void handleFeatureGetNext(const BiDiBMessage &msg);
+    void handleFeatureGet(const BiDiBMessage &msg);
+    void handleFeatureSet(const BiDiBMessage &msg);
+    void handleCsState(const BiDiBMessage &msg);
+    void handleCsDriveAck(const BiDiBMessage &msg);
+    void handleCsAccessoryAck(const BiDiBMessage &msg);
+    void handleCsPomAck(const BiDiBMessage &msg);
+    void handleBmOcc(const BiDiBMessage &msg);
+    void handleBmFree(const BiDiBMessage &msg);
+    void handleBmMultiple(const BiDiBMessage &msg);
+    void handleBmAddress(const BiDiBMessage &msg);
+    void handleBmSpeed(const BiDiBMessage &msg);
+    void handleBmCv(const BiDiBMessage &msg);
+    void handleAccessoryState(const BiDiBMessage &msg);   ///< MSG_ACCESSORY_STATE and MSG_ACCESSORY_NOTIFY
+    void handleBoostStat(const BiDiBMessage &msg);
+    void handleBoostDiagnostic(const BiDiBMessage &msg);
+    void handleFwUpdateStat(const BiDiBMessage &msg);
+    void handleBmMirror(const BiDiBMessage &msg);         ///< MSG_BM_MIRROR_OCC and MSG_BM_MIRROR_FREE
+    void handleBmMirrorMultiple(const BiDiBMessage &msg);
+
+    // --- Application message handlers ---
+    MessageHandlerEntry _messageHandlers[BIDIB_MAX_MESSAGE_HANDLERS];
+    uint8_t _messageHandlerCount;
+    uint8_t _messageHandlerMask[32]; ///< One bit per MSG_TYPE that has application handlers
+
+    /// @brief States of the incremental frame parser used by receiveMessages().
+    enum RxState : uint8_t
+    {
+        RX_WAIT_MAGIC,     ///< Discarding bytes until the next MAGIC (idle or after an error)
+        RX_LENGTH,         ///< Expecting MSG_LENGTH of the first message in the packet
+        RX_ADDRESS,        ///< Reading the address stack up to its terminating 0
+        RX_MSG_NUM,        ///< Expecting MSG_NUM
+        RX_MSG_TYPE,       ///< Expecting MSG_TYPE
+        RX_DATA,           ///< Reading the payload
+        RX_CRC_OR_LENGTH,  ///< Message complete; expecting the CRC or MSG_LENGTH of the next message
+        RX_END             ///< The previous byte was the CRC if a MAGIC follows, otherwise a MSG_LENGTH
+    };
+
+    /// @brief Feeds the bytes currently available on the serial stream into the frame parser.
+    /// The parser keeps its state between calls, so a packet may arrive spread over several calls.
+    /// A packet may carry a MESSAGE_SEQ of several messages sharing one CRC; all of them are
+    /// appended to the receive queue once the CRC has been verified.
+    void receiveMessages();
+
+    /// @brief Feeds raw bytes from the stream into the frame parser (unescaping and CRC).
+    /// @param data The bytes as received, including MAGIC and ESCAPE.
+    /// @param size The number of bytes.
+    void receiveBytes(const uint8_t *data, uint8_t size);
+
+    /// @brief Starts decoding a new message of a packet.
+    /// @param length The MSG_LENGTH of the message.
+    /// @return True if the length is plausible, false if the packet must be dropped.
+    bool beginRxMessage(uint8_t length);
+
+    /// @brief Advances the frame parser by one unescaped content byte.
+    /// @param byte The content byte (length, address, number, type, data or CRC).
+    void parseContentByte(uint8_t byte);
+
+    /// @brief Advances the frame parser by a run of unescaped content bytes; payload is copied as a block.
+    void parseContentRun(const uint8_t *data, uint8_t size);
+
+    /// @brief Serializes a message (MSG_LENGTH up to the end of the payload) into a buffer.
+    /// @param msg The message to serialize.
+    /// @param buffer The destination; must hold msg.length + 1 bytes.
+    /// @return The number of bytes written.
+    uint8_t encodeMessage(const BiDiBMessage &msg, uint8_t *buffer);
+
+    /// @brief Writes the packet in _txBuffer to the stream, framed and escaped.
+    /// @param crc The CRC over the packet content.
+    void writeTxPacket(uint8_t crc);
+
+    /// @brief Writes queued bytes, class by class and packet by packet.
+    /// @param room The number of bytes the stream accepts.
+    /// @return The number of bytes written.
+    uint16_t writeTxQueue(uint16_t room);
+
+    /// @brief Appends the packet in _txBuffer, framed and escaped, to the transmit queue.
+    /// @param crc The CRC over the packet content.
+    /// @return True if the packet was queued, false if it was dropped because it did not fit.
+    bool queueTxPacket(uint8_t crc);
+
+    /// @brief Writes as much of the transmit queue as the stream accepts without blocking.
+    void drainTxQueue();
 
     /// @brief Sends a single byte and applies escaping if necessary.
     /// @param byte The byte to send.
-    /// @param crc A reference to the running CRC checksum, which will be updated.
-    void sendByte(uint8_t byte, uint8_t &crc);
+    void sendByte(uint8_t byte);
 
     /// @brief Updates the CRC checksum with a new byte.
     /// @param byte The byte to add to the CRC calculation.
     /// @param crc A reference to the CRC checksum to update.
     void updateCrc(uint8_t byte, uint8_t &crc);
 
-    /// @brief Adds a message to the pending Secure-ACK list.
+    /// @brief Adds a message to the pending Secure-ACK list and sends it.
+    /// A pending report about the same detector or range is replaced and its retry cycle restarts;
+    /// otherwise the message is dropped if the list or the arena is full.
     /// @param msg The message to add.
     void addPendingSecureAck(const BiDiBMessage &msg);
 
+    /// @brief Removes an entry from the pending Secure-ACK list and compacts the arena.
+    /// @param index The index of the entry; later entries move down by one.
+    void removePendingSecureAck(uint8_t index);
+
+    /// @brief Finds the pending Secure-ACK that reports the same detector or range as a message.
+    /// @param msg_type The message type; MSG_BM_OCC and MSG_BM_FREE match each other.
+    /// @param key The detector number, or the base number of a MSG_BM_MULTIPLE.
+    /// @return The index of the entry, or -1 if there is none.
+    int findPendingSecureAck(uint8_t msg_type, uint8_t key);
+
+    /// @brief Resends a pending Secure-ACK and schedules its next timeout, or drops it once
+    /// SECURE_ACK_RETRIES retransmissions have been used up.
+    /// @param index The index of the entry.
+    /// @param now The current millis().
+    /// @param backoff True after a timeout: the timeout doubles and gets jitter. False for a
+    ///        correction after a wrong mirror, which proves the link works; the current estimate is used.
+    void resendPendingSecureAck(uint8_t index, unsigned long now, bool backoff);
+
+    /// @brief Marks a pending Secure-ACK whose content changed in place. Mirrors still on their way
+    /// answer the old content, so they are ignored until the next timed resend.
+    /// @param index The index of the entry.
+    void markSecureAckOverwritten(uint8_t index);
+
+    /// @brief Feeds the round trip of a mirrored report into the timeout estimate.
+    /// Only reports that were sent once and not overwritten are measured, as otherwise the mirror
+    /// may answer an earlier transmission (Karn's rule).
+    /// @param index The index of the mirrored entry.
+    /// @param now The current millis().
+    void sampleSecureAckRtt(uint8_t index, unsigned long now);
+
+    /// @brief Forgets the round-trip estimate and the retry statistics.
+    void resetSecureAckRtt();
+
+    /// @brief Gets the encoded payload (MSG_DATA) of a pending Secure-ACK in the arena.
+    uint8_t *pendingSecureAckData(uint8_t index);
+
+    /// @brief Checks whether a pending Secure-ACK is due before another; ties go to the older entry.
+    bool secureAckBefore(uint8_t a, uint8_t b) const;
+
+    /// @brief Moves a pending Secure-ACK to its place in the deadline heap after its deadline changed.
+    /// @param pos The position of the entry in the heap.
+    void siftSecureAck(uint8_t pos);
+
+    /// @brief Decodes a message stored by encodeMessage().
+    /// @param buffer The encoded message, starting with MSG_LENGTH.
+    /// @param msg The message to fill.
+    void decodeMessage(const uint8_t *buffer, BiDiBMessage &msg);
+
     Stream *bidib_serial;
     uint8_t protocol_version[2] = {0, 1}; // V 0.1
 
+    // --- Request correlation ---
+    /// Outstanding requests in the order they were sent. Answered and expired entries are removed
+    /// right away and the later ones move down, so every entry is one that still waits.
+    PendingRequest _requests[BIDIB_MAX_PENDING_REQUESTS];
+    uint8_t _requestCount;
+    uint16_t _requestTimeout;
+
+    /// @brief Completes the oldest matching request, if the message answers one.
+    void completeRequest(const BiDiBMessage &msg);
+
+    /// @brief Times out the requests whose deadline has passed, oldest first.
+    void expireRequests(unsigned long now);
+
+    /// @brief Takes a request out of the table; the later ones move down.
+    void removeRequest(uint8_t index);
+
+    /// @brief Starts the timeout of the oldest held request to the message's node, as it is sent now.
+    void releaseRequest(const BiDiBMessage &msg);
+
+    // --- MSG_NUM sequencing ---
+    NodeSequenceState _nodeSequence[BIDIB_SEQUENCE_NODES]; ///< Sequence state of the first node table entries
+    bool _sequencing;
+    uint16_t _rxLost;       ///< Sum of NodeSequenceState::rx_lost
+    uint16_t _rxDuplicates; ///< Sum of NodeSequenceState::rx_duplicates
+
+    /// @brief Checks the MSG_NUM of a received message against the sender's last one.
+    /// @return False if the message is a duplicate and must not be dispatched.
+    bool checkRxSequence(const BiDiBMessage &msg);
+
+    // --- Flow control ---
+#if BIDIB_FLOW_CONTROL
+    NodeFlowState _nodeFlow[BIDIB_MAX_NODES];     ///< Flow state of each node table entry
+    BiDiBMessage _flowHeld[BIDIB_FLOW_HOLD_SIZE]; ///< Requests waiting for a credit, oldest first
+    uint16_t _flowHeldNode[BIDIB_FLOW_HOLD_SIZE]; ///< Node table slot of each held request
+    bool _flowHeldTracked[BIDIB_FLOW_HOLD_SIZE];  ///< True if a sendRequest() entry waits for the held request
+#endif
+    uint8_t _flowHeldCount;
+    uint16_t _flowInFlight;                       ///< Unanswered requests of all nodes
+    uint16_t _flowTimeouts;
+    bool _flowControl;
+
+#if BIDIB_FLOW_CONTROL
+    /// @brief Applies flow control to an outgoing message.
+    /// @return True if the message may be sent now, false if it was held back.
+    bool admitFlowRequest(const BiDiBMessage &msg);
+
+    /// @brief Gives a credit back if the message answers a request, and sends held requests.
+    void returnFlowCredit(const BiDiBMessage &msg);
+
+    /// @brief Sends held requests of a node as far as its credits allow.
+    void releaseFlowRequests(uint16_t slot);
+
+    /// @brief Gives the credits of requests that have timed out back.
+    void expireFlowRequests();
+#endif
+
+    /// @brief Encodes a message into the packet buffer and sends it, bypassing flow control.
+    void writeMessage(const BiDiBMessage &msg);
+
+    // --- Drive scheduler ---
+    DriveSlot _driveSlots[BIDIB_DRIVE_SLOTS];
+    uint8_t _driveSlotCount;        ///< Slots assigned to an address
+    uint8_t _drivePending;          ///< Slots with a command waiting
+    uint8_t _driveCursor;           ///< Slot the round-robin continues at
+    bool _driveScheduling;
+    uint16_t _driveRate;            ///< Commands per second
+    uint8_t _driveBurst;
+    uint32_t _driveTokens;          ///< Budget in thousandths of a command
+    unsigned long _driveLastRefill;
+    uint16_t _driveCoalesced;
+
+    /// @brief Sends a MSG_CS_DRIVE without going through the scheduler.
+    void sendDrive(uint16_t address, int8_t speed, uint8_t functions);
+
+    /// @brief Adds the budget earned since the last call, up to the burst size.
+    void refillDriveTokens(unsigned long now);
+
+    /// @brief Sends pending drive commands round-robin while the budget allows.
+    void drainDriveSlots();
+
+    // --- Occupancy engine ---
+    uint8_t _occupancyState[BIDIB_OCCUPANCY_DETECTORS / 8];    ///< States as set by the application
+    uint8_t _occupancyReported[BIDIB_OCCUPANCY_DETECTORS / 8]; ///< States as last reported
+    bool _occupancyDirty;                                      ///< Set when _occupancyState changed since the last flush
+
+    // --- Occupancy debounce stage, bit-sliced: bit i of byte j of each plane belongs to detector 8 * j + i ---
+    uint8_t _debounceInput[BIDIB_OCCUPANCY_DETECTORS / 8];                        ///< Raw input levels
+    uint8_t _debounceCount[BIDIB_DEBOUNCE_BITS][BIDIB_OCCUPANCY_DETECTORS / 8];   ///< Ticks the input has differed, bit k of the counter in plane k
+    uint8_t _debounceOn[BIDIB_DEBOUNCE_BITS][BIDIB_OCCUPANCY_DETECTORS / 8];      ///< On delay, bit k in plane k
+    uint8_t _debounceOff[BIDIB_DEBOUNCE_BITS][BIDIB_OCCUPANCY_DETECTORS / 8];     ///< Off delay, bit k in plane k
+    bool _debounceEnabled;
+    unsigned long _debounceLastTick;
+
+    /// @brief Runs one debounce tick over a lane of detectors held in a word of type W.
+    /// @param offset The byte offset of the lane in the bitmaps.
+    template <typename W> void tickDebounceLane(uint8_t offset);
+
+    // --- Pending Secure-ACKs, oldest first; their messages are packed into the arena in the same order ---
     PendingSecureAck _pendingSecureAcks[MAX_PENDING_SECURE_ACKS];
+    uint8_t _pendingSecureAckCount;
+    uint8_t _secureAckHeap[MAX_PENDING_SECURE_ACKS];    ///< Entry indices as a binary min-heap on the deadline
+    uint8_t _secureAckHeapPos[MAX_PENDING_SECURE_ACKS]; ///< Heap position of each entry
+#if BIDIB_SECACK_DETECTOR_INDEX
+    uint8_t _secureAckSingleSlot[256]; ///< Entry index + 1 of the pending MSG_BM_OCC/FREE per detector, 0 if none
+    uint8_t _secureAckRangeSlot[256];  ///< Entry index + 1 of the pending MSG_BM_MULTIPLE per base number, 0 if none
+#endif
+    uint8_t _secureAckArena[BIDIB_SECACK_ARENA_SIZE];
+    uint16_t _secureAckArenaUsed;
+
+    // --- Secure-ACK round-trip estimate, in the fixed-point form of Jacobson/Karels (RFC 6298) ---
+    uint32_t _secureAckSrtt8;      ///< Smoothed RTT * 8
+    uint32_t _secureAckRttVar4;    ///< RTT mean deviation * 4
+    bool _secureAckRttValid;       ///< False until the first round trip is measured
+    uint16_t _secureAckTimeout;    ///< Timeout for new reports
+    uint16_t _secureAckRetransmits;
+    uint16_t _secureAckFailures;
+    uint16_t _secureAckJitter;     ///< Xorshift state for the retry jitter
+    uint16_t _secureAckNudgeStamp; ///< Low 16 bits of millis() when pending reports were last resent after a sequence gap
+    bool _secureAckNudged;         ///< False until the first such resend
+
+    // --- Transmit packet buffer ---
+    uint8_t _txBuffer[BIDIB_TX_BATCH_SIZE]; ///< MESSAGE_SEQ of the packet being assembled
+    uint8_t _txLength;                      ///< Number of bytes used in _txBuffer
+    bool _txBatching;                       ///< True if messages are collected until the end of a pass
+#if BIDIB_TX_SCRATCH_SIZE > 0
+    uint8_t _txFrame[BIDIB_TX_SCRATCH_SIZE]; ///< Framed and escaped bytes waiting for a bulk write
+#endif
+
+    // --- Non-blocking transmit queue ---
+#if BIDIB_TX_QUEUE_SIZE > 0
+    /// Ring buffers of framed and escaped bytes, one per priority class, back to back
+    uint8_t _txQueue[BIDIB_TX_SYSTEM_QUEUE_SIZE + BIDIB_TX_QUEUE_SIZE + BIDIB_TX_BULK_QUEUE_SIZE];
+#endif
+    uint16_t _txQueueHead[BIDIB_TX_PRIORITIES];  ///< Index of the next byte to write, per class
+    uint16_t _txQueueFill[BIDIB_TX_PRIORITIES];  ///< Number of bytes waiting, per class
+    uint16_t _txQueueCount;                  ///< Number of bytes waiting in all rings
+    uint16_t _txPacketLeft;                  ///< Bytes of the partly written packet still to write
+    uint8_t _txPacketClass;                  ///< Priority class of the partly written packet
+    uint8_t _txBulkSkips;                    ///< Packets written ahead of waiting bulk packets
+    uint8_t _txClass;                        ///< Most urgent class of the messages in _txBuffer
+    bool _txSequenced;                       ///< True if _txBuffer holds a message with a MSG_NUM other than 0
+    uint16_t _txQueueHighWater;              ///< Largest _txQueueCount seen since begin()
+    uint16_t _txDropCount;                   ///< Packets dropped because the ring buffer was full
+    bool _txQueueing;                        ///< True if packets go through the ring buffer
+
+    // --- Receive queue ---
+    BiDiBMessage _rxQueue[BIDIB_RX_QUEUE_SIZE]; ///< Ring buffer of decoded messages
+    uint8_t _rxQueueHead;                       ///< Index of the oldest queued message
+    uint8_t _rxQueueCount;                      ///< Number of queued messages
+    uint16_t _rxOverflowCount;                  ///< Messages dropped because the queue was full
+
+    // --- Receive state (kept between update() calls) ---
+    BiDiBMessage *_rxTarget;  ///< Queue slot the parser decodes into, or nullptr if the queue is full
+    uint8_t _rxState;         ///< Current RxState of the parser
+    uint8_t _rxPending;       ///< Messages of the current packet decoded but not yet published
+    uint8_t _rxDropped;       ///< Messages of the current packet that did not fit into the queue
+    uint8_t _rxLastByte;      ///< Byte held back in RX_END (CRC or MSG_LENGTH)
+    uint8_t _rxLength;        ///< MSG_LENGTH of the current message
+    uint8_t _rxCrc;           ///< Running CRC over the frame content
+    uint8_t _rxIndex;         ///< Write position within the address stack or payload
+    uint8_t _rxDataLength;    ///< Expected payload length of the current message
+    bool _rxEscaped;          ///< True if the previous byte was an ESCAPE
 };
 
 #endif
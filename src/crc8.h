@@ -2,24 +2,123 @@
 #define CRC8_H
 
 #include <stdint.h>
+#include <stddef.h>
 
-static const uint8_t crc8_table[] = {
-    0, 94, 188, 226, 97, 63, 221, 131, 194, 156, 126, 32, 163, 253, 31, 65,
-    157, 195, 33, 127, 252, 162, 64, 30, 95, 1, 227, 189, 62, 96, 130, 220,
-    35, 125, 159, 193, 66, 28, 254, 160, 225, 191, 93, 3, 128, 222, 60, 98,
-    190, 224, 2, 92, 223, 129, 99, 61, 124, 34, 192, 158, 29, 67, 161, 255,
-    70, 24, 250, 164, 39, 121, 155, 197, 132, 218, 56, 102, 229, 187, 89, 7,
-    219, 133, 103, 57, 186, 228, 6, 88, 25, 71, 165, 251, 120, 38, 196, 154,
-    101, 59, 217, 135, 4, 90, 184, 230, 167, 249, 27, 69, 198, 152, 122, 36,
-    248, 166, 68, 26, 153, 199, 37, 123, 58, 100, 134, 216, 91, 5, 231, 185,
-    140, 210, 48, 110, 237, 179, 81, 15, 78, 16, 242, 172, 47, 113, 147, 205,
-    17, 79, 173, 243, 112, 46, 204, 146, 211, 141, 111, 49, 178, 236, 14, 80,
-    175, 241, 19, 77, 206, 144, 114, 44, 109, 51, 209, 143, 12, 82, 176, 234,
-    50, 108, 142, 208, 83, 13, 235, 177, 240, 174, 76, 18, 145, 207, 45, 115,
-    202, 148, 118, 40, 171, 245, 23, 73, 8, 86, 180, 238, 121, 39, 197, 155,
-    244, 170, 72, 22, 87, 9, 239, 181, 41, 119, 149, 203, 14, 80, 176, 232,
-    107, 53, 215, 137, 182, 232, 10, 84, 21, 75, 169, 247, 116, 42, 200, 150,
-    52, 106, 136, 214, 246, 168, 74, 20, 85, 11, 233, 183, 151, 201, 43, 117
+//================================================================================
+// BiDiB CRC8: polynomial x^8 + x^5 + x^4 + 1 (0x31), reflected (0x8C), initial value 0.
+//
+// All lookup tables are generated at compile time from the bitwise definition below,
+// so they cannot drift from it. Three kernels are available:
+//  - BIDIB_CRC8_TABLE:  one lookup in a 256-entry table per byte (table in flash on AVR)
+//  - BIDIB_CRC8_NIBBLE: two lookups in a 16-entry table per byte, for nodes short on memory
+//  - BIDIB_CRC8_BULK:   slicing-by-8 over whole buffers (8 x 256 bytes of tables), for hosts
+// Select one with -DBIDIB_CRC8_STRATEGY=...; the default is TABLE on AVR and BULK elsewhere.
+//================================================================================
+
+#define BIDIB_CRC8_TABLE 1
+#define BIDIB_CRC8_NIBBLE 2
+#define BIDIB_CRC8_BULK 3
+
+#ifndef BIDIB_CRC8_STRATEGY
+#if defined(__AVR__)
+#define BIDIB_CRC8_STRATEGY BIDIB_CRC8_TABLE
+#else
+#define BIDIB_CRC8_STRATEGY BIDIB_CRC8_BULK
+#endif
+#endif
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define BIDIB_CRC8_PROGMEM PROGMEM
+#define BIDIB_CRC8_READ(table, index) pgm_read_byte(&(table)[index])
+#else
+#define BIDIB_CRC8_PROGMEM
+#define BIDIB_CRC8_READ(table, index) ((table)[index])
+#endif
+
+/// @brief Advances the CRC register by a number of bits with no new input (bitwise reference).
+/// @param crc The CRC register.
+/// @param bits The number of bits to shift through the polynomial division.
+constexpr uint8_t crc8_shift(uint8_t crc, uint8_t bits) {
+    return bits == 0 ? crc
+                     : crc8_shift((crc & 1) ? (uint8_t)((crc >> 1) ^ 0x8C) : (uint8_t)(crc >> 1), bits - 1);
+}
+
+/// @brief Bitwise reference implementation; adds one byte to the CRC.
+constexpr uint8_t crc8_bitwise(uint8_t crc, uint8_t byte) {
+    return crc8_shift(crc ^ byte, 8);
+}
+
+// Table rows: entry i of slice k is the CRC contribution of byte i followed by k - 1 zero bytes.
+#define BIDIB_CRC8_E(k, i) crc8_shift((uint8_t)(i), 8 * (k))
+#define BIDIB_CRC8_R4(k, i) BIDIB_CRC8_E(k, i), BIDIB_CRC8_E(k, i + 1), BIDIB_CRC8_E(k, i + 2), BIDIB_CRC8_E(k, i + 3)
+#define BIDIB_CRC8_R16(k, i) BIDIB_CRC8_R4(k, i), BIDIB_CRC8_R4(k, i + 4), BIDIB_CRC8_R4(k, i + 8), BIDIB_CRC8_R4(k, i + 12)
+#define BIDIB_CRC8_R64(k, i) BIDIB_CRC8_R16(k, i), BIDIB_CRC8_R16(k, i + 16), BIDIB_CRC8_R16(k, i + 32), BIDIB_CRC8_R16(k, i + 48)
+#define BIDIB_CRC8_R256(k) BIDIB_CRC8_R64(k, 0), BIDIB_CRC8_R64(k, 64), BIDIB_CRC8_R64(k, 128), BIDIB_CRC8_R64(k, 192)
+
+/// 256-entry table: crc = crc8_table[crc ^ byte]
+static const uint8_t crc8_table[256] BIDIB_CRC8_PROGMEM = { BIDIB_CRC8_R256(1) };
+
+/// 16-entry table: the CRC register after shifting a single nibble through the polynomial.
+#define BIDIB_CRC8_N4(i) crc8_shift(i, 4), crc8_shift(i + 1, 4), crc8_shift(i + 2, 4), crc8_shift(i + 3, 4)
+static const uint8_t crc8_nibble_table[16] BIDIB_CRC8_PROGMEM = {
+    BIDIB_CRC8_N4(0), BIDIB_CRC8_N4(4), BIDIB_CRC8_N4(8), BIDIB_CRC8_N4(12)
 };
 
+#if !defined(__AVR__)
+/// Slicing-by-8 tables; crc8_slice[k - 1] holds the rows of slice k.
+static const uint8_t crc8_slice[8][256] = {
+    { BIDIB_CRC8_R256(1) }, { BIDIB_CRC8_R256(2) }, { BIDIB_CRC8_R256(3) }, { BIDIB_CRC8_R256(4) },
+    { BIDIB_CRC8_R256(5) }, { BIDIB_CRC8_R256(6) }, { BIDIB_CRC8_R256(7) }, { BIDIB_CRC8_R256(8) }
+};
+#endif
+
+/// @brief Adds one byte to the CRC using the 256-entry table.
+static inline uint8_t crc8_update_table(uint8_t crc, uint8_t byte) {
+    return BIDIB_CRC8_READ(crc8_table, crc ^ byte);
+}
+
+/// @brief Adds one byte to the CRC using the 16-entry table (low nibble first, as the CRC is reflected).
+static inline uint8_t crc8_update_nibble(uint8_t crc, uint8_t byte) {
+    crc ^= byte;
+    crc = (crc >> 4) ^ BIDIB_CRC8_READ(crc8_nibble_table, crc & 0x0F);
+    return (crc >> 4) ^ BIDIB_CRC8_READ(crc8_nibble_table, crc & 0x0F);
+}
+
+#if !defined(__AVR__)
+/// @brief Adds a whole buffer to the CRC, eight bytes per step. The eight lookups of a step are
+/// independent of each other, so they do not wait on the previous result like a byte loop does.
+static inline uint8_t crc8_update_bulk(uint8_t crc, const uint8_t *data, size_t size) {
+    while (size >= 8) {
+        crc = crc8_slice[7][crc ^ data[0]] ^ crc8_slice[6][data[1]] ^
+              crc8_slice[5][data[2]] ^ crc8_slice[4][data[3]] ^
+              crc8_slice[3][data[4]] ^ crc8_slice[2][data[5]] ^
+              crc8_slice[1][data[6]] ^ crc8_slice[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size--) { crc = crc8_slice[0][crc ^ *data++]; }
+    return crc;
+}
+#endif
+
+/// @brief Adds one byte to the CRC with the configured kernel.
+static inline uint8_t crc8_update(uint8_t crc, uint8_t byte) {
+#if BIDIB_CRC8_STRATEGY == BIDIB_CRC8_NIBBLE
+    return crc8_update_nibble(crc, byte);
+#else
+    return crc8_update_table(crc, byte);
+#endif
+}
+
+/// @brief Adds a buffer to the CRC with the configured kernel.
+static inline uint8_t crc8_update(uint8_t crc, const uint8_t *data, size_t size) {
+#if BIDIB_CRC8_STRATEGY == BIDIB_CRC8_BULK && !defined(__AVR__)
+    return crc8_update_bulk(crc, data, size);
+#else
+    while (size--) { crc = crc8_update(crc, *data++); }
+    return crc;
+#endif
+}
+
 #endif // CRC8_H
@@ -0,0 +1,73 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+//================================================================================
+// BiDiB byte stuffing: MAGIC (0xFE) and ESCAPE (0xFD) inside a frame are sent as
+// ESCAPE followed by the byte XOR 0x20.
+//
+// Most content (firmware data, occupancy bitmaps) contains neither byte, so the
+// framing code looks for the next byte that needs escaping and copies the clean run
+// in between in one go. The scan uses SSE2 where available, a word-at-a-time test
+// on other native hosts and a plain byte loop on AVR.
+//================================================================================
+
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(__AVR__)
+#include <emmintrin.h>
+#endif
+
+/// @brief Returns true if the byte must be escaped inside a frame.
+static inline bool bidib_needs_escape(uint8_t byte) {
+    return byte == 0xFE || byte == 0xFD;
+}
+
+/// @brief Finds the first byte that needs escaping.
+/// @param data The buffer to scan.
+/// @param size The number of bytes in the buffer.
+/// @return The index of the first MAGIC or ESCAPE byte, or size if there is none.
+static inline size_t bidib_escape_scan(const uint8_t *data, size_t size) {
+    size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(__AVR__)
+    const __m128i magic = _mm_set1_epi8((char)0xFE);
+    const __m128i escape = _mm_set1_epi8((char)0xFD);
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, magic), _mm_cmpeq_epi8(v, escape)));
+        if (mask != 0) { return i + __builtin_ctz(mask); }
+    }
+#endif
+#if !defined(__AVR__)
+    // A byte of w ^ pattern is zero where w matches; (x - 0x01..) & ~x & 0x80.. flags such a
+    // zero byte. The exact position is left to the byte loop below, which keeps this endian-neutral.
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        uint64_t m = w ^ (ones * 0xFE);
+        uint64_t e = w ^ (ones * 0xFD);
+        if ((((m - ones) & ~m) | ((e - ones) & ~e)) & highs) { break; }
+    }
+#endif
+    for (; i < size; i++) {
+        if (bidib_needs_escape(data[i])) { break; }
+    }
+    return i;
+}
+
+/// @brief Counts the bytes that need escaping, i.e. how much longer the buffer gets on the wire.
+static inline size_t bidib_escape_count(const uint8_t *data, size_t size) {
+    size_t count = 0;
+    size_t i = bidib_escape_scan(data, size);
+    while (i < size) {
+        count++;
+        i++;
+        i += bidib_escape_scan(data + i, size - i);
+    }
+    return count;
+}
+
+#endif // ESCAPE_H
@@ -32,6 +32,18 @@ public:
         return 1;
     }
 
+    size_t write(const uint8_t* buffer, size_t size) override {
+        for (size_t i = 0; i < size; ++i) {
+            outgoing.push(buffer[i]);
+        }
+        writeCalls++;
+        return size;
+    }
+
+    int availableForWrite() override {
+        return writeRoom;
+    }
+
     void flush() override {
         // Nichts zu tun für den Mock
     }
@@ -46,8 +58,16 @@ public:
     void clear() {
         while(!incoming.empty()) incoming.pop();
         while(!outgoing.empty()) outgoing.pop();
+        writeCalls = 0;
+        writeRoom = 64;
     }
 
+    // Number of bulk write calls since the last clear()
+    int writeCalls = 0;
+
+    // Free space reported by availableForWrite(), e.g. to simulate a full UART buffer
+    int writeRoom = 64;
+
     int available_outgoing() {
         return outgoing.size();
     }
@@ -1,20 +1,17 @@
-#include <Arduino.h>
+#include <ArduinoFake.h>
 #include <unity.h>
 #include "BiDiB.h"
 #include "mock_stream.h"
 
+using namespace fakeit;
+
 // Test-spezifische Klasse, um auf interne Zustände zugreifen zu können
 class TestBiDiB : public BiDiB {
 public:
-    // Expose protected members for testing
-    using BiDiB::_lastMessage;
-    using BiDiB::_messageAvailable;
-
     uint8_t getTrackState() { return _track_state; }
 
     void setTestLastMessage(const BiDiBMessage& msg) {
-        _lastMessage = msg;
-        _messageAvailable = true;
+        queueMessage(msg);
     }
 };
 
@@ -46,6 +43,8 @@ void accessoryAckCallback(uint16_t address, uint8_t status) {
 
 void setUp(void) {
     bidib.begin(mockSerial);
+    bidib.setDriveScheduling(false);
+    bidib.setDriveRate(BIDIB_DRIVE_RATE, BIDIB_DRIVE_BURST);
     mockSerial.clear();
 
     // Reset drive callback state before each test
@@ -68,7 +67,7 @@ void tearDown(void) {
 void test_send_track_off(void) {
     bidib.setTrackState(BIDIB_CS_STATE_OFF);
 
-    // FE 04 00 00 48 00 96 FE
+    // FE 04 00 00 48 00 F2 FE
     TEST_ASSERT_EQUAL(8, mockSerial.available_outgoing());
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(4, mockSerial.read_outgoing());
@@ -76,14 +75,14 @@ void test_send_track_off(void) {
     TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(MSG_CS_SET_STATE, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(BIDIB_CS_STATE_OFF, mockSerial.read_outgoing());
-    TEST_ASSERT_EQUAL(150, mockSerial.read_outgoing()); // CRC
+    TEST_ASSERT_EQUAL(242, mockSerial.read_outgoing()); // CRC
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
 }
 
 void test_send_track_stop(void) {
     bidib.setTrackState(BIDIB_CS_STATE_STOP);
 
-    // FE 04 00 00 48 01 C8 FE
+    // FE 04 00 00 48 01 AC FE
     TEST_ASSERT_EQUAL(8, mockSerial.available_outgoing());
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(4, mockSerial.read_outgoing());
@@ -91,14 +90,14 @@ void test_send_track_stop(void) {
     TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(MSG_CS_SET_STATE, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(BIDIB_CS_STATE_STOP, mockSerial.read_outgoing());
-    TEST_ASSERT_EQUAL(200, mockSerial.read_outgoing()); // CRC
+    TEST_ASSERT_EQUAL(172, mockSerial.read_outgoing()); // CRC
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
 }
 
 void test_send_track_go(void) {
     bidib.setTrackState(BIDIB_CS_STATE_GO);
 
-    // FE 04 00 00 48 02 2A FE
+    // FE 04 00 00 48 02 4E FE
     TEST_ASSERT_EQUAL(8, mockSerial.available_outgoing());
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(4, mockSerial.read_outgoing());
@@ -106,7 +105,7 @@ void test_send_track_go(void) {
     TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(MSG_CS_SET_STATE, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(BIDIB_CS_STATE_GO, mockSerial.read_outgoing());
-    TEST_ASSERT_EQUAL(42, mockSerial.read_outgoing()); // CRC
+    TEST_ASSERT_EQUAL(78, mockSerial.read_outgoing()); // CRC
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
 }
 
@@ -250,6 +249,108 @@ void test_receive_accessory_ack_no_callback(void) {
     TEST_ASSERT_FALSE(accessory_callback_fired);
 }
 
+// Reads the next MSG_CS_DRIVE from the outgoing stream; returns false if there is none.
+static bool read_drive(uint16_t &address, uint8_t &speed) {
+    if (mockSerial.available_outgoing() < 12) { return false; }
+    uint8_t frame[12];
+    for (uint8_t i = 0; i < 12; i++) { frame[i] = mockSerial.read_outgoing(); }
+    TEST_ASSERT_EQUAL(MSG_CS_DRIVE, frame[4]);
+    address = frame[5] | (frame[6] << 8);
+    speed = frame[8];
+    return true;
+}
+
+void test_drive_scheduler_coalesces_per_address(void) {
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000);
+    bidib.setDriveRate(10, 1);
+    bidib.setDriveScheduling(true);
+
+    // The first command goes out right away; the budget is spent after that.
+    bidib.drive(3, 10, 0);
+    bidib.drive(3, 20, 0);
+    bidib.drive(4, 30, 0);
+    bidib.drive(3, 40, 0);
+    TEST_ASSERT_EQUAL(2, bidib.getDrivePendingCount());
+    TEST_ASSERT_EQUAL(1, bidib.getDriveCoalescedCount());
+
+    uint16_t address;
+    uint8_t speed;
+    TEST_ASSERT_TRUE(read_drive(address, speed));
+    TEST_ASSERT_EQUAL(3, address);
+    TEST_ASSERT_EQUAL(10, speed);
+    TEST_ASSERT_FALSE(read_drive(address, speed));
+
+    // 10 commands per second: one every 100 ms, each loco with its latest speed.
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1050);
+    bidib.update();
+    TEST_ASSERT_FALSE(read_drive(address, speed));
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1100);
+    bidib.update();
+    TEST_ASSERT_TRUE(read_drive(address, speed));
+    TEST_ASSERT_EQUAL(3, address);
+    TEST_ASSERT_EQUAL(40, speed);
+    TEST_ASSERT_FALSE(read_drive(address, speed));
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1200);
+    bidib.update();
+    TEST_ASSERT_TRUE(read_drive(address, speed));
+    TEST_ASSERT_EQUAL(4, address);
+    TEST_ASSERT_EQUAL(30, speed);
+    TEST_ASSERT_EQUAL(0, bidib.getDrivePendingCount());
+}
+
+void test_drive_scheduler_rate_zero_holds_commands(void) {
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000);
+    bidib.setDriveRate(0, 2);
+    bidib.setDriveScheduling(true);
+
+    // The burst granted on enabling is spent, and a rate of 0 earns nothing back, however long it waits.
+    bidib.drive(3, 10, 0);
+    bidib.drive(4, 20, 0);
+    bidib.drive(5, 30, 0);
+    TEST_ASSERT_EQUAL(1, bidib.getDrivePendingCount());
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + 60000);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, bidib.getDrivePendingCount());
+
+    bidib.setDriveScheduling(false);
+    while (mockSerial.available_outgoing() > 0) { mockSerial.read_outgoing(); }
+}
+
+void test_drive_scheduler_emergency_stop_bypasses(void) {
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000);
+    bidib.setDriveRate(10, 1);
+    bidib.setDriveScheduling(true);
+
+    bidib.drive(5, 10, 0);
+    bidib.drive(6, 50, 0);
+    bidib.drive(5, 60, 0);
+    TEST_ASSERT_EQUAL(2, bidib.getDrivePendingCount());
+
+    // The emergency stop is sent despite the spent budget and drops the stale command for loco 5.
+    bidib.drive(5, 1, 0);
+    TEST_ASSERT_EQUAL(1, bidib.getDrivePendingCount());
+
+    uint16_t address;
+    uint8_t speed;
+    TEST_ASSERT_TRUE(read_drive(address, speed));
+    TEST_ASSERT_EQUAL(5, address);
+    TEST_ASSERT_EQUAL(10, speed);
+    TEST_ASSERT_TRUE(read_drive(address, speed));
+    TEST_ASSERT_EQUAL(5, address);
+    TEST_ASSERT_EQUAL(1, speed);
+    TEST_ASSERT_FALSE(read_drive(address, speed));
+
+    // Switching the scheduler off sends what is still waiting.
+    bidib.setDriveScheduling(false);
+    TEST_ASSERT_TRUE(read_drive(address, speed));
+    TEST_ASSERT_EQUAL(6, address);
+    TEST_ASSERT_EQUAL(50, speed);
+    TEST_ASSERT_EQUAL(0, bidib.getDrivePendingCount());
+}
+
 int main(int argc, char **argv) {
     UNITY_BEGIN();
     RUN_TEST(test_send_track_off);
@@ -261,6 +362,9 @@ int main(int argc, char **argv) {
     RUN_TEST(test_send_drive_command);
     RUN_TEST(test_receive_drive_ack_callback);
     RUN_TEST(test_receive_drive_ack_no_callback);
+    RUN_TEST(test_drive_scheduler_coalesces_per_address);
+    RUN_TEST(test_drive_scheduler_emergency_stop_bypasses);
+    RUN_TEST(test_drive_scheduler_rate_zero_holds_commands);
     RUN_TEST(test_send_accessory_command);
     RUN_TEST(test_receive_accessory_ack_callback);
     RUN_TEST(test_receive_accessory_ack_no_callback);
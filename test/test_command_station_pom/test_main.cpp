@@ -8,9 +8,6 @@
 // =============================================================================
 class TestableBiDiB : public BiDiB {
 public:
-    // Expose protected members for testing
-    using BiDiB::_lastMessage;
-
     void sendMessage(const BiDiBMessage& msg) override {
         // Intercept sent messages and store them for inspection
         _lastSentMessage = msg;
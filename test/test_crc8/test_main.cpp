@@ -0,0 +1,79 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "crc8.h"
+
+// Simple xorshift so the buffers are reproducible without touching random()
+static uint32_t rng_state = 0x12345678;
+static uint8_t next_byte() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (uint8_t)rng_state;
+}
+
+static uint8_t reference_crc(uint8_t crc, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        crc = crc8_bitwise(crc, data[i]);
+    }
+    return crc;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_crc8_known_values() {
+    // The polynomial itself: a single 0x01 byte yields the reflected polynomial's table entry
+    TEST_ASSERT_EQUAL_HEX8(0x5E, crc8_bitwise(0, 0x01));
+    // Standard check value of CRC-8/MAXIM over "123456789"
+    const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    TEST_ASSERT_EQUAL_HEX8(0xA1, reference_crc(0, check, sizeof(check)));
+    TEST_ASSERT_EQUAL_HEX8(0xA1, crc8_update(0, check, sizeof(check)));
+}
+
+void test_crc8_table_matches_bitwise_reference() {
+    for (int i = 0; i < 256; i++) {
+        TEST_ASSERT_EQUAL_HEX8(crc8_bitwise(0, i), crc8_table[i]);
+    }
+}
+
+void test_crc8_single_byte_kernels_match_reference() {
+    for (int crc = 0; crc < 256; crc++) {
+        for (int byte = 0; byte < 256; byte++) {
+            uint8_t expected = crc8_bitwise(crc, byte);
+            TEST_ASSERT_EQUAL_HEX8(expected, crc8_update_table(crc, byte));
+            TEST_ASSERT_EQUAL_HEX8(expected, crc8_update_nibble(crc, byte));
+        }
+    }
+}
+
+void test_crc8_bulk_kernel_matches_reference() {
+    uint8_t buffer[200];
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = next_byte();
+    }
+    // Every length around the 8-byte step and every start offset, with varying seeds
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t size = 0; size <= sizeof(buffer) - offset; size++) {
+            uint8_t seed = buffer[size % sizeof(buffer)];
+            TEST_ASSERT_EQUAL_HEX8(reference_crc(seed, buffer + offset, size),
+                                   crc8_update_bulk(seed, buffer + offset, size));
+        }
+    }
+}
+
+void test_crc8_packet_with_crc_checks_to_zero() {
+    uint8_t packet[] = {0x05, 0x00, 0x01, 0x86, 0x00, 0x00};
+    packet[sizeof(packet) - 1] = crc8_update(0, packet, sizeof(packet) - 1);
+    TEST_ASSERT_EQUAL_HEX8(0, crc8_update(0, packet, sizeof(packet)));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_crc8_known_values);
+    RUN_TEST(test_crc8_table_matches_bitwise_reference);
+    RUN_TEST(test_crc8_single_byte_kernels_match_reference);
+    RUN_TEST(test_crc8_bulk_kernel_matches_reference);
+    RUN_TEST(test_crc8_packet_with_crc_checks_to_zero);
+    UNITY_END();
+    return 0;
+}
@@ -47,13 +47,22 @@ void test_cv_reporting() {
         0x05, 0x00, // CV 5
         0xAB, // Value
         0x00, // CRC (placeholder)
+        0x00, // CRC low byte when escaped, otherwise End Magic
         0xFE  // End Magic
     };
     uint8_t crc = bidib.calculateCrc(&msg[1], 10);
-    msg[11] = crc;
+    size_t size = sizeof(msg);
+    if (crc == BIDIB_MAGIC || crc == BIDIB_ESCAPE) {
+        msg[11] = BIDIB_ESCAPE;
+        msg[12] = crc ^ 0x20;
+    } else {
+        msg[11] = crc;
+        msg[12] = BIDIB_MAGIC;
+        size--;
+    }
 
     // Simulate receiving the message
-    mockStream.addIncoming(msg, sizeof(msg));
+    mockStream.addIncoming(msg, size);
     bidib.update();
     bidib.handleMessages();
 
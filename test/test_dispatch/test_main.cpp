@@ -0,0 +1,149 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "BiDiB.h"
+#include "mock_stream.h"
+#include <vector>
+
+// Final, so the per-test delete through this type is known to reach the right destructor.
+class TestBiDiB final : public BiDiB {
+public:
+    std::vector<BiDiBMessage> sent;
+
+    void sendMessage(const BiDiBMessage& msg) override {
+        sent.push_back(msg);
+    }
+
+    void injectMessage(const BiDiBMessage& msg) {
+        queueMessage(msg);
+    }
+};
+
+TestBiDiB* bidib;
+MockStream mockSerial;
+std::vector<int> calls;
+int occupancyCallbacks = 0;
+
+void occupancyCallback(uint8_t, bool) { calls.push_back(0); occupancyCallbacks++; }
+void firstHandler(BiDiB&, const BiDiBMessage&) { calls.push_back(1); }
+void secondHandler(BiDiB&, const BiDiBMessage&) { calls.push_back(2); }
+void wrappingHandler(BiDiB& b, const BiDiBMessage& msg) {
+    calls.push_back(3);
+    b.handleBuiltin(msg);
+    calls.push_back(4);
+}
+void replyingHandler(BiDiB& b, const BiDiBMessage& msg) {
+    BiDiBMessage reply;
+    reply.length = 4;
+    reply.address[0] = 0;
+    reply.msg_num = msg.msg_num;
+    reply.msg_type = 0x7E;
+    reply.data[0] = msg.data[0] + 1;
+    b.sendMessage(reply);
+}
+
+void inject(uint8_t type, uint8_t data0) {
+    BiDiBMessage msg;
+    msg.length = 4;
+    msg.address[0] = 0;
+    msg.msg_num = 1;
+    msg.msg_type = type;
+    msg.data[0] = data0;
+    bidib->injectMessage(msg);
+    bidib->handleMessages();
+}
+
+void setUp(void) {
+    bidib = new TestBiDiB();
+    bidib->begin(mockSerial);
+    bidib->onOccupancy(occupancyCallback);
+    calls.clear();
+    occupancyCallbacks = 0;
+}
+
+void tearDown(void) {
+    delete bidib;
+}
+
+void test_chained_handlers_run_before_builtin(void) {
+    TEST_ASSERT_TRUE(bidib->onMessage(MSG_BM_OCC, firstHandler));
+    TEST_ASSERT_TRUE(bidib->onMessage(MSG_BM_OCC, secondHandler));
+
+    inject(MSG_BM_OCC, 5);
+
+    TEST_ASSERT_EQUAL(3, calls.size());
+    TEST_ASSERT_EQUAL(1, calls[0]);
+    TEST_ASSERT_EQUAL(2, calls[1]);
+    TEST_ASSERT_EQUAL(0, calls[2]);
+}
+
+void test_replacing_handler_skips_builtin(void) {
+    bidib->onMessage(MSG_BM_OCC, firstHandler, true);
+
+    inject(MSG_BM_OCC, 5);
+    TEST_ASSERT_EQUAL(1, calls.size());
+    TEST_ASSERT_EQUAL(0, occupancyCallbacks);
+
+    // Other types keep their built-in handling.
+    inject(MSG_BM_FREE, 5);
+    TEST_ASSERT_EQUAL(1, occupancyCallbacks);
+}
+
+void test_replacing_handler_can_wrap_builtin(void) {
+    bidib->onMessage(MSG_BM_FREE, wrappingHandler, true);
+
+    inject(MSG_BM_FREE, 9);
+
+    TEST_ASSERT_EQUAL(3, calls.size());
+    TEST_ASSERT_EQUAL(3, calls[0]);
+    TEST_ASSERT_EQUAL(0, calls[1]);
+    TEST_ASSERT_EQUAL(4, calls[2]);
+}
+
+void test_handler_for_type_without_builtin(void) {
+    // No built-in handling exists for this type; the handler replies on its own.
+    inject(0x7D, 41);
+    TEST_ASSERT_EQUAL(0, bidib->sent.size());
+
+    bidib->onMessage(0x7D, replyingHandler);
+    inject(0x7D, 41);
+    TEST_ASSERT_EQUAL(1, bidib->sent.size());
+    TEST_ASSERT_EQUAL(0x7E, bidib->sent[0].msg_type);
+    TEST_ASSERT_EQUAL(42, bidib->sent[0].data[0]);
+}
+
+void test_removed_handler_is_not_called(void) {
+    bidib->onMessage(MSG_BM_OCC, firstHandler, true);
+    bidib->onMessage(MSG_BM_OCC, secondHandler);
+    bidib->removeMessageHandler(MSG_BM_OCC, firstHandler);
+
+    inject(MSG_BM_OCC, 5);
+    TEST_ASSERT_EQUAL(2, calls.size());
+    TEST_ASSERT_EQUAL(2, calls[0]);
+    TEST_ASSERT_EQUAL(0, calls[1]);
+
+    bidib->removeMessageHandler(MSG_BM_OCC, secondHandler);
+    calls.clear();
+    inject(MSG_BM_OCC, 5);
+    TEST_ASSERT_EQUAL(1, calls.size());
+    TEST_ASSERT_EQUAL(0, calls[0]);
+}
+
+void test_handler_slots_are_bounded(void) {
+    for (int i = 0; i < BIDIB_MAX_MESSAGE_HANDLERS; ++i) {
+        TEST_ASSERT_TRUE(bidib->onMessage(0x70 + i, firstHandler));
+    }
+    TEST_ASSERT_FALSE(bidib->onMessage(MSG_BM_OCC, firstHandler));
+    TEST_ASSERT_FALSE(bidib->onMessage(MSG_BM_OCC, nullptr));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_chained_handlers_run_before_builtin);
+    RUN_TEST(test_replacing_handler_skips_builtin);
+    RUN_TEST(test_replacing_handler_can_wrap_builtin);
+    RUN_TEST(test_handler_for_type_without_builtin);
+    RUN_TEST(test_removed_handler_is_not_called);
+    RUN_TEST(test_handler_slots_are_bounded);
+    UNITY_END();
+    return 0;
+}
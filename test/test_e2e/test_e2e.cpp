@@ -1,6 +1,7 @@
 #include <Arduino.h>
 #include <unity.h>
 #include "BiDiB.h"
+#include "crc8.h"
 #include <string>
 #include <vector>
 
@@ -18,6 +19,10 @@ public:
         buffer.push_back(c);
         return 1;
     }
+    virtual size_t write(const uint8_t *data, size_t size) {
+        buffer.insert(buffer.end(), data, data + size);
+        return size;
+    }
 
     // Custom method for this test to reset the stream and prepare for a new transfer
     void reset() {
@@ -30,28 +35,9 @@ BiDiB sender;
 BiDiB receiver;
 MockStream mockConnection;
 
-// --- CRC Calculation Logic ---
-static const uint8_t crc8_table[] = {
-    0, 94, 188, 226, 97, 63, 221, 131, 194, 156, 126, 32, 163, 253, 31, 65,
-    157, 195, 33, 127, 252, 162, 64, 30, 95, 1, 227, 189, 62, 96, 130, 220,
-    35, 125, 159, 193, 66, 28, 254, 160, 225, 191, 93, 3, 128, 222, 60, 98,
-    190, 224, 2, 92, 223, 129, 99, 61, 124, 34, 192, 158, 29, 67, 161, 255,
-    70, 24, 250, 164, 39, 121, 155, 197, 132, 218, 56, 102, 229, 187, 89, 7,
-    219, 133, 103, 57, 186, 228, 6, 88, 25, 71, 165, 251, 120, 38, 196, 154,
-    101, 59, 217, 135, 4, 90, 184, 230, 167, 249, 27, 69, 198, 152, 122, 36,
-    248, 166, 68, 26, 153, 199, 37, 123, 58, 100, 134, 216, 91, 5, 231, 185,
-    140, 210, 48, 110, 237, 179, 81, 15, 78, 16, 242, 172, 47, 113, 147, 205,
-    17, 79, 173, 243, 112, 46, 204, 146, 211, 141, 111, 49, 178, 236, 14, 80,
-    175, 241, 19, 77, 206, 144, 114, 44, 109, 51, 209, 143, 12, 82, 176, 234,
-    50, 108, 142, 208, 83, 13, 235, 177, 240, 174, 76, 18, 145, 207, 45, 115,
-    202, 148, 118, 40, 171, 245, 23, 73, 8, 86, 180, 238, 121, 39, 197, 155,
-    244, 170, 72, 22, 87, 9, 239, 181, 41, 119, 149, 203, 14, 80, 176, 232,
-    107, 53, 215, 137, 182, 232, 10, 84, 21, 75, 169, 247, 116, 42, 200, 150,
-    52, 106, 136, 214, 246, 168, 74, 20, 85, 11, 233, 183, 151, 201, 43, 117
-};
-
+// --- CRC Calculation Logic (bitwise reference, independent of the library tables) ---
 void updateCrc(uint8_t byte, uint8_t &crc) {
-    crc = crc8_table[crc ^ byte];
+    crc = crc8_bitwise(crc, byte);
 }
 
 uint8_t calculate_expected_crc(const std::vector<uint8_t>& data) {
@@ -129,11 +115,29 @@ void test_e2e_system_message_exchange(void) {
     TEST_ASSERT_EQUAL_UINT8_ARRAY(receiver.unique_id, uid_response.data, 7);
 }
 
+void test_e2e_batched_packet_transfer(void) {
+    sender.setTxBatching(true);
+    sender.sendOccupancySingle(5, true);
+    sender.sendOccupancySingle(6, false);
+    sender.flushTxBatch();
+    sender.setTxBatching(false);
+
+    receiver.update();
+
+    TEST_ASSERT_EQUAL(2, receiver.getRxQueueCount());
+    BiDiBMessage first = receiver.getLastMessage();
+    BiDiBMessage second = receiver.getLastMessage();
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, first.msg_type);
+    TEST_ASSERT_EQUAL(5, first.data[0]);
+    TEST_ASSERT_EQUAL(MSG_BM_FREE, second.msg_type);
+    TEST_ASSERT_EQUAL(6, second.data[0]);
+}
 
 void runTests() {
     UNITY_BEGIN();
     RUN_TEST(test_e2e_simple_message_transfer);
     RUN_TEST(test_e2e_system_message_exchange);
+    RUN_TEST(test_e2e_batched_packet_transfer);
     UNITY_END();
 }
 
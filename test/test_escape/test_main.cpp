@@ -0,0 +1,62 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "escape.h"
+
+static size_t reference_scan(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == 0xFE || data[i] == 0xFD) { return i; }
+    }
+    return size;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_escape_scan_clean_buffer() {
+    uint8_t buffer[100];
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = (uint8_t)(i % 0xFD); // never reaches 0xFD or 0xFE
+    }
+    for (size_t size = 0; size <= sizeof(buffer); size++) {
+        TEST_ASSERT_EQUAL(size, bidib_escape_scan(buffer, size));
+        TEST_ASSERT_EQUAL(0, bidib_escape_count(buffer, size));
+    }
+}
+
+void test_escape_scan_finds_every_position() {
+    // Bytes next to the special values (0xFC, 0xFF) must not be reported.
+    uint8_t buffer[48];
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = (i & 1) ? 0xFF : 0xFC;
+    }
+    for (size_t pos = 0; pos < sizeof(buffer); pos++) {
+        for (uint8_t special : { (uint8_t)0xFE, (uint8_t)0xFD }) {
+            uint8_t saved = buffer[pos];
+            buffer[pos] = special;
+            for (size_t offset = 0; offset <= pos; offset++) {
+                size_t size = sizeof(buffer) - offset;
+                TEST_ASSERT_EQUAL(reference_scan(buffer + offset, size), bidib_escape_scan(buffer + offset, size));
+                TEST_ASSERT_EQUAL(1, bidib_escape_count(buffer + offset, size));
+            }
+            buffer[pos] = saved;
+        }
+    }
+}
+
+void test_escape_count_all_special() {
+    uint8_t buffer[37];
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = (i % 3) ? 0xFE : 0xFD;
+    }
+    TEST_ASSERT_EQUAL(0, bidib_escape_scan(buffer, sizeof(buffer)));
+    TEST_ASSERT_EQUAL(sizeof(buffer), bidib_escape_count(buffer, sizeof(buffer)));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_escape_scan_clean_buffer);
+    RUN_TEST(test_escape_scan_finds_every_position);
+    RUN_TEST(test_escape_count_all_special);
+    UNITY_END();
+    return 0;
+}
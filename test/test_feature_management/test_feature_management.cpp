@@ -30,13 +30,8 @@ public:
 
     // Test-spezifische Methode, um den internen Zustand zu manipulieren
     void injectMessage(const BiDiBMessage& msg) {
-        // Da _lastMessage und _messageAvailable private sind, können wir nicht direkt darauf zugreifen.
-        // Für einen sauberen Test bräuchte die BiDiB-Klasse `protected`-Member
-        // oder eine `friend`-Deklaration für die Testklasse.
-        // Als Workaround ändern wir die Sichtbarkeit in der Header-Datei für die Tests.
-        // (Dies wird im nächsten Schritt erledigt)
-        _lastMessage = msg;
-        _messageAvailable = true;
+        // Legt die Nachricht in die Empfangs-Queue, als wäre sie über den Bus gekommen.
+        queueMessage(msg);
     }
 };
 
@@ -176,6 +171,59 @@ void test_handle_feature_set() {
     TEST_ASSERT_EQUAL(64, response.data[1]);
 }
 
+void test_features_beyond_sixteen_are_kept_in_order() {
+    BiDiBTestable bidib;
+
+    // Insert out of order and across several mask bytes.
+    for (int f = 200; f >= 10; f -= 5) {
+        bidib.setFeature(f, (uint8_t)(f + 1));
+    }
+    TEST_ASSERT_EQUAL(3 + 39, bidib.getFeatureCount());
+    TEST_ASSERT_TRUE(bidib.hasFeature(105));
+    TEST_ASSERT_FALSE(bidib.hasFeature(106));
+    TEST_ASSERT_EQUAL(106, bidib.getFeature(105));
+    TEST_ASSERT_EQUAL(0, bidib.getFeature(106));
+    TEST_ASSERT_EQUAL(32, bidib.getFeature(BIDIB_FEATURE_STRING_SIZE));
+
+    for (uint8_t i = 1; i < bidib.getFeatureCount(); ++i) {
+        TEST_ASSERT_TRUE(bidib.getFeatureAt(i - 1)->feature_num < bidib.getFeatureAt(i)->feature_num);
+    }
+    TEST_ASSERT_NULL(bidib.getFeatureAt(bidib.getFeatureCount()));
+
+    // Updating an existing feature does not add an entry.
+    bidib.setFeature(105, 7);
+    TEST_ASSERT_EQUAL(42, bidib.getFeatureCount());
+    TEST_ASSERT_EQUAL(7, bidib.getFeature(105));
+}
+
+void test_feature_getnext_walks_features_in_ascending_order() {
+    BiDiBTestable bidib;
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+    bidib.setFeature(255, 9);
+    bidib.setFeature(40, 5);
+
+    BiDiBMessage msg;
+    msg.msg_type = MSG_FEATURE_GETALL;
+    bidib.injectMessage(msg);
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(6, sentMessages[0].data[0]);
+    sentMessages.clear();
+
+    msg.msg_type = MSG_FEATURE_GETNEXT;
+    for (int i = 0; i < 7; ++i) {
+        bidib.injectMessage(msg);
+        bidib.handleMessages();
+    }
+    TEST_ASSERT_EQUAL(7, sentMessages.size());
+    const uint8_t expected[] = {0, 1, 2, 3, 40, 255};
+    for (int i = 0; i < 6; ++i) {
+        TEST_ASSERT_EQUAL(MSG_FEATURE, sentMessages[i].msg_type);
+        TEST_ASSERT_EQUAL(expected[i], sentMessages[i].data[0]);
+    }
+    TEST_ASSERT_EQUAL(9, sentMessages[5].data[1]);
+    TEST_ASSERT_EQUAL(MSG_FEATURE_NA, sentMessages[6].msg_type);
+    TEST_ASSERT_EQUAL(255, sentMessages[6].data[0]);
+}
 
 int main(int argc, char **argv) {
     UNITY_BEGIN();
@@ -184,6 +232,8 @@ int main(int argc, char **argv) {
     RUN_TEST(test_handle_feature_get);
     RUN_TEST(test_handle_feature_get_na);
     RUN_TEST(test_handle_feature_set);
+    RUN_TEST(test_features_beyond_sixteen_are_kept_in_order);
+    RUN_TEST(test_feature_getnext_walks_features_in_ascending_order);
     UNITY_END();
     return 0;
 }
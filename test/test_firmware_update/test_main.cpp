@@ -16,14 +16,11 @@ void setUp(void) {
     mockStream.clear();
     bidib.begin(mockStream);
 
-    // Manually add a node to the table for testing fw update on a specific node
-    BiDiBNode node1;
-    uint8_t uid[] = {0x13, 0, 0, 0, 0, 0, 1};
-    memcpy(node1.unique_id, uid, 7);
-    // This is a hack, directly accessing private members.
+    // Manually add a node with address 1 to the table for testing fw update on a specific node.
     // In a real scenario, this would be populated by the logon process.
-    memcpy(bidib._node_table[1].unique_id, uid, 7);
-    bidib._node_count = 2;
+    uint8_t uid[] = {0x13, 0, 0, 0, 0, 0, 1};
+    uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {1};
+    bidib.addNode(uid, address);
 }
 
 void tearDown(void) {}
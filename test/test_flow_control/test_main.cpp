@@ -0,0 +1,173 @@
+#include <ArduinoFake.h>
+#include <unity.h>
+#include "BiDiB.h"
+#include "mock_stream.h"
+
+using namespace fakeit;
+
+// Gives the tests a way to inject answers as if they had been received.
+class TestBiDiB : public BiDiB {
+public:
+    void receive(const BiDiBMessage &msg) { queueMessage(msg); }
+};
+
+TestBiDiB bidib;
+MockStream mockSerial;
+
+const uint8_t node_uid[7] = {0x81, 0x00, 0x0D, 0x01, 0x02, 0x03, 0x04};
+const uint8_t node_addr[BIDIB_MAX_ADDRESS_LENGTH] = {5, 0, 0, 0};
+
+static void answer_feature(uint8_t feature_num, uint8_t value);
+
+void setUp(void) {
+    ArduinoFakeReset();
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000);
+    mockSerial.clear();
+    bidib.begin(mockSerial);
+    bidib.setFlowControl(false);
+    bidib.addNode(node_uid, node_addr);
+    bidib.setFlowControl(true);
+
+    // Earlier tests may have taught the node a larger window.
+    bidib.queryFeature(5, BIDIB_FEATURE_MSG_RECEIVE_COUNT);
+    answer_feature(BIDIB_FEATURE_MSG_RECEIVE_COUNT, 1);
+    mockSerial.clear();
+}
+
+void tearDown(void) {
+    bidib.setFlowControl(false);
+}
+
+// Counts the packets written since the last call.
+static int sent_packets() {
+    int packets = 0;
+    while (mockSerial.available_outgoing() > 0) {
+        uint8_t byte = mockSerial.read_outgoing();
+        // Every packet starts and ends with MAGIC.
+        if (byte == BIDIB_MAGIC) { packets++; }
+    }
+    return packets / 2;
+}
+
+static void answer_feature(uint8_t feature_num, uint8_t value) {
+    BiDiBMessage msg;
+    msg.length = 6;
+    msg.address[0] = 5;
+    msg.address[1] = 0;
+    msg.msg_num = 1;
+    msg.msg_type = MSG_FEATURE;
+    msg.data[0] = feature_num;
+    msg.data[1] = value;
+    bidib.receive(msg);
+    bidib.handleMessages();
+}
+
+void test_requests_wait_for_credits(void) {
+    // Until the node tells otherwise, it takes one request at a time.
+    bidib.queryFeature(5, BIDIB_FEATURE_MSG_RECEIVE_COUNT);
+    bidib.vendorGet(5, "a");
+    bidib.vendorGet(5, "b");
+    bidib.vendorGet(5, "c");
+    TEST_ASSERT_EQUAL(1, sent_packets());
+    TEST_ASSERT_EQUAL(3, bidib.getFlowHeldCount());
+
+    // The answer returns the credit and announces a window of two.
+    answer_feature(BIDIB_FEATURE_MSG_RECEIVE_COUNT, 2);
+    TEST_ASSERT_EQUAL(2, sent_packets());
+    TEST_ASSERT_EQUAL(1, bidib.getFlowHeldCount());
+
+    answer_feature(BIDIB_FEATURE_MSG_RECEIVE_COUNT, 2);
+    TEST_ASSERT_EQUAL(1, sent_packets());
+    TEST_ASSERT_EQUAL(0, bidib.getFlowHeldCount());
+}
+
+void test_other_traffic_is_not_held(void) {
+    bidib.vendorGet(5, "a");
+    TEST_ASSERT_EQUAL(1, sent_packets());
+
+    // Commands that are not answered, and requests to unknown nodes, go out right away.
+    bidib.setBoosterState(false, 5);
+    bidib.vendorGet(9, "a");
+    TEST_ASSERT_EQUAL(2, sent_packets());
+
+    bidib.vendorGet(5, "b");
+    TEST_ASSERT_EQUAL(0, sent_packets());
+    TEST_ASSERT_EQUAL(1, bidib.getFlowHeldCount());
+
+    // Disabling flow control sends what is held back.
+    bidib.setFlowControl(false);
+    TEST_ASSERT_EQUAL(1, sent_packets());
+    TEST_ASSERT_EQUAL(0, bidib.getFlowHeldCount());
+}
+
+void test_unanswered_requests_time_out(void) {
+    bidib.vendorGet(5, "a");
+    bidib.vendorGet(5, "b");
+    TEST_ASSERT_EQUAL(1, sent_packets());
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + BIDIB_FLOW_TIMEOUT - 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(0, sent_packets());
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + BIDIB_FLOW_TIMEOUT);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, sent_packets());
+    TEST_ASSERT_EQUAL(1, bidib.getFlowTimeoutCount());
+    TEST_ASSERT_EQUAL(0, bidib.getFlowHeldCount());
+}
+
+void test_window_is_learnt_only_from_its_own_query(void) {
+    bidib.vendorGet(5, "a");
+    bidib.vendorGet(5, "b");
+    bidib.vendorGet(5, "c");
+    TEST_ASSERT_EQUAL(1, sent_packets());
+
+    // An occupancy node reports FEATURE_BM_SECACK_AVAILABLE under the same number. The answer
+    // returns the credit, but nobody asked for the window, so it stays at one.
+    answer_feature(FEATURE_BM_SECACK_AVAILABLE, 4);
+    TEST_ASSERT_EQUAL(1, sent_packets());
+    TEST_ASSERT_EQUAL(1, bidib.getFlowHeldCount());
+
+    answer_feature(FEATURE_BM_SECACK_AVAILABLE, 4);
+    TEST_ASSERT_EQUAL(1, sent_packets());
+    TEST_ASSERT_EQUAL(0, bidib.getFlowHeldCount());
+}
+
+static void answer_vendor_ack() {
+    BiDiBMessage msg;
+    msg.length = 5;
+    msg.address[0] = 5;
+    msg.address[1] = 0;
+    msg.msg_num = 1;
+    msg.msg_type = MSG_VENDOR_ACK;
+    msg.data[0] = 0;
+    bidib.receive(msg);
+    bidib.handleMessages();
+}
+
+void test_vendor_disable_takes_the_credit_its_ack_returns(void) {
+    // MSG_VENDOR_DISABLE is answered with MSG_VENDOR_ACK like any other request.
+    bidib.vendorDisable(5);
+    bidib.vendorGet(5, "a");
+    TEST_ASSERT_EQUAL(1, sent_packets());
+    TEST_ASSERT_EQUAL(1, bidib.getFlowHeldCount());
+
+    // Its acknowledgement frees the credit for the held request, and no more.
+    answer_vendor_ack();
+    TEST_ASSERT_EQUAL(1, sent_packets());
+    TEST_ASSERT_EQUAL(0, bidib.getFlowHeldCount());
+    bidib.vendorGet(5, "b");
+    TEST_ASSERT_EQUAL(0, sent_packets());
+    TEST_ASSERT_EQUAL(1, bidib.getFlowHeldCount());
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_requests_wait_for_credits);
+    RUN_TEST(test_other_traffic_is_not_held);
+    RUN_TEST(test_unanswered_requests_time_out);
+    RUN_TEST(test_window_is_learnt_only_from_its_own_query);
+    RUN_TEST(test_vendor_disable_takes_the_credit_its_ack_returns);
+    UNITY_END();
+    return 0;
+}
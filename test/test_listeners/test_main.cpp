@@ -0,0 +1,127 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "BiDiB.h"
+#include "mock_stream.h"
+#include <vector>
+
+// Final, so the per-test delete through this type is known to reach the right destructor.
+class TestBiDiB final : public BiDiB {
+public:
+    void injectMessage(const BiDiBMessage& msg) {
+        queueMessage(msg);
+    }
+};
+
+// A subscriber that keeps its own state instead of writing to globals.
+struct Recorder {
+    std::vector<uint8_t> detectors;
+    int occupied = 0;
+
+    static void onOccupancy(void* context, uint8_t detectorNum, bool occupied) {
+        Recorder* self = static_cast<Recorder*>(context);
+        self->detectors.push_back(detectorNum);
+        if (occupied) { self->occupied++; }
+    }
+};
+
+TestBiDiB* bidib;
+MockStream mockSerial;
+int plainCalls = 0;
+int otherPlainCalls = 0;
+uint16_t lastDriveAddress = 0;
+
+void plainCallback(uint8_t, bool) { plainCalls++; }
+void otherPlainCallback(uint8_t, bool) { otherPlainCalls++; }
+void driveListener(void* context, uint16_t address, uint8_t status) {
+    *static_cast<uint16_t*>(context) = address + status;
+}
+
+void inject(uint8_t type, uint8_t d0, uint8_t d1 = 0, uint8_t d2 = 0) {
+    BiDiBMessage msg;
+    msg.length = 6;
+    msg.address[0] = 0;
+    msg.msg_num = 1;
+    msg.msg_type = type;
+    msg.data[0] = d0;
+    msg.data[1] = d1;
+    msg.data[2] = d2;
+    bidib->injectMessage(msg);
+    bidib->handleMessages();
+}
+
+void setUp(void) {
+    bidib = new TestBiDiB();
+    bidib->begin(mockSerial);
+    plainCalls = 0;
+    otherPlainCalls = 0;
+}
+
+void tearDown(void) {
+    delete bidib;
+}
+
+void test_listeners_and_callback_all_receive_event(void) {
+    Recorder telemetry, ui;
+    bidib->onOccupancy(plainCallback);
+    TEST_ASSERT_TRUE(bidib->onOccupancy(Recorder::onOccupancy, &telemetry));
+    TEST_ASSERT_TRUE(bidib->onOccupancy(Recorder::onOccupancy, &ui));
+
+    inject(MSG_BM_OCC, 7);
+    inject(MSG_BM_FREE, 8);
+
+    TEST_ASSERT_EQUAL(2, plainCalls);
+    TEST_ASSERT_EQUAL(2, telemetry.detectors.size());
+    TEST_ASSERT_EQUAL(7, telemetry.detectors[0]);
+    TEST_ASSERT_EQUAL(8, telemetry.detectors[1]);
+    TEST_ASSERT_EQUAL(1, telemetry.occupied);
+    TEST_ASSERT_EQUAL(2, ui.detectors.size());
+}
+
+void test_plain_callback_is_still_replaced(void) {
+    bidib->onOccupancy(plainCallback);
+    bidib->onOccupancy(otherPlainCallback);
+
+    inject(MSG_BM_OCC, 1);
+    TEST_ASSERT_EQUAL(0, plainCalls);
+    TEST_ASSERT_EQUAL(1, otherPlainCalls);
+
+    bidib->onOccupancy((OccupancyCallback)nullptr);
+    inject(MSG_BM_OCC, 1);
+    TEST_ASSERT_EQUAL(1, otherPlainCalls);
+}
+
+void test_listener_list_is_bounded(void) {
+    Recorder recorders[BIDIB_MAX_LISTENERS + 1];
+    for (int i = 0; i < BIDIB_MAX_LISTENERS; ++i) {
+        TEST_ASSERT_TRUE(bidib->onOccupancy(Recorder::onOccupancy, &recorders[i]));
+    }
+    TEST_ASSERT_FALSE(bidib->onOccupancy(Recorder::onOccupancy, &recorders[BIDIB_MAX_LISTENERS]));
+}
+
+void test_remove_listener_by_context(void) {
+    Recorder telemetry;
+    uint16_t driveResult = 0;
+    bidib->onOccupancy(Recorder::onOccupancy, &telemetry);
+    bidib->onDriveAck(driveListener, &driveResult);
+
+    inject(MSG_CS_DRIVE_ACK, 0x34, 0x12, 1);
+    TEST_ASSERT_EQUAL(0x1235, driveResult);
+
+    bidib->removeListener(&telemetry);
+    inject(MSG_BM_OCC, 3);
+    TEST_ASSERT_EQUAL(0, telemetry.detectors.size());
+
+    // Listeners of other contexts stay registered.
+    inject(MSG_CS_DRIVE_ACK, 0x00, 0x01, 2);
+    TEST_ASSERT_EQUAL(0x0102, driveResult);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_listeners_and_callback_all_receive_event);
+    RUN_TEST(test_plain_callback_is_still_replaced);
+    RUN_TEST(test_listener_list_is_bounded);
+    RUN_TEST(test_remove_listener_by_context);
+    UNITY_END();
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <unity.h>
 #include "BiDiB.h"
 #include "mock_stream.h"
+#include <vector>
 
 using namespace fakeit;
 
@@ -85,9 +86,133 @@ void test_host_handles_logon_from_new_node() {
     TEST_ASSERT_EQUAL_UINT8_ARRAY(expected_node_new, actual_node_new, expected_node_new_size);
 }
 
+// Records the replies instead of writing them to a stream, so many logons can be fed in directly.
+class LogonRecorder : public BiDiB {
+public:
+    std::vector<BiDiBMessage> sent;
+    void sendMessage(const BiDiBMessage& msg) override { sent.push_back(msg); }
+    void logon(const uint8_t* uid) {
+        BiDiBMessage msg;
+        msg.length = 10;
+        msg.address[0] = 0;
+        msg.msg_num = 1;
+        msg.msg_type = MSG_LOGON;
+        memcpy(msg.data, uid, 7);
+        queueMessage(msg);
+        handleMessages();
+    }
+};
+
+static void make_uid(uint8_t* uid, uint16_t n) {
+    // Same class and vendor bytes for every node, like a batch of identical modules.
+    uint8_t base[] = {0x40, 0x0D, 0x68, 0x00, 0x00, 0x00, 0x00};
+    memcpy(uid, base, 7);
+    uid[5] = n >> 8;
+    uid[6] = n & 0xFF;
+}
+
+void test_logon_storm_assigns_addresses_and_ignores_repeats() {
+    LogonRecorder host;
+    const uint16_t nodes = BIDIB_MAX_NODES - 1 < 255 ? BIDIB_MAX_NODES - 1 : 255;
+    uint8_t uid[7];
+    for (uint16_t n = 1; n <= nodes; ++n) {
+        make_uid(uid, n);
+        host.logon(uid);
+        host.logon(uid); // Repeated logon is ignored.
+    }
+    TEST_ASSERT_EQUAL(nodes + 1, host.getNodeCount());
+    TEST_ASSERT_EQUAL(2 * nodes, host.sent.size());
+    for (uint16_t n = 1; n <= nodes; ++n) {
+        make_uid(uid, n);
+        TEST_ASSERT_EQUAL(n, host.findNode(uid));
+        uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {(uint8_t)n};
+        TEST_ASSERT_EQUAL(n, host.findNodeByAddress(address));
+        const BiDiBNode *node = host.getNode(n);
+        TEST_ASSERT_EQUAL(n, node->address[0]);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(uid, node->unique_id, 7);
+        TEST_ASSERT_EQUAL(MSG_LOGON_ACK, host.sent[2 * (n - 1)].msg_type);
+        TEST_ASSERT_EQUAL(n, host.sent[2 * (n - 1)].data[1]);
+    }
+    TEST_ASSERT_TRUE(host.getNode(nodes + 1) == nullptr);
+    make_uid(uid, 0xFFFF);
+    TEST_ASSERT_EQUAL(-1, host.findNode(uid));
+}
+
+void test_add_node_behind_hub_up_to_capacity() {
+    LogonRecorder host;
+    uint8_t uid[7];
+    uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {0};
+    for (uint16_t n = 1; n < BIDIB_MAX_NODES; ++n) {
+        make_uid(uid, n);
+        address[0] = 1 + (n >> 7);
+        address[1] = 1 + (n & 0x7F);
+        TEST_ASSERT_EQUAL(n, host.addNode(uid, address));
+    }
+    TEST_ASSERT_EQUAL(BIDIB_MAX_NODES, host.getNodeCount());
+
+    // The table is full.
+    make_uid(uid, 0x7FFF);
+    uint8_t spare[BIDIB_MAX_ADDRESS_LENGTH] = {0x7F, 0x7F, 0x7F, 0};
+    TEST_ASSERT_EQUAL(-1, host.addNode(uid, spare));
+
+    // Every node is found by unique ID and by address; a shorter address is a different node.
+    for (uint16_t n = 1; n < BIDIB_MAX_NODES; ++n) {
+        make_uid(uid, n);
+        address[0] = 1 + (n >> 7);
+        address[1] = 1 + (n & 0x7F);
+        TEST_ASSERT_EQUAL(n, host.findNode(uid));
+        TEST_ASSERT_EQUAL(n, host.findNodeByAddress(address));
+    }
+    uint8_t hub[BIDIB_MAX_ADDRESS_LENGTH] = {1, 0, 0, 0};
+    TEST_ASSERT_EQUAL(-1, host.findNodeByAddress(hub));
+    uint8_t self[BIDIB_MAX_ADDRESS_LENGTH] = {0};
+    TEST_ASSERT_EQUAL(0, host.findNodeByAddress(self));
+}
+
+void test_add_node_rejects_duplicates() {
+    LogonRecorder host;
+    uint8_t uid[7];
+    make_uid(uid, 1);
+    uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {3, 1, 0, 0};
+    TEST_ASSERT_EQUAL(1, host.addNode(uid, address));
+    TEST_ASSERT_EQUAL(-1, host.addNode(uid, address));
+    make_uid(uid, 2);
+    TEST_ASSERT_EQUAL(-1, host.addNode(uid, address)); // Address taken
+    address[1] = 2;
+    TEST_ASSERT_EQUAL(2, host.addNode(uid, address));
+}
+
+void test_logon_takes_lowest_free_address() {
+    LogonRecorder host;
+    uint8_t uid[7];
+    make_uid(uid, 1);
+    uint8_t taken[BIDIB_MAX_ADDRESS_LENGTH] = {1, 0, 0, 0};
+    TEST_ASSERT_EQUAL(1, host.addNode(uid, taken));
+    make_uid(uid, 2);
+    taken[0] = 3;
+    TEST_ASSERT_EQUAL(2, host.addNode(uid, taken));
+
+    // Addresses 1 and 3 are taken, so the next nodes get 2 and 4.
+    make_uid(uid, 3);
+    host.logon(uid);
+    make_uid(uid, 4);
+    host.logon(uid);
+    TEST_ASSERT_EQUAL(4, host.sent.size());
+    TEST_ASSERT_EQUAL(MSG_LOGON_ACK, host.sent[0].msg_type);
+    TEST_ASSERT_EQUAL(2, host.sent[0].data[1]);
+    TEST_ASSERT_EQUAL(MSG_LOGON_ACK, host.sent[2].msg_type);
+    TEST_ASSERT_EQUAL(4, host.sent[2].data[1]);
+    uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {4, 0, 0, 0};
+    TEST_ASSERT_EQUAL(4, host.findNodeByAddress(address));
+}
+
 int main(int argc, char** argv) {
     UNITY_BEGIN();
     RUN_TEST(test_host_handles_logon_from_new_node);
+    RUN_TEST(test_logon_storm_assigns_addresses_and_ignores_repeats);
+    RUN_TEST(test_add_node_behind_hub_up_to_capacity);
+    RUN_TEST(test_add_node_rejects_duplicates);
+    RUN_TEST(test_logon_takes_lowest_free_address);
     UNITY_END();
     return 0;
 }
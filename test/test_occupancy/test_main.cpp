@@ -2,6 +2,7 @@
 #include <unity.h>
 #include "BiDiB.h"
 #include "mock_stream.h"
+#include <vector>
 
 using namespace fakeit;
 
@@ -121,12 +122,231 @@ void test_handle_msg_bm_multiple() {
     TEST_ASSERT_EQUAL_UINT8_ARRAY(msg_data, lastData, 2);
 }
 
+// Records the reports of the occupancy engine instead of framing them.
+class ReportRecorder : public BiDiB {
+public:
+    std::vector<BiDiBMessage> sent;
+    void sendMessage(const BiDiBMessage& msg) override { sent.push_back(msg); }
+};
+
+void test_occupancy_engine_sends_sparse_changes_singly() {
+    MockStream mockSerial;
+    ReportRecorder bidib;
+    bidib.begin(mockSerial);
+
+    bidib.setOccupancy(5, true);
+    bidib.setOccupancy(60, true);
+    TEST_ASSERT_EQUAL(0, bidib.sent.size()); // Nothing until update()
+    bidib.update();
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, bidib.sent[0].msg_type);
+    TEST_ASSERT_EQUAL(5, bidib.sent[0].data[0]);
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, bidib.sent[1].msg_type);
+    TEST_ASSERT_EQUAL(60, bidib.sent[1].data[0]);
+
+    // Unchanged inputs and changes that cancel out before the next update() send nothing.
+    bidib.setOccupancy(5, true);
+    bidib.setOccupancy(7, true);
+    bidib.setOccupancy(7, false);
+    bidib.update();
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+
+    bidib.setOccupancy(5, false);
+    bidib.update();
+    TEST_ASSERT_EQUAL(3, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_FREE, bidib.sent[2].msg_type);
+    TEST_ASSERT_EQUAL(5, bidib.sent[2].data[0]);
+    TEST_ASSERT_FALSE(bidib.getOccupancy(5));
+    TEST_ASSERT_TRUE(bidib.getOccupancy(60));
+}
+
+void test_occupancy_engine_sends_dense_changes_as_range() {
+    MockStream mockSerial;
+    ReportRecorder bidib;
+    bidib.begin(mockSerial);
+
+    // Twelve detectors change across two bytes: one MSG_BM_MULTIPLE beats twelve single reports.
+    uint8_t inputs[] = {0xFF, 0x0F};
+    bidib.setOccupancyBitmap(16, sizeof(inputs), inputs);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_MULTIPLE, bidib.sent[0].msg_type);
+    TEST_ASSERT_EQUAL(16, bidib.sent[0].data[0]);
+    TEST_ASSERT_EQUAL(2, bidib.sent[0].data[1]);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(inputs, &bidib.sent[0].data[2], 2);
+
+    // Two changes in one byte: a one-byte range (7 bytes) beats two single reports (2 x 5).
+    bidib.sent.clear();
+    bidib.setOccupancy(41, true);
+    bidib.setOccupancy(42, true);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_MULTIPLE, bidib.sent[0].msg_type);
+    TEST_ASSERT_EQUAL(40, bidib.sent[0].data[0]);
+    TEST_ASSERT_EQUAL(1, bidib.sent[0].data[1]);
+    TEST_ASSERT_EQUAL(0x06, bidib.sent[0].data[2]);
+}
+
+void test_occupancy_engine_merges_nearby_bytes() {
+    MockStream mockSerial;
+    ReportRecorder bidib;
+    bidib.begin(mockSerial);
+
+    // Two changes in each of bytes 0 and 2: a range over bytes 0..2 (9 bytes) is cheaper than
+    // two ranges (2 x 7) or four single reports (4 x 5).
+    bidib.setOccupancy(1, true);
+    bidib.setOccupancy(2, true);
+    bidib.setOccupancy(17, true);
+    bidib.setOccupancy(18, true);
+    bidib.flushOccupancy();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_MULTIPLE, bidib.sent[0].msg_type);
+    TEST_ASSERT_EQUAL(0, bidib.sent[0].data[0]);
+    TEST_ASSERT_EQUAL(3, bidib.sent[0].data[1]);
+    uint8_t expected[] = {0x06, 0x00, 0x06};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, &bidib.sent[0].data[2], 3);
+
+    // Unaligned ranges and detectors beyond the engine are handled bit by bit.
+    bidib.sent.clear();
+    uint8_t bits[] = {0x01};
+    bidib.setOccupancyBitmap(3, 1, bits);
+    TEST_ASSERT_TRUE(bidib.getOccupancy(3));
+    TEST_ASSERT_FALSE(bidib.getOccupancy(4));
+#if BIDIB_OCCUPANCY_DETECTORS < 256
+    bidib.setOccupancy(BIDIB_OCCUPANCY_DETECTORS, true);
+#endif
+    bidib.flushOccupancy();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+    TEST_ASSERT_EQUAL(3, bidib.sent[0].data[0]);
+}
+
+void test_occupancy_debounce_filters_bounces() {
+    MockStream mockSerial;
+    ReportRecorder bidib;
+    bidib.begin(mockSerial);
+
+    // Without delays the inputs pass straight through.
+    bidib.setOccupancyInput(2, true);
+    TEST_ASSERT_TRUE(bidib.getOccupancy(2));
+
+    // Detector 10: 3 ticks to become occupied, 7 ticks to become free again.
+    bidib.setOccupancyDebounce(10, 3, 7);
+
+    // A bounce shorter than the on delay never reaches the bus.
+    bidib.setOccupancyInput(10, true);
+    bidib.tickOccupancyDebounce();
+    bidib.tickOccupancyDebounce();
+    bidib.setOccupancyInput(10, false);
+    bidib.tickOccupancyDebounce();
+    bidib.setOccupancyInput(10, true);
+    bidib.tickOccupancyDebounce();
+    bidib.tickOccupancyDebounce();
+    TEST_ASSERT_FALSE(bidib.getOccupancy(10));
+    bidib.tickOccupancyDebounce();
+    TEST_ASSERT_TRUE(bidib.getOccupancy(10));
+
+    // Dropouts shorter than the off delay are held.
+    for (int i = 0; i < 6; ++i) {
+        bidib.setOccupancyInput(10, false);
+        bidib.tickOccupancyDebounce();
+    }
+    bidib.setOccupancyInput(10, true);
+    bidib.tickOccupancyDebounce();
+    TEST_ASSERT_TRUE(bidib.getOccupancy(10));
+    bidib.setOccupancyInput(10, false);
+    for (int i = 0; i < 6; ++i) { bidib.tickOccupancyDebounce(); }
+    TEST_ASSERT_TRUE(bidib.getOccupancy(10));
+    bidib.tickOccupancyDebounce();
+    TEST_ASSERT_FALSE(bidib.getOccupancy(10));
+
+    // Only the accepted changes were reported: 2 occupied, then 10 occupied and free.
+    bidib.flushOccupancy();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+    TEST_ASSERT_EQUAL(2, bidib.sent[0].data[0]);
+}
+
+void test_occupancy_debounce_handles_all_detectors_per_tick() {
+    MockStream mockSerial;
+    ReportRecorder bidib;
+    bidib.begin(mockSerial);
+    bidib.setOccupancyDebounce(2, 4);
+
+    // Every detector goes occupied at once: after the on delay they are reported as one range.
+    uint8_t all[BIDIB_OCCUPANCY_DETECTORS / 8];
+    memset(all, 0xFF, sizeof(all));
+    bidib.setOccupancyInputBitmap(0, sizeof(all), all);
+    bidib.tickOccupancyDebounce();
+    bidib.flushOccupancy();
+    TEST_ASSERT_EQUAL(0, bidib.sent.size());
+    bidib.tickOccupancyDebounce();
+    bidib.flushOccupancy();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_MULTIPLE, bidib.sent[0].msg_type);
+    TEST_ASSERT_EQUAL(sizeof(all), bidib.sent[0].data[1]);
+    for (int i = 0; i < BIDIB_OCCUPANCY_DETECTORS; ++i) {
+        TEST_ASSERT_TRUE(bidib.getOccupancy(i));
+    }
+
+    // The last detector drops out; it is freed after the off delay only.
+    bidib.setOccupancyInput(BIDIB_OCCUPANCY_DETECTORS - 1, false);
+    for (int i = 0; i < 3; ++i) { bidib.tickOccupancyDebounce(); }
+    TEST_ASSERT_TRUE(bidib.getOccupancy(BIDIB_OCCUPANCY_DETECTORS - 1));
+    bidib.tickOccupancyDebounce();
+    TEST_ASSERT_FALSE(bidib.getOccupancy(BIDIB_OCCUPANCY_DETECTORS - 1));
+    TEST_ASSERT_TRUE(bidib.getOccupancy(BIDIB_OCCUPANCY_DETECTORS - 2));
+
+    // update() drives the ticks from millis().
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000);
+    bidib.setOccupancyInput(0, false);
+    bidib.update();
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + BIDIB_DEBOUNCE_TICK_MS);
+    bidib.update();
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + BIDIB_DEBOUNCE_TICK_MS + 1);
+    bidib.update();
+    TEST_ASSERT_TRUE(bidib.getOccupancy(0));
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + 4 * BIDIB_DEBOUNCE_TICK_MS);
+    bidib.update();
+    bidib.update();
+    TEST_ASSERT_TRUE(bidib.getOccupancy(0));
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + 6 * BIDIB_DEBOUNCE_TICK_MS);
+    bidib.update();
+    TEST_ASSERT_FALSE(bidib.getOccupancy(0));
+}
+
+void test_occupancy_set_directly_survives_debounce() {
+    MockStream mockSerial;
+    ReportRecorder bidib;
+    bidib.begin(mockSerial);
+    bidib.setOccupancyDebounce(2, 2);
+
+    // A state set directly is taken over at once and is not undone by the next ticks.
+    bidib.setOccupancy(5, true);
+    uint8_t byte = 0xFF;
+    bidib.setOccupancyBitmap(8, 1, &byte);
+    bidib.tickOccupancyDebounce();
+    bidib.tickOccupancyDebounce();
+    TEST_ASSERT_TRUE(bidib.getOccupancy(5));
+    TEST_ASSERT_TRUE(bidib.getOccupancy(12));
+
+    // A half-counted input change is dropped as well.
+    bidib.setOccupancyInput(6, true);
+    bidib.tickOccupancyDebounce();
+    bidib.setOccupancy(6, false);
+    bidib.tickOccupancyDebounce();
+    TEST_ASSERT_FALSE(bidib.getOccupancy(6));
+}
 
 int main() {
     UNITY_BEGIN();
     RUN_TEST(test_handle_msg_bm_occ);
     RUN_TEST(test_handle_msg_bm_free);
     RUN_TEST(test_handle_msg_bm_multiple);
+    RUN_TEST(test_occupancy_engine_sends_sparse_changes_singly);
+    RUN_TEST(test_occupancy_engine_sends_dense_changes_as_range);
+    RUN_TEST(test_occupancy_engine_merges_nearby_bytes);
+    RUN_TEST(test_occupancy_debounce_filters_bounces);
+    RUN_TEST(test_occupancy_debounce_handles_all_detectors_per_tick);
+    RUN_TEST(test_occupancy_set_directly_survives_debounce);
     UNITY_END();
     return 0;
 }
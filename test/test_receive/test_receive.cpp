@@ -0,0 +1,293 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "BiDiB.h"
+#include "mock_stream.h"
+
+BiDiB bidib;
+MockStream mockSerial;
+
+int occupancyCallbackCount = 0;
+uint8_t occupancyDetectors[8];
+
+void countingOccupancyCallback(uint8_t detectorNum, bool occupied) {
+    if (occupancyCallbackCount < (int)sizeof(occupancyDetectors)) {
+        occupancyDetectors[occupancyCallbackCount] = detectorNum;
+    }
+    occupancyCallbackCount++;
+}
+
+// Helper to build a framed message using the library's own CRC logic
+void build_message(uint8_t* buffer, size_t& size, const uint8_t* payload, size_t payload_size) {
+    buffer[0] = BIDIB_MAGIC;
+    memcpy(&buffer[1], payload, payload_size);
+    buffer[payload_size + 1] = bidib.calculateCrc(payload, payload_size);
+    buffer[payload_size + 2] = BIDIB_MAGIC;
+    size = payload_size + 3;
+}
+
+void setUp(void) {
+    mockSerial.clear();
+    bidib.begin(mockSerial);
+    bidib.onOccupancy(countingOccupancyCallback);
+    occupancyCallbackCount = 0;
+}
+
+void tearDown(void) {}
+
+void test_receive_frame_split_across_updates(void) {
+    uint8_t payload[] = { 0x05, 0x00, 0x07, MSG_BM_OCC, 0x0C, 0x34 };
+    uint8_t frame[sizeof(payload) + 3];
+    size_t frame_size;
+    build_message(frame, frame_size, payload, sizeof(payload));
+
+    // Deliver the frame one byte per loop pass.
+    for (size_t i = 0; i < frame_size - 1; ++i) {
+        mockSerial.addIncoming(&frame[i], 1);
+        bidib.update();
+        TEST_ASSERT_FALSE(bidib.messageAvailable());
+    }
+    mockSerial.addIncoming(&frame[frame_size - 1], 1);
+    bidib.update();
+
+    TEST_ASSERT_TRUE(bidib.messageAvailable());
+    BiDiBMessage msg = bidib.getLastMessage();
+    TEST_ASSERT_EQUAL(5, msg.length);
+    TEST_ASSERT_EQUAL(0, msg.address[0]);
+    TEST_ASSERT_EQUAL(7, msg.msg_num);
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, msg.msg_type);
+    TEST_ASSERT_EQUAL(0x0C, msg.data[0]);
+    TEST_ASSERT_EQUAL(0x34, msg.data[1]);
+}
+
+void test_receive_escape_split_across_updates(void) {
+    // Payload byte 0xFE must be escaped on the wire as 0xFD 0xDE.
+    uint8_t payload[] = { 0x04, 0x00, 0x01, MSG_BM_OCC, 0xFE };
+    uint8_t crc = bidib.calculateCrc(payload, sizeof(payload));
+    uint8_t first[] = { BIDIB_MAGIC, 0x04, 0x00, 0x01, MSG_BM_OCC, BIDIB_ESCAPE };
+    uint8_t second[] = { 0xFE ^ 0x20, crc, BIDIB_MAGIC };
+
+    mockSerial.addIncoming(first, sizeof(first));
+    bidib.update();
+    TEST_ASSERT_FALSE(bidib.messageAvailable());
+
+    mockSerial.addIncoming(second, sizeof(second));
+    bidib.update();
+    TEST_ASSERT_TRUE(bidib.messageAvailable());
+    TEST_ASSERT_EQUAL(0xFE, bidib.getLastMessage().data[0]);
+}
+
+void test_receive_rejects_bad_length_and_resyncs(void) {
+    // MSG_LENGTH larger than any message the library can hold.
+    uint8_t bad[] = { BIDIB_MAGIC, 0xF0, 0x00, 0x01, MSG_BM_OCC, 0x01, 0x02, 0x03 };
+    mockSerial.addIncoming(bad, sizeof(bad));
+
+    uint8_t payload[] = { 0x04, 0x00, 0x02, MSG_BM_FREE, 0x05 };
+    uint8_t frame[sizeof(payload) + 3];
+    size_t frame_size;
+    build_message(frame, frame_size, payload, sizeof(payload));
+    mockSerial.addIncoming(frame, frame_size);
+
+    bidib.update();
+    TEST_ASSERT_TRUE(bidib.messageAvailable());
+    BiDiBMessage msg = bidib.getLastMessage();
+    TEST_ASSERT_EQUAL(MSG_BM_FREE, msg.msg_type);
+    TEST_ASSERT_EQUAL(5, msg.data[0]);
+}
+
+void test_receive_rejects_bad_crc(void) {
+    uint8_t payload[] = { 0x04, 0x00, 0x02, MSG_BM_FREE, 0x05 };
+    uint8_t frame[sizeof(payload) + 3];
+    size_t frame_size;
+    build_message(frame, frame_size, payload, sizeof(payload));
+    frame[frame_size - 2] ^= 0x01;
+    mockSerial.addIncoming(frame, frame_size);
+
+    bidib.update();
+    TEST_ASSERT_FALSE(bidib.messageAvailable());
+}
+
+void test_receive_queue_keeps_back_to_back_frames(void) {
+    for (uint8_t detector = 1; detector <= 3; ++detector) {
+        uint8_t payload[] = { 0x04, 0x00, detector, MSG_BM_OCC, detector };
+        uint8_t frame[sizeof(payload) + 3];
+        size_t frame_size;
+        build_message(frame, frame_size, payload, sizeof(payload));
+        mockSerial.addIncoming(frame, frame_size);
+    }
+
+    bidib.update();
+    TEST_ASSERT_EQUAL(3, bidib.getRxQueueCount());
+
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(0, bidib.getRxQueueCount());
+    TEST_ASSERT_EQUAL(3, occupancyCallbackCount);
+    TEST_ASSERT_EQUAL(1, occupancyDetectors[0]);
+    TEST_ASSERT_EQUAL(2, occupancyDetectors[1]);
+    TEST_ASSERT_EQUAL(3, occupancyDetectors[2]);
+}
+
+void test_receive_queue_counts_overflow(void) {
+    for (int i = 0; i < BIDIB_RX_QUEUE_SIZE + 2; ++i) {
+        uint8_t payload[] = { 0x04, 0x00, 0x01, MSG_BM_FREE, (uint8_t)i };
+        uint8_t frame[sizeof(payload) + 3];
+        size_t frame_size;
+        build_message(frame, frame_size, payload, sizeof(payload));
+        mockSerial.addIncoming(frame, frame_size);
+    }
+
+    bidib.update();
+    TEST_ASSERT_EQUAL(BIDIB_RX_QUEUE_SIZE, bidib.getRxQueueCount());
+    TEST_ASSERT_EQUAL(2, bidib.getRxOverflowCount());
+
+    // The oldest messages are kept, the newest ones were dropped.
+    TEST_ASSERT_EQUAL(0, bidib.getLastMessage().data[0]);
+    TEST_ASSERT_EQUAL(BIDIB_RX_QUEUE_SIZE - 1, bidib.getRxQueueCount());
+}
+
+void test_receive_message_sequence_in_one_packet(void) {
+    // MAGIC MESSAGE_SEQ CRC MAGIC with three messages sharing one CRC.
+    uint8_t seq[] = {
+        0x04, 0x00, 0x01, MSG_BM_OCC, 0x0A,
+        0x04, 0x00, 0x02, MSG_BM_FREE, 0x0B,
+        0x03, 0x00, 0x03, MSG_SYS_GET_MAGIC
+    };
+    uint8_t packet[sizeof(seq) + 3];
+    size_t packet_size;
+    build_message(packet, packet_size, seq, sizeof(seq));
+
+    // Split the packet in the middle of the second message.
+    mockSerial.addIncoming(packet, 8);
+    bidib.update();
+    TEST_ASSERT_EQUAL(0, bidib.getRxQueueCount());
+    mockSerial.addIncoming(packet + 8, packet_size - 8);
+    bidib.update();
+
+    TEST_ASSERT_EQUAL(3, bidib.getRxQueueCount());
+    BiDiBMessage first = bidib.getLastMessage();
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, first.msg_type);
+    TEST_ASSERT_EQUAL(0x0A, first.data[0]);
+    BiDiBMessage second = bidib.getLastMessage();
+    TEST_ASSERT_EQUAL(MSG_BM_FREE, second.msg_type);
+    TEST_ASSERT_EQUAL(2, second.msg_num);
+    TEST_ASSERT_EQUAL(0x0B, second.data[0]);
+    BiDiBMessage third = bidib.getLastMessage();
+    TEST_ASSERT_EQUAL(3, third.length);
+    TEST_ASSERT_EQUAL(MSG_SYS_GET_MAGIC, third.msg_type);
+}
+
+void test_receive_message_sequence_with_bad_crc_is_dropped(void) {
+    uint8_t seq[] = {
+        0x04, 0x00, 0x01, MSG_BM_OCC, 0x0A,
+        0x04, 0x00, 0x02, MSG_BM_FREE, 0x0B
+    };
+    uint8_t packet[sizeof(seq) + 3];
+    size_t packet_size;
+    build_message(packet, packet_size, seq, sizeof(seq));
+    packet[4] ^= 0x01; // corrupt the first message
+
+    mockSerial.addIncoming(packet, packet_size);
+    bidib.update();
+    TEST_ASSERT_EQUAL(0, bidib.getRxQueueCount());
+}
+
+// Frames a payload the way a sender does, escaping MAGIC and ESCAPE in content and CRC.
+size_t build_escaped_message(uint8_t* buffer, const uint8_t* payload, size_t payload_size) {
+    size_t n = 0;
+    buffer[n++] = BIDIB_MAGIC;
+    uint8_t crc = bidib.calculateCrc(payload, payload_size);
+    for (size_t i = 0; i <= payload_size; ++i) {
+        uint8_t byte = (i < payload_size) ? payload[i] : crc;
+        if (byte == BIDIB_MAGIC || byte == BIDIB_ESCAPE) {
+            buffer[n++] = BIDIB_ESCAPE;
+            buffer[n++] = byte ^ 0x20;
+        } else {
+            buffer[n++] = byte;
+        }
+    }
+    buffer[n++] = BIDIB_MAGIC;
+    return n;
+}
+
+void test_receive_large_payload_with_scattered_escapes(void) {
+    // Maximum payload: long clean runs broken up by a few bytes that need escaping.
+    uint8_t payload[4 + BIDIB_MAX_DATA_LENGTH] = { 3 + BIDIB_MAX_DATA_LENGTH, 0x00, 0x09, MSG_BM_MULTIPLE };
+    for (int i = 0; i < BIDIB_MAX_DATA_LENGTH; ++i) {
+        payload[4 + i] = (uint8_t)(i * 7);
+    }
+    payload[4 + 5] = BIDIB_MAGIC;
+    payload[4 + 6] = BIDIB_ESCAPE;
+    payload[4 + 40] = BIDIB_MAGIC;
+    payload[4 + BIDIB_MAX_DATA_LENGTH - 1] = BIDIB_ESCAPE;
+    uint8_t frame[2 * sizeof(payload) + 4];
+    size_t frame_size = build_escaped_message(frame, payload, sizeof(payload));
+
+    // Once in one go, once in pieces that split runs and escape sequences at odd places.
+    for (size_t piece : { frame_size, (size_t)7 }) {
+        for (size_t pos = 0; pos < frame_size; pos += piece) {
+            mockSerial.addIncoming(&frame[pos], (frame_size - pos < piece) ? frame_size - pos : piece);
+            bidib.update();
+        }
+
+        TEST_ASSERT_EQUAL(1, bidib.getRxQueueCount());
+        BiDiBMessage msg = bidib.getLastMessage();
+        TEST_ASSERT_EQUAL(payload[0], msg.length);
+        TEST_ASSERT_EQUAL(MSG_BM_MULTIPLE, msg.msg_type);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(&payload[4], msg.data, BIDIB_MAX_DATA_LENGTH);
+    }
+}
+
+void test_receive_message_view_points_into_queue(void) {
+    uint8_t payload[] = { 0x07, 0x02, 0x01, 0x00, 0x0A, MSG_BM_OCC, 0x0C, 0x34 };
+    uint8_t frame[sizeof(payload) + 3];
+    size_t frame_size;
+    build_message(frame, frame_size, payload, sizeof(payload));
+
+    TEST_ASSERT_FALSE(bidib.peekMessage().valid());
+
+    mockSerial.addIncoming(frame, frame_size);
+    bidib.update();
+    BiDiBMessageView view = bidib.peekMessage();
+    TEST_ASSERT_TRUE(view.valid());
+    TEST_ASSERT_EQUAL(7, view.length());
+    TEST_ASSERT_EQUAL(3, view.addressLength());
+    TEST_ASSERT_EQUAL(2, view.address()[0]);
+    TEST_ASSERT_EQUAL(1, view.address()[1]);
+    TEST_ASSERT_EQUAL(0x0A, view.msgNum());
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, view.msgType());
+    TEST_ASSERT_EQUAL(2, view.dataLength());
+    TEST_ASSERT_EQUAL(0x0C, view.data()[0]);
+    TEST_ASSERT_EQUAL(0x34, view.data()[1]);
+
+    // A second message is decoded into another slot; the view is unaffected.
+    payload[4] = 0x0B;
+    payload[6] = 0x0D;
+    build_message(frame, frame_size, payload, sizeof(payload));
+    mockSerial.addIncoming(frame, frame_size);
+    bidib.update();
+    TEST_ASSERT_EQUAL(2, bidib.getRxQueueCount());
+    TEST_ASSERT_EQUAL(0x0A, view.msgNum());
+    TEST_ASSERT_EQUAL(0x0C, view.data()[0]);
+
+    bidib.releaseMessage();
+    TEST_ASSERT_EQUAL(1, bidib.getRxQueueCount());
+    TEST_ASSERT_EQUAL(0x0B, bidib.peekMessage().msgNum());
+    bidib.releaseMessage();
+    bidib.releaseMessage(); // releasing an empty queue is harmless
+    TEST_ASSERT_EQUAL(0, bidib.getRxQueueCount());
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_receive_frame_split_across_updates);
+    RUN_TEST(test_receive_escape_split_across_updates);
+    RUN_TEST(test_receive_rejects_bad_length_and_resyncs);
+    RUN_TEST(test_receive_rejects_bad_crc);
+    RUN_TEST(test_receive_queue_keeps_back_to_back_frames);
+    RUN_TEST(test_receive_queue_counts_overflow);
+    RUN_TEST(test_receive_message_sequence_in_one_packet);
+    RUN_TEST(test_receive_message_sequence_with_bad_crc_is_dropped);
+    RUN_TEST(test_receive_large_payload_with_scattered_escapes);
+    RUN_TEST(test_receive_message_view_points_into_queue);
+    UNITY_END();
+    return 0;
+}
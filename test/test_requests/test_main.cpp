@@ -0,0 +1,195 @@
+#include <ArduinoFake.h>
+#include <unity.h>
+#include "BiDiB.h"
+#include "mock_stream.h"
+#include <vector>
+
+using namespace fakeit;
+
+// Gives the tests a way to inject answers as if they had been received.
+class TestBiDiB : public BiDiB {
+public:
+    void receive(const BiDiBMessage &msg) { queueMessage(msg); }
+};
+
+TestBiDiB bidib;
+MockStream mockSerial;
+
+// One entry per completed request: the context it was sent with and the answer's type (0 on timeout).
+struct Completion
+{
+    void *context;
+    uint8_t reply_type;
+    uint8_t data0;
+};
+std::vector<Completion> completions;
+
+void recordCompletion(void *context, const BiDiBMessage *reply) {
+    Completion completion = {context, 0, 0};
+    if (reply != nullptr) {
+        completion.reply_type = reply->msg_type;
+        completion.data0 = reply->data[0];
+    }
+    completions.push_back(completion);
+}
+
+static void answer(uint8_t node, uint8_t msg_num, uint8_t type, uint8_t data0) {
+    BiDiBMessage msg;
+    msg.length = 6;
+    msg.address[0] = node;
+    msg.address[1] = 0;
+    msg.msg_num = msg_num;
+    msg.msg_type = type;
+    msg.data[0] = data0;
+    msg.data[1] = 0;
+    bidib.receive(msg);
+    bidib.handleMessages();
+}
+
+void setUp(void) {
+    ArduinoFakeReset();
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000);
+    mockSerial.clear();
+    bidib.begin(mockSerial);
+    bidib.setRequestTimeout(BIDIB_REQUEST_TIMEOUT);
+    completions.clear();
+}
+
+void tearDown(void) {}
+
+void test_pipelined_requests_complete_with_their_answers(void) {
+    int a, b, c;
+    TEST_ASSERT_TRUE(bidib.queryFeature(5, BIDIB_FEATURE_MSG_RECEIVE_COUNT, recordCompletion, &a));
+    TEST_ASSERT_TRUE(bidib.queryFeature(5, BIDIB_FEATURE_STRING_SIZE, recordCompletion, &b));
+    TEST_ASSERT_TRUE(bidib.vendorGet(6, "name", recordCompletion, &c));
+    TEST_ASSERT_EQUAL(3, bidib.getPendingRequestCount());
+
+    // Answers of other nodes and types do not disturb the order per node.
+    answer(6, 0, MSG_VENDOR, 4);
+    answer(5, 0, MSG_FEATURE, BIDIB_FEATURE_MSG_RECEIVE_COUNT);
+    answer(5, 0, MSG_FEATURE_NA, BIDIB_FEATURE_STRING_SIZE);
+    answer(5, 0, MSG_FEATURE, 0); // nobody asks any more
+
+    TEST_ASSERT_EQUAL(3, completions.size());
+    TEST_ASSERT_TRUE(&c == completions[0].context);
+    TEST_ASSERT_EQUAL(MSG_VENDOR, completions[0].reply_type);
+    TEST_ASSERT_TRUE(&a == completions[1].context);
+    TEST_ASSERT_EQUAL(BIDIB_FEATURE_MSG_RECEIVE_COUNT, completions[1].data0);
+    TEST_ASSERT_TRUE(&b == completions[2].context);
+    TEST_ASSERT_EQUAL(MSG_FEATURE_NA, completions[2].reply_type);
+    TEST_ASSERT_EQUAL(0, bidib.getPendingRequestCount());
+}
+
+void test_echoed_msg_num_selects_the_request(void) {
+    BiDiBMessage msg;
+    msg.length = 4;
+    msg.address[0] = 7;
+    msg.address[1] = 0;
+    msg.msg_type = MSG_BOOST_QUERY;
+    int first, second;
+    msg.msg_num = 10;
+    bidib.sendRequest(msg, MSG_BOOST_STAT, recordCompletion, &first);
+    msg.msg_num = 11;
+    bidib.sendRequest(msg, MSG_BOOST_STAT, recordCompletion, &second);
+
+    answer(7, 11, MSG_BOOST_STAT, 0x80);
+    TEST_ASSERT_EQUAL(1, completions.size());
+    TEST_ASSERT_TRUE(&second == completions[0].context);
+    TEST_ASSERT_EQUAL(1, bidib.getPendingRequestCount());
+
+    answer(7, 10, MSG_BOOST_STAT, 0x81);
+    TEST_ASSERT_TRUE(&first == completions[1].context);
+    TEST_ASSERT_EQUAL(0, bidib.getPendingRequestCount());
+}
+
+void test_unanswered_requests_time_out(void) {
+    int contexts[BIDIB_MAX_PENDING_REQUESTS];
+    for (int i = 0; i < BIDIB_MAX_PENDING_REQUESTS; ++i) {
+        TEST_ASSERT_TRUE(bidib.queryBooster(3, recordCompletion, &contexts[i]));
+    }
+    int extra;
+    TEST_ASSERT_FALSE(bidib.queryBooster(3, recordCompletion, &extra));
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + BIDIB_REQUEST_TIMEOUT - 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(0, completions.size());
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + BIDIB_REQUEST_TIMEOUT);
+    bidib.update();
+    TEST_ASSERT_EQUAL(BIDIB_MAX_PENDING_REQUESTS, completions.size());
+    TEST_ASSERT_TRUE(&contexts[0] == completions[0].context);
+    TEST_ASSERT_EQUAL(0, completions[0].reply_type);
+    TEST_ASSERT_EQUAL(0, bidib.getPendingRequestCount());
+
+    // A late answer finds nobody waiting.
+    answer(3, 0, MSG_BOOST_STAT, 0x80);
+    TEST_ASSERT_EQUAL(BIDIB_MAX_PENDING_REQUESTS, completions.size());
+}
+
+void test_answered_requests_free_their_slots(void) {
+    // The oldest request stays unanswered while all later ones are answered.
+    int contexts[BIDIB_MAX_PENDING_REQUESTS];
+    TEST_ASSERT_TRUE(bidib.queryBooster(3, recordCompletion, &contexts[0]));
+    for (int i = 1; i < BIDIB_MAX_PENDING_REQUESTS; ++i) {
+        TEST_ASSERT_TRUE(bidib.queryBooster(4, recordCompletion, &contexts[i]));
+    }
+    for (int i = 1; i < BIDIB_MAX_PENDING_REQUESTS; ++i) {
+        answer(4, 0, MSG_BOOST_STAT, 0x80);
+    }
+    TEST_ASSERT_EQUAL(1, bidib.getPendingRequestCount());
+
+    int next;
+    TEST_ASSERT_TRUE(bidib.queryBooster(4, recordCompletion, &next));
+    TEST_ASSERT_EQUAL(2, bidib.getPendingRequestCount());
+
+    answer(4, 0, MSG_BOOST_STAT, 0x80);
+    answer(3, 0, MSG_BOOST_STAT, 0x80);
+    TEST_ASSERT_EQUAL(0, bidib.getPendingRequestCount());
+}
+
+void test_held_request_times_out_from_when_it_is_sent(void) {
+    const uint8_t uid[7] = {0x81, 0x00, 0x0D, 0x01, 0x02, 0x03, 0x06};
+    const uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {5, 0, 0, 0};
+    bidib.addNode(uid, address);
+    bidib.setFlowControl(true);
+
+    // The node takes one request at a time, so the second one is held back.
+    int first, second;
+    TEST_ASSERT_TRUE(bidib.queryFeature(5, BIDIB_FEATURE_MSG_RECEIVE_COUNT, recordCompletion, &first));
+    TEST_ASSERT_TRUE(bidib.queryFeature(5, BIDIB_FEATURE_STRING_SIZE, recordCompletion, &second));
+    TEST_ASSERT_EQUAL(1, bidib.getFlowHeldCount());
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1000 + BIDIB_REQUEST_TIMEOUT);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, completions.size());
+    TEST_ASSERT_TRUE(&first == completions[0].context);
+    TEST_ASSERT_EQUAL(1, bidib.getPendingRequestCount());
+
+    // The late answer to the first request releases the second one without completing it.
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1600);
+    answer(5, 0, MSG_FEATURE, BIDIB_FEATURE_MSG_RECEIVE_COUNT);
+    TEST_ASSERT_EQUAL(1, completions.size());
+    TEST_ASSERT_EQUAL(0, bidib.getFlowHeldCount());
+
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(1600 + BIDIB_REQUEST_TIMEOUT - 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, completions.size());
+
+    answer(5, 0, MSG_FEATURE, BIDIB_FEATURE_STRING_SIZE);
+    TEST_ASSERT_EQUAL(2, completions.size());
+    TEST_ASSERT_TRUE(&second == completions[1].context);
+    TEST_ASSERT_EQUAL(BIDIB_FEATURE_STRING_SIZE, completions[1].data0);
+
+    bidib.setFlowControl(false);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_pipelined_requests_complete_with_their_answers);
+    RUN_TEST(test_echoed_msg_num_selects_the_request);
+    RUN_TEST(test_unanswered_requests_time_out);
+    RUN_TEST(test_answered_requests_free_their_slots);
+    RUN_TEST(test_held_request_times_out_from_when_it_is_sent);
+    UNITY_END();
+    return 0;
+}
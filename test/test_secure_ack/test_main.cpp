@@ -2,45 +2,564 @@
 #include <unity.h>
 #include "BiDiB.h"
 #include "mock_stream.h"
-
-// @todo: This test is currently disabled due to a persistent SIGABRT error.
-// The crash occurs during the setup of the test, likely due to a stack
-// or memory allocation issue related to the size of the BiDiB object when
-// used with ArduinoFake and the Unity test runner. This issue was exposed
-// by the addition of a new member variable (_addressCallback) to the BiDiB class.
-//
-// Extensive debugging steps were taken without success:
-// 1. Refactored test from inheritance to composition to avoid vtable/sizing issues.
-// 2. Refactored from global/static object instances to dynamic allocation within setUp/tearDown.
-// 3. Performed a clean build of the test environment (`platformio run --target clean`).
-// 4. Systematically rebuilt the test from a minimal case. The crash appears after
-//    the BiDiB object is instantiated and interacted with (e.g., calling begin() or setFeature()).
-//
-// The test needs a more in-depth investigation, possibly with a native debugger,
-// to resolve this issue. For now, it is disabled with a placeholder test to allow the
-// rest of the CI pipeline to pass.
+#include <vector>
 
 using namespace fakeit;
 
+// Records everything the node sends instead of framing it.
+class TestBiDiB : public BiDiB {
+public:
+    std::vector<BiDiBMessage> sent;
+
+    void sendMessage(const BiDiBMessage& msg) override {
+        sent.push_back(msg);
+    }
+
+    void injectMessage(const BiDiBMessage& msg) {
+        queueMessage(msg);
+    }
+};
+
+MockStream mockSerial;
+
+void setClock(unsigned long now) {
+    When(Method(ArduinoFake(), millis)).AlwaysReturn(now);
+}
+
+void mirror(TestBiDiB& bidib, uint8_t type, uint8_t key) {
+    BiDiBMessage msg;
+    msg.length = 4;
+    msg.address[0] = 0;
+    msg.msg_num = 0;
+    msg.msg_type = type;
+    msg.data[0] = key;
+    bidib.injectMessage(msg);
+    bidib.handleMessages();
+}
+
 void setUp(void) {
-    // Intentionally left empty
+    ArduinoFakeReset();
+    setClock(1000);
+    mockSerial.clear();
+}
+
+void tearDown(void) {}
+
+void test_secure_ack_occurs_and_is_confirmed(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    bidib.sendOccupancySingle(5, true);
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+    TEST_ASSERT_EQUAL(1, bidib.getPendingSecureAckCount());
+
+    mirror(bidib, MSG_BM_MIRROR_OCC, 5);
+    TEST_ASSERT_EQUAL(0, bidib.getPendingSecureAckCount());
+
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+}
+
+void test_secure_ack_timeout_triggers_resend(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    uint8_t bitmap[] = {0x12, 0x34, 0x56};
+    bidib.sendOccupancyMultiple(16, sizeof(bitmap), bitmap);
+
+    setClock(1000 + SECURE_ACK_TIMEOUT);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+
+    // The resent message is restored completely from its encoded copy.
+    const BiDiBMessage& resent = bidib.sent[1];
+    TEST_ASSERT_EQUAL(bidib.sent[0].length, resent.length);
+    TEST_ASSERT_EQUAL(MSG_BM_MULTIPLE, resent.msg_type);
+    TEST_ASSERT_EQUAL(16, resent.data[0]);
+    TEST_ASSERT_EQUAL(sizeof(bitmap), resent.data[1]);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bitmap, &resent.data[2], sizeof(bitmap));
+}
+
+void test_secure_ack_gives_up_after_max_retries(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    bidib.sendOccupancySingle(7, false);
+    unsigned long now = 1000;
+    for (int i = 0; i <= SECURE_ACK_RETRIES; ++i) {
+        // Longer than any backed-off timeout plus jitter, so every step is one timeout.
+        now += 2 * BIDIB_SECACK_MAX_TIMEOUT;
+        setClock(now);
+        bidib.update();
+    }
+    TEST_ASSERT_EQUAL(1 + SECURE_ACK_RETRIES, bidib.sent.size());
+    TEST_ASSERT_EQUAL(0, bidib.getPendingSecureAckCount());
+    TEST_ASSERT_EQUAL(SECURE_ACK_RETRIES, bidib.getSecureAckRetransmitCount());
+    TEST_ASSERT_EQUAL(1, bidib.getSecureAckFailureCount());
+}
+
+void test_secure_ack_many_reports_in_flight(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) {
+        bidib.sendOccupancySingle(i, true);
+    }
+    TEST_ASSERT_EQUAL(MAX_PENDING_SECURE_ACKS, bidib.getPendingSecureAckCount());
+
+    // The list is full; the next report is dropped without being sent.
+    bidib.sendOccupancySingle(200, true);
+    TEST_ASSERT_EQUAL(MAX_PENDING_SECURE_ACKS, bidib.sent.size());
+
+    // Confirm one from the middle; the rest is resent in the original order.
+    mirror(bidib, MSG_BM_MIRROR_OCC, 3);
+    TEST_ASSERT_EQUAL(MAX_PENDING_SECURE_ACKS - 1, bidib.getPendingSecureAckCount());
+
+    bidib.sent.clear();
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(MAX_PENDING_SECURE_ACKS - 1, bidib.sent.size());
+    for (int i = 0; i < MAX_PENDING_SECURE_ACKS - 1; ++i) {
+        TEST_ASSERT_EQUAL(MSG_BM_OCC, bidib.sent[i].msg_type);
+        TEST_ASSERT_EQUAL(i < 3 ? i : i + 1, bidib.sent[i].data[0]);
+    }
+}
+
+void test_secure_ack_resends_in_deadline_order(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    setClock(1000); bidib.sendOccupancySingle(1, true);
+    setClock(1300); bidib.sendOccupancySingle(2, true);
+    setClock(1600); bidib.sendOccupancySingle(3, true);
+
+    // Only detector 1 is due; it is rescheduled behind the others.
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(4, bidib.sent.size());
+    TEST_ASSERT_EQUAL(1, bidib.sent[3].data[0]);
+
+    // Confirming the entry in the middle keeps the schedule of the others.
+    mirror(bidib, MSG_BM_MIRROR_OCC, 2);
+    setClock(1600 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(5, bidib.sent.size());
+    TEST_ASSERT_EQUAL(3, bidib.sent[4].data[0]);
+
+    // Detectors 1 and 3 now wait twice their first timeout plus up to a quarter of jitter, i.e.
+    // until 4501 and 5101 at the latest. Detector 4 waits the timeout measured from the mirror of detector 2.
+    setClock(3100);
+    bidib.sendOccupancySingle(4, false);
+    TEST_ASSERT_TRUE(3100 + bidib.getSecureAckTimeout() > 5101);
+    bidib.sent.clear();
+
+    // Everything is overdue; the resends follow the deadlines.
+    setClock(10000);
+    bidib.update();
+    TEST_ASSERT_EQUAL(3, bidib.sent.size());
+    TEST_ASSERT_EQUAL(1, bidib.sent[0].data[0]);
+    TEST_ASSERT_EQUAL(3, bidib.sent[1].data[0]);
+    TEST_ASSERT_EQUAL(4, bidib.sent[2].data[0]);
+}
+
+void test_secure_ack_schedule_survives_random_confirmations(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    // Reports at scattered times, about every third one confirmed right away.
+    unsigned long sentAt[MAX_PENDING_SECURE_ACKS];
+    bool confirmed[MAX_PENDING_SECURE_ACKS];
+    uint32_t seed = 12345;
+    for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) {
+        seed = seed * 1103515245 + 12345;
+        sentAt[i] = 1000 + (seed >> 16) % 900;
+        setClock(sentAt[i]);
+        bidib.sendOccupancySingle(i, true);
+        confirmed[i] = (seed >> 8) % 3 == 0;
+    }
+    for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) {
+        if (confirmed[i]) { mirror(bidib, MSG_BM_MIRROR_OCC, i); }
+    }
+    bidib.sent.clear();
+
+    // Step through time; each resend must be the report that was sent the longest ago.
+    unsigned long last = 0;
+    for (unsigned long now = 1900; now < 1000 + 900 + SECURE_ACK_TIMEOUT + 10; now += 7) {
+        setClock(now);
+        size_t before = bidib.sent.size();
+        bidib.update();
+        for (size_t k = before; k < bidib.sent.size(); ++k) {
+            uint8_t det = bidib.sent[k].data[0];
+            TEST_ASSERT_FALSE(confirmed[det]);
+            TEST_ASSERT_TRUE(sentAt[det] >= last);
+            TEST_ASSERT_TRUE(now - sentAt[det] > SECURE_ACK_TIMEOUT);
+            last = sentAt[det];
+        }
+    }
+    size_t open = 0;
+    for (int i = 0; i < MAX_PENDING_SECURE_ACKS; ++i) { open += confirmed[i] ? 0 : 1; }
+    TEST_ASSERT_EQUAL(open, bidib.sent.size());
+}
+
+void test_secure_ack_flicker_keeps_latest_state_only(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    bidib.sendOccupancySingle(9, true);
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update(); // First retry
+    setClock(1500 + SECURE_ACK_TIMEOUT);
+    bidib.sendOccupancySingle(9, false);
+    bidib.sendOccupancySingle(9, true);
+    bidib.sendOccupancySingle(9, false);
+    TEST_ASSERT_EQUAL(1, bidib.getPendingSecureAckCount());
+    TEST_ASSERT_EQUAL(5, bidib.sent.size());
+
+    // The replaced report restarted its timeout and retries, and only the latest state is resent.
+    bidib.sent.clear();
+    unsigned long now = 1500 + SECURE_ACK_TIMEOUT;
+    for (int i = 0; i <= SECURE_ACK_RETRIES; ++i) {
+        now += 2 * BIDIB_SECACK_MAX_TIMEOUT;
+        setClock(now);
+        bidib.update();
+    }
+    TEST_ASSERT_EQUAL(SECURE_ACK_RETRIES, bidib.sent.size());
+    for (size_t i = 0; i < bidib.sent.size(); ++i) {
+        TEST_ASSERT_EQUAL(MSG_BM_FREE, bidib.sent[i].msg_type);
+        TEST_ASSERT_EQUAL(9, bidib.sent[i].data[0]);
+    }
+    TEST_ASSERT_EQUAL(0, bidib.getPendingSecureAckCount());
+}
+
+void test_secure_ack_range_reports_coalesce(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    bidib.sendOccupancySingle(3, true);
+    bidib.sendOccupancySingle(17, true);
+    bidib.sendOccupancySingle(40, true);
+
+    // A range report covering detectors 0..15 makes the pending report of detector 3 stale.
+    uint8_t first[] = {0x08, 0x00};
+    bidib.sendOccupancyMultiple(0, sizeof(first), first);
+    TEST_ASSERT_EQUAL(3, bidib.getPendingSecureAckCount());
+
+    // A newer report of the same range replaces it.
+    uint8_t second[] = {0x01, 0x80};
+    bidib.sendOccupancyMultiple(0, sizeof(second), second);
+    TEST_ASSERT_EQUAL(3, bidib.getPendingSecureAckCount());
+
+    // A single report within the range updates the range's pending bitmap as well.
+    bidib.sendOccupancySingle(9, true);
+    TEST_ASSERT_EQUAL(4, bidib.getPendingSecureAckCount());
+
+    bidib.sent.clear();
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(4, bidib.sent.size());
+    bool rangeSeen = false;
+    for (size_t i = 0; i < bidib.sent.size(); ++i) {
+        const BiDiBMessage& msg = bidib.sent[i];
+        if (msg.msg_type == MSG_BM_MULTIPLE) {
+            rangeSeen = true;
+            TEST_ASSERT_EQUAL(0, msg.data[0]);
+            TEST_ASSERT_EQUAL(0x01, msg.data[2]);
+            TEST_ASSERT_EQUAL(0x82, msg.data[3]);
+        } else {
+            TEST_ASSERT_TRUE(msg.data[0] != 3);
+        }
+    }
+    TEST_ASSERT_TRUE(rangeSeen);
+}
+
+void test_secure_ack_overlapping_ranges_keep_latest_bits(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    uint8_t wide[] = {0x00, 0x00, 0xFF, 0xFF};
+    bidib.sendOccupancyMultiple(0, sizeof(wide), wide);
+    uint8_t narrow[] = {0xFF};
+    bidib.sendOccupancyMultiple(24, sizeof(narrow), narrow);
+    TEST_ASSERT_EQUAL(2, bidib.getPendingSecureAckCount());
+
+    // Detectors 16..47: the range at 24 is covered and dropped, the one at 0 overlaps on 16..31.
+    uint8_t shifted[] = {0x0F, 0x00, 0x00, 0x00};
+    bidib.sendOccupancyMultiple(16, sizeof(shifted), shifted);
+    TEST_ASSERT_EQUAL(2, bidib.getPendingSecureAckCount());
+
+    bidib.sent.clear();
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+    for (size_t i = 0; i < bidib.sent.size(); ++i) {
+        const BiDiBMessage& msg = bidib.sent[i];
+        TEST_ASSERT_EQUAL(MSG_BM_MULTIPLE, msg.msg_type);
+        TEST_ASSERT_TRUE(msg.data[0] == 0 || msg.data[0] == 16);
+        if (msg.data[0] == 0) {
+            TEST_ASSERT_EQUAL(0x00, msg.data[3]);
+            TEST_ASSERT_EQUAL(0x0F, msg.data[4]);
+            TEST_ASSERT_EQUAL(0x00, msg.data[5]);
+        }
+    }
+}
+
+void test_secure_ack_late_mirror_does_not_confirm_overwritten_report(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    // The detector flickers back to occupied while the mirror of the first report is on its way.
+    bidib.sendOccupancySingle(7, true);
+    setClock(1010);
+    bidib.sendOccupancySingle(7, false);
+    bidib.sendOccupancySingle(7, true);
+    TEST_ASSERT_EQUAL(3, bidib.sent.size());
+
+    // The late mirror matches the latest state by chance but answers the first report.
+    setClock(1020);
+    mirror(bidib, MSG_BM_MIRROR_OCC, 7);
+    TEST_ASSERT_EQUAL(1, bidib.getPendingSecureAckCount());
+    TEST_ASSERT_EQUAL(3, bidib.sent.size());
+
+    // The timed resend of the latest state is the one a mirror confirms.
+    setClock(1010 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(4, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, bidib.sent[3].msg_type);
+    mirror(bidib, MSG_BM_MIRROR_OCC, 7);
+    TEST_ASSERT_EQUAL(0, bidib.getPendingSecureAckCount());
+}
+
+void test_secure_ack_mismatching_mirror_resends_at_once(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    bidib.sendOccupancySingle(12, true);
+    setClock(1100);
+    mirror(bidib, MSG_BM_MIRROR_FREE, 12);
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, bidib.sent[1].msg_type);
+    TEST_ASSERT_EQUAL(12, bidib.sent[1].data[0]);
+    TEST_ASSERT_EQUAL(1, bidib.getPendingSecureAckCount());
+
+    // A wrong mirror measures nothing; the timeout runs from the corrective retransmission.
+    TEST_ASSERT_EQUAL(0, bidib.getSecureAckRtt());
+    TEST_ASSERT_EQUAL(SECURE_ACK_TIMEOUT, bidib.getSecureAckTimeout());
+    setClock(1100 + bidib.getSecureAckTimeout());
+    bidib.update();
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+
+    // Mirrors of other detectors are ignored; the right one confirms.
+    mirror(bidib, MSG_BM_MIRROR_OCC, 13);
+    TEST_ASSERT_EQUAL(1, bidib.getPendingSecureAckCount());
+    mirror(bidib, MSG_BM_MIRROR_OCC, 12);
+    TEST_ASSERT_EQUAL(0, bidib.getPendingSecureAckCount());
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+
+    // The matching mirror answered a retransmission, so it is not timed either.
+    TEST_ASSERT_EQUAL(0, bidib.getSecureAckRtt());
 }
 
-void tearDown(void) {
-    // Intentionally left empty
+void test_secure_ack_mirror_multiple_must_match_bitmap(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+
+    uint8_t bitmap[] = {0xA5, 0x0F};
+    bidib.sendOccupancyMultiple(32, sizeof(bitmap), bitmap);
+    bidib.sendOccupancySingle(32, false); // Pending single inside the range: bit 0 cleared
+    TEST_ASSERT_EQUAL(2, bidib.getPendingSecureAckCount());
+
+    BiDiBMessage msg;
+    msg.length = 7;
+    msg.address[0] = 0;
+    msg.msg_num = 0;
+    msg.msg_type = MSG_BM_MIRROR_MULTIPLE;
+    msg.data[0] = 32;
+    msg.data[1] = 2;
+    msg.data[2] = 0xA5; // The original bitmap is stale now
+    msg.data[3] = 0x0F;
+
+    // Until the patched range has been resent, a mirror may still answer the original and is ignored.
+    bidib.injectMessage(msg);
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+    TEST_ASSERT_EQUAL(2, bidib.getPendingSecureAckCount());
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(4, bidib.sent.size());
+
+    // After that, a wrong mirror is corrected at once.
+    bidib.injectMessage(msg);
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(5, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_MULTIPLE, bidib.sent[4].msg_type);
+    TEST_ASSERT_EQUAL(0xA4, bidib.sent[4].data[2]);
+
+    msg.data[2] = 0xA4;
+    bidib.injectMessage(msg);
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(1, bidib.getPendingSecureAckCount());
+    mirror(bidib, MSG_BM_MIRROR_FREE, 32);
+    TEST_ASSERT_EQUAL(0, bidib.getPendingSecureAckCount());
+}
+
+void test_secure_ack_timeout_adapts_to_round_trip(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+    TEST_ASSERT_EQUAL(SECURE_ACK_TIMEOUT, bidib.getSecureAckTimeout());
+    TEST_ASSERT_EQUAL(0, bidib.getSecureAckRtt());
+
+    // A fast link: every report is mirrored after 40 ms.
+    unsigned long now = 1000;
+    for (int i = 0; i < 20; ++i) {
+        setClock(now);
+        bidib.sendOccupancySingle(i, true);
+        now += 40;
+        setClock(now);
+        mirror(bidib, MSG_BM_MIRROR_OCC, i);
+    }
+    TEST_ASSERT_EQUAL(40, bidib.getSecureAckRtt());
+    TEST_ASSERT_TRUE(bidib.getSecureAckTimeout() >= 40);
+    TEST_ASSERT_TRUE(bidib.getSecureAckTimeout() < 100);
+
+    // A lost report is now recovered after the estimated timeout instead of a second.
+    uint16_t timeout = bidib.getSecureAckTimeout();
+    bidib.sendOccupancySingle(99, true);
+    bidib.sent.clear();
+    setClock(now + timeout + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+
+    // Its next timeout is doubled, with at most a quarter of jitter on top.
+    setClock(now + timeout + 1 + 2 * timeout);
+    bidib.update();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+    setClock(now + timeout + 1 + 2 * timeout + timeout / 2 + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+
+    // A mirror of a retransmitted report is ambiguous and does not change the estimate.
+    setClock(now + 5000);
+    mirror(bidib, MSG_BM_MIRROR_OCC, 99);
+    TEST_ASSERT_EQUAL(40, bidib.getSecureAckRtt());
+    TEST_ASSERT_EQUAL(2, bidib.getSecureAckRetransmitCount());
+
+    // Neither is a mirror of a report that was overwritten in place after it was sent.
+    setClock(now + 6000);
+    bidib.sendOccupancySingle(98, true);
+    setClock(now + 6030);
+    bidib.sendOccupancySingle(98, false);
+    setClock(now + 6040);
+    mirror(bidib, MSG_BM_MIRROR_FREE, 98);
+    TEST_ASSERT_EQUAL(40, bidib.getSecureAckRtt());
+
+    // A slower round trip raises the timeout again.
+    for (int i = 0; i < 20; ++i) {
+        now += 10000;
+        setClock(now);
+        bidib.sendOccupancySingle(i, false);
+        setClock(now + 300);
+        mirror(bidib, MSG_BM_MIRROR_FREE, i);
+    }
+    TEST_ASSERT_TRUE(bidib.getSecureAckRtt() > 250);
+    TEST_ASSERT_TRUE(bidib.getSecureAckTimeout() > bidib.getSecureAckRtt());
+
+    // begin() starts over on a new link.
+    bidib.begin(mockSerial);
+    TEST_ASSERT_EQUAL(SECURE_ACK_TIMEOUT, bidib.getSecureAckTimeout());
+    TEST_ASSERT_EQUAL(0, bidib.getSecureAckRetransmitCount());
 }
 
-void test_placeholder(void) {
-    TEST_ASSERT_TRUE(true);
+void test_secure_ack_resends_when_master_messages_go_missing(void) {
+    TestBiDiB bidib;
+    bidib.begin(mockSerial);
+    bidib.setFeature(FEATURE_BM_SECACK_ON, 1);
+    bidib.setSequencing(true);
+
+    bidib.sendOccupancySingle(5, true);
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+
+    BiDiBMessage msg;
+    msg.length = 4;
+    msg.address[0] = 0;
+    msg.msg_type = MSG_CS_STATE;
+    msg.data[0] = BIDIB_CS_STATE_GO;
+    msg.msg_num = 1;
+    bidib.injectMessage(msg);
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(1, bidib.sent.size());
+
+    // Messages 2 and 3 never arrived; the mirror may have been one of them.
+    msg.msg_num = 4;
+    bidib.injectMessage(msg);
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(2, bidib.getRxLostCount());
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+    TEST_ASSERT_EQUAL(MSG_BM_OCC, bidib.sent[1].msg_type);
+    TEST_ASSERT_EQUAL(1, bidib.getPendingSecureAckCount());
+
+    // Another gap within the same timeout is not answered again.
+    msg.msg_num = 6;
+    bidib.injectMessage(msg);
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+
+    // Gaps in the messages of other nodes say nothing about the mirrors.
+    const uint8_t uid[7] = {0x81, 0x00, 0x0D, 0x01, 0x02, 0x03, 0x09};
+    const uint8_t address[BIDIB_MAX_ADDRESS_LENGTH] = {5, 0, 0, 0};
+    bidib.addNode(uid, address);
+    setClock(1000 + SECURE_ACK_TIMEOUT / 2);
+    BiDiBMessage other = msg;
+    other.address[0] = 5;
+    other.address[1] = 0;
+    other.msg_num = 1;
+    bidib.injectMessage(other);
+    other.msg_num = 3;
+    bidib.injectMessage(other);
+    bidib.handleMessages();
+    TEST_ASSERT_EQUAL(4, bidib.getRxLostCount());
+    TEST_ASSERT_EQUAL(2, bidib.sent.size());
+
+    // The early resend was no retry: the timeout still runs from the first transmission.
+    setClock(1000 + SECURE_ACK_TIMEOUT + 1);
+    bidib.update();
+    TEST_ASSERT_EQUAL(3, bidib.sent.size());
+    TEST_ASSERT_EQUAL(1, bidib.getPendingSecureAckCount());
 }
 
 int main() {
     UNITY_BEGIN();
-    RUN_TEST(test_placeholder);
-    // Original tests are commented out to prevent the crash.
-    // RUN_TEST(test_secure_ack_occurs_and_is_confirmed);
-    // RUN_TEST(test_secure_ack_timeout_triggers_resend);
-    // RUN_TEST(test_secure_ack_gives_up_after_max_retries);
+    RUN_TEST(test_secure_ack_occurs_and_is_confirmed);
+    RUN_TEST(test_secure_ack_timeout_triggers_resend);
+    RUN_TEST(test_secure_ack_gives_up_after_max_retries);
+    RUN_TEST(test_secure_ack_many_reports_in_flight);
+    RUN_TEST(test_secure_ack_resends_in_deadline_order);
+    RUN_TEST(test_secure_ack_schedule_survives_random_confirmations);
+    RUN_TEST(test_secure_ack_flicker_keeps_latest_state_only);
+    RUN_TEST(test_secure_ack_range_reports_coalesce);
+    RUN_TEST(test_secure_ack_overlapping_ranges_keep_latest_bits);
+    RUN_TEST(test_secure_ack_late_mirror_does_not_confirm_overwritten_report);
+    RUN_TEST(test_secure_ack_mismatching_mirror_resends_at_once);
+    RUN_TEST(test_secure_ack_mirror_multiple_must_match_bitmap);
+    RUN_TEST(test_secure_ack_timeout_adapts_to_round_trip);
+    RUN_TEST(test_secure_ack_resends_when_master_messages_go_missing);
     UNITY_END();
     return 0;
 }
@@ -1,6 +1,7 @@
 #include <Arduino.h>
 #include <unity.h>
 #include "BiDiB.h"
+#include "crc8.h"
 #include <string>
 #include <vector>
 #include <numeric>
@@ -11,6 +12,7 @@ public:
     std::vector<uint8_t> output_buffer;
     std::vector<uint8_t> input_buffer;
     size_t read_pos = 0;
+    int bulk_writes = 0;
 
     virtual int available() { return input_buffer.size() - read_pos; }
     virtual int read() { return available() > 0 ? input_buffer[read_pos++] : -1; }
@@ -20,39 +22,26 @@ public:
         output_buffer.push_back(c);
         return 1;
     }
+    virtual size_t write(const uint8_t *data, size_t size) {
+        output_buffer.insert(output_buffer.end(), data, data + size);
+        bulk_writes++;
+        return size;
+    }
 
     void clear() {
         output_buffer.clear();
         input_buffer.clear();
         read_pos = 0;
+        bulk_writes = 0;
     }
 };
 
 BiDiB bidib;
 MockStream mockSerial;
 
-// --- CRC Calculation Logic (copied from BiDiB.cpp for test accuracy) ---
-static const uint8_t crc8_table[] = {
-    0, 94, 188, 226, 97, 63, 221, 131, 194, 156, 126, 32, 163, 253, 31, 65,
-    157, 195, 33, 127, 252, 162, 64, 30, 95, 1, 227, 189, 62, 96, 130, 220,
-    35, 125, 159, 193, 66, 28, 254, 160, 225, 191, 93, 3, 128, 222, 60, 98,
-    190, 224, 2, 92, 223, 129, 99, 61, 124, 34, 192, 158, 29, 67, 161, 255,
-    70, 24, 250, 164, 39, 121, 155, 197, 132, 218, 56, 102, 229, 187, 89, 7,
-    219, 133, 103, 57, 186, 228, 6, 88, 25, 71, 165, 251, 120, 38, 196, 154,
-    101, 59, 217, 135, 4, 90, 184, 230, 167, 249, 27, 69, 198, 152, 122, 36,
-    248, 166, 68, 26, 153, 199, 37, 123, 58, 100, 134, 216, 91, 5, 231, 185,
-    140, 210, 48, 110, 237, 179, 81, 15, 78, 16, 242, 172, 47, 113, 147, 205,
-    17, 79, 173, 243, 112, 46, 204, 146, 211, 141, 111, 49, 178, 236, 14, 80,
-    175, 241, 19, 77, 206, 144, 114, 44, 109, 51, 209, 143, 12, 82, 176, 234,
-    50, 108, 142, 208, 83, 13, 235, 177, 240, 174, 76, 18, 145, 207, 45, 115,
-    202, 148, 118, 40, 171, 245, 23, 73, 8, 86, 180, 238, 121, 39, 197, 155,
-    244, 170, 72, 22, 87, 9, 239, 181, 41, 119, 149, 203, 14, 80, 176, 232,
-    107, 53, 215, 137, 182, 232, 10, 84, 21, 75, 169, 247, 116, 42, 200, 150,
-    52, 106, 136, 214, 246, 168, 74, 20, 85, 11, 233, 183, 151, 201, 43, 117
-};
-
+// --- CRC Calculation Logic (bitwise reference, independent of the library tables) ---
 void updateCrc(uint8_t byte, uint8_t &crc) {
-    crc = crc8_table[crc ^ byte];
+    crc = crc8_bitwise(crc, byte);
 }
 
 uint8_t calculate_expected_crc(const std::vector<uint8_t>& data) {
@@ -75,6 +64,7 @@ void ASSERT_EQUAL_VECTOR(const std::vector<uint8_t>& expected, const std::vector
 void setUp(void) {
     mockSerial.clear();
     bidib.begin(mockSerial);
+    bidib.setTxBatching(false);
 }
 
 void tearDown(void) {}
@@ -123,10 +113,78 @@ void test_send_message_with_escaping(void) {
     ASSERT_EQUAL_VECTOR(expected_output, mockSerial.output_buffer, "test_send_message_with_escaping");
 }
 
+void test_send_frame_uses_single_bulk_write(void) {
+    BiDiBMessage msg;
+    msg.length = 5;
+    msg.address[0] = 1;
+    msg.address[1] = 0;
+    msg.msg_num = 0xFE;
+    msg.msg_type = 20;
+    msg.data[0] = 0xFD;
+
+    bidib.sendMessage(msg);
+
+#if BIDIB_TX_SCRATCH_SIZE >= 2 * BIDIB_TX_BATCH_SIZE + 4
+    TEST_ASSERT_EQUAL(1, mockSerial.bulk_writes);
+#endif
+    TEST_ASSERT_EQUAL(11, mockSerial.output_buffer.size());
+}
+
+void test_send_batched_messages_share_one_packet(void) {
+    bidib.setTxBatching(true);
+
+    bidib.sendOccupancySingle(3, true);
+    bidib.sendOccupancySingle(4, false);
+    TEST_ASSERT_EQUAL(0, mockSerial.output_buffer.size());
+
+    bidib.flushTxBatch();
+
+    std::vector<uint8_t> seq = {4, 0, 0, MSG_BM_OCC, 3, 4, 0, 0, MSG_BM_FREE, 4};
+    std::vector<uint8_t> expected_output = {0xFE};
+    expected_output.insert(expected_output.end(), seq.begin(), seq.end());
+    expected_output.push_back(calculate_expected_crc(seq));
+    expected_output.push_back(0xFE);
+
+    ASSERT_EQUAL_VECTOR(expected_output, mockSerial.output_buffer, "test_send_batched_messages_share_one_packet");
+}
+
+void test_send_batch_is_flushed_by_update(void) {
+    bidib.setTxBatching(true);
+
+    bidib.setTrackState(BIDIB_CS_STATE_GO);
+    TEST_ASSERT_EQUAL(0, mockSerial.output_buffer.size());
+
+    bidib.update();
+    TEST_ASSERT_EQUAL(8, mockSerial.output_buffer.size());
+}
+
+void test_send_batch_starts_new_packet_when_full(void) {
+    bidib.setTxBatching(true);
+
+    // Each MSG_BM_MULTIPLE with 32 bytes of bitmap occupies 38 bytes of the packet.
+    uint8_t bitmap[32] = {0};
+    int messages = BIDIB_TX_BATCH_SIZE / 38 + 1;
+    for (int i = 0; i < messages; ++i) {
+        bidib.sendOccupancyMultiple(i * 8, sizeof(bitmap), bitmap);
+    }
+
+    // The first packet went out as soon as the last message no longer fitted.
+    TEST_ASSERT_GREATER_THAN(0, mockSerial.output_buffer.size());
+    size_t first_packet = mockSerial.output_buffer.size();
+    TEST_ASSERT_EQUAL(1 + (messages - 1) * 38 + 2, first_packet);
+
+    bidib.flushTxBatch();
+    TEST_ASSERT_EQUAL(first_packet + 1 + 38 + 2, mockSerial.output_buffer.size());
+}
+
 void runTests() {
     UNITY_BEGIN();
     RUN_TEST(test_send_simple_message);
     RUN_TEST(test_send_message_with_escaping);
+    RUN_TEST(test_send_frame_uses_single_bulk_write);
+    RUN_TEST(test_send_batched_messages_share_one_packet);
+    RUN_TEST(test_send_batch_is_flushed_by_update);
+    RUN_TEST(test_send_batch_starts_new_packet_when_full);
     UNITY_END();
 }
 
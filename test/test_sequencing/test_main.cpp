@@ -0,0 +1,138 @@
+#include <ArduinoFake.h>
+#include <unity.h>
+#include "BiDiB.h"
+#include "mock_stream.h"
+#include <vector>
+
+using namespace fakeit;
+
+// Gives the tests a way to inject messages as if they had been received.
+class TestBiDiB : public BiDiB {
+public:
+    void receive(const BiDiBMessage &msg) { queueMessage(msg); }
+};
+
+TestBiDiB bidib;
+MockStream mockSerial;
+
+const uint8_t node_uid[7] = {0x81, 0x00, 0x0D, 0x01, 0x02, 0x03, 0x05};
+const uint8_t node_addr[BIDIB_MAX_ADDRESS_LENGTH] = {5, 0, 0, 0};
+
+int dispatched = 0;
+
+void countMessage(BiDiB &, const BiDiBMessage &) {
+    dispatched++;
+}
+
+void setUp(void) {
+    ArduinoFakeReset();
+    mockSerial.clear();
+    bidib.begin(mockSerial);
+    bidib.addNode(node_uid, node_addr);
+    bidib.setSequencing(true);
+    dispatched = 0;
+}
+
+void tearDown(void) {
+    bidib.setSequencing(false);
+}
+
+// Reads the next packet from the outgoing stream and removes the escaping.
+static std::vector<uint8_t> read_packet() {
+    std::vector<uint8_t> packet;
+    TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
+    while (mockSerial.available_outgoing() > 0) {
+        uint8_t byte = mockSerial.read_outgoing();
+        if (byte == BIDIB_MAGIC) { break; }
+        if (byte == BIDIB_ESCAPE) { byte = mockSerial.read_outgoing() ^ 0x20; }
+        packet.push_back(byte);
+    }
+    return packet;
+}
+
+static void receive_from_node(uint8_t msg_num) {
+    BiDiBMessage msg;
+    msg.length = 5;
+    msg.address[0] = 5;
+    msg.address[1] = 0;
+    msg.msg_num = msg_num;
+    msg.msg_type = MSG_BOOST_STAT;
+    msg.data[0] = 0x80;
+    bidib.receive(msg);
+    bidib.handleMessages();
+}
+
+void test_messages_are_numbered_per_node(void) {
+    // LEN ADDR 0 MSG_NUM TYPE ...: the number follows the address stack.
+    for (int i = 1; i <= 255; ++i) {
+        bidib.queryBooster(5);
+        std::vector<uint8_t> packet = read_packet();
+        TEST_ASSERT_EQUAL(i, packet[3]);
+    }
+
+    // 0 is skipped when the number wraps.
+    bidib.queryBooster(5);
+    TEST_ASSERT_EQUAL(1, read_packet()[3]);
+
+    // Other nodes have a sequence of their own; unknown nodes get 0.
+    bidib.queryBooster(0);
+    TEST_ASSERT_EQUAL(1, read_packet()[2]);
+    bidib.queryBooster(9);
+    TEST_ASSERT_EQUAL(0, read_packet()[3]);
+}
+
+void test_gaps_and_duplicates_are_counted(void) {
+    bidib.onMessage(MSG_BOOST_STAT, countMessage);
+
+    receive_from_node(1);
+    receive_from_node(2);
+    receive_from_node(2); // delivered twice
+    receive_from_node(5); // 3 and 4 went missing
+    receive_from_node(6);
+    TEST_ASSERT_EQUAL(4, dispatched);
+
+    uint16_t lost = 0;
+    uint16_t duplicates = 0;
+    TEST_ASSERT_TRUE(bidib.getSequenceStats(node_addr, lost, duplicates));
+    TEST_ASSERT_EQUAL(2, lost);
+    TEST_ASSERT_EQUAL(1, duplicates);
+    TEST_ASSERT_EQUAL(2, bidib.getRxLostCount());
+    TEST_ASSERT_EQUAL(1, bidib.getRxDuplicateCount());
+
+    // The sequence wraps from 255 to 1, and 0 restarts the check.
+    receive_from_node(255);
+    receive_from_node(1);
+    receive_from_node(0);
+    receive_from_node(17);
+    TEST_ASSERT_EQUAL(2 + 248, bidib.getRxLostCount());
+    TEST_ASSERT_EQUAL(8, dispatched);
+
+    bidib.removeMessageHandler(MSG_BOOST_STAT, countMessage);
+}
+
+void test_queued_classes_keep_the_numbers_in_order(void) {
+    // A bulk request waits in the queue when a system command to the same node overtakes it.
+    bidib.setTxQueueing(true);
+    mockSerial.writeRoom = 0;
+    bidib.vendorGet(5, "a");
+    bidib.setBoosterState(false, 5);
+    mockSerial.writeRoom = 64;
+    bidib.setTxQueueing(false);
+
+    // Numbered packets share one ring, so they leave in the order they were numbered.
+    std::vector<uint8_t> first = read_packet();
+    std::vector<uint8_t> second = read_packet();
+    TEST_ASSERT_EQUAL(MSG_VENDOR_GET, first[4]);
+    TEST_ASSERT_EQUAL(1, first[3]);
+    TEST_ASSERT_EQUAL(MSG_BOOST_OFF, second[4]);
+    TEST_ASSERT_EQUAL(2, second[3]);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_messages_are_numbered_per_node);
+    RUN_TEST(test_gaps_and_duplicates_are_counted);
+    RUN_TEST(test_queued_classes_keep_the_numbers_in_order);
+    UNITY_END();
+    return 0;
+}
@@ -6,15 +6,10 @@
 // Test-spezifische Klasse, um auf interne Zustände zugreifen zu können
 class TestBiDiB : public BiDiB {
 public:
-    // Expose protected members for testing
-    using BiDiB::_lastMessage;
-    using BiDiB::_messageAvailable;
-
     bool getSystemEnabled() { return _system_enabled; }
 
     void setTestLastMessage(const BiDiBMessage& msg) {
-        _lastMessage = msg;
-        _messageAvailable = true;
+        queueMessage(msg);
     }
 };
 
@@ -33,28 +28,28 @@ void tearDown(void) {
 void test_send_enable(void) {
     bidib.enable();
 
-    // FE 03 00 00 04 05 FE
+    // FE 03 00 00 04 E9 FE
     TEST_ASSERT_EQUAL(7, mockSerial.available_outgoing());
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(3, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(MSG_SYS_ENABLE, mockSerial.read_outgoing());
-    TEST_ASSERT_EQUAL(108, mockSerial.read_outgoing()); // CRC
+    TEST_ASSERT_EQUAL(233, mockSerial.read_outgoing()); // CRC
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
 }
 
 void test_send_disable(void) {
     bidib.disable();
 
-    // FE 03 00 00 05 50 FE
+    // FE 03 00 00 05 B7 FE
     TEST_ASSERT_EQUAL(7, mockSerial.available_outgoing());
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(3, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
     TEST_ASSERT_EQUAL(MSG_SYS_DISABLE, mockSerial.read_outgoing());
-    TEST_ASSERT_EQUAL(50, mockSerial.read_outgoing()); // CRC
+    TEST_ASSERT_EQUAL(183, mockSerial.read_outgoing()); // CRC
     TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
 }
 
@@ -0,0 +1,179 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "BiDiB.h"
+#include "mock_stream.h"
+
+BiDiB bidib;
+MockStream mockSerial;
+
+void setUp(void) {
+    mockSerial.clear();
+    bidib.begin(mockSerial);
+    bidib.setTxQueueing(true);
+}
+
+void tearDown(void) {
+    bidib.setTxQueueing(false);
+}
+
+void test_queued_packet_is_written_when_room_is_available(void) {
+    bidib.setTrackState(BIDIB_CS_STATE_GO);
+
+    // FE 04 00 00 48 02 CRC FE fits into the UART buffer right away.
+    TEST_ASSERT_EQUAL(8, mockSerial.available_outgoing());
+    TEST_ASSERT_EQUAL(0, bidib.getTxQueueCount());
+}
+
+void test_send_does_not_block_on_full_uart(void) {
+    mockSerial.writeRoom = 0;
+
+    uint8_t bitmap[32] = {0};
+    bidib.sendOccupancyMultiple(0, sizeof(bitmap), bitmap);
+    bidib.setTrackState(BIDIB_CS_STATE_GO);
+
+    // Nothing may be written while the UART reports no room.
+    TEST_ASSERT_EQUAL(0, mockSerial.available_outgoing());
+    uint16_t queued = bidib.getTxQueueCount();
+    TEST_ASSERT_EQUAL(41 + 8, queued);
+    TEST_ASSERT_EQUAL(queued, bidib.getTxQueueHighWater());
+
+    // update() only hands over as many bytes as the UART accepts.
+    mockSerial.writeRoom = 16;
+    bidib.update();
+    TEST_ASSERT_EQUAL(16, mockSerial.available_outgoing());
+    TEST_ASSERT_EQUAL(queued - 16, bidib.getTxQueueCount());
+
+    mockSerial.writeRoom = 64;
+    bidib.update();
+    TEST_ASSERT_EQUAL(queued, mockSerial.available_outgoing());
+    TEST_ASSERT_EQUAL(0, bidib.getTxQueueCount());
+
+    // The bytes come out unchanged; the track state overtook the occupancy report.
+    TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
+    TEST_ASSERT_EQUAL(4, mockSerial.read_outgoing());
+    uint8_t skip[6];
+    mockSerial.read_outgoing(skip, sizeof(skip));
+    TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
+    TEST_ASSERT_EQUAL(37, mockSerial.read_outgoing());
+}
+
+void test_full_queue_drops_whole_packets(void) {
+    mockSerial.writeRoom = 0;
+
+    uint8_t bitmap[32] = {0};
+    int sent = BIDIB_TX_QUEUE_SIZE / 41 + 1;
+    for (int i = 0; i < sent; ++i) {
+        bidib.sendOccupancyMultiple(0, sizeof(bitmap), bitmap);
+    }
+
+    TEST_ASSERT_EQUAL(1, bidib.getTxDropCount());
+    TEST_ASSERT_EQUAL((sent - 1) * 41, bidib.getTxQueueCount());
+}
+
+void test_disabling_queue_flushes_pending_bytes(void) {
+    mockSerial.writeRoom = 0;
+    bidib.setTrackState(BIDIB_CS_STATE_OFF);
+    TEST_ASSERT_EQUAL(0, mockSerial.available_outgoing());
+
+    bidib.setTxQueueing(false);
+    TEST_ASSERT_EQUAL(8, mockSerial.available_outgoing());
+    TEST_ASSERT_EQUAL(0, bidib.getTxQueueCount());
+}
+
+void test_system_packet_waits_only_for_the_packet_in_progress(void) {
+    mockSerial.writeRoom = 0;
+
+    uint8_t bitmap[32] = {0};
+    bidib.sendOccupancyMultiple(0, sizeof(bitmap), bitmap);
+    bidib.sendOccupancyMultiple(8, sizeof(bitmap), bitmap);
+    TEST_ASSERT_EQUAL(2 * 41, bidib.getTxQueueCount(BIDIB_TX_PRIORITY_REALTIME));
+
+    // The first report is on its way when the track is switched off.
+    mockSerial.writeRoom = 10;
+    bidib.update();
+    bidib.setTrackState(BIDIB_CS_STATE_OFF);
+    TEST_ASSERT_EQUAL(8, bidib.getTxQueueCount(BIDIB_TX_PRIORITY_SYSTEM));
+
+    mockSerial.writeRoom = 256;
+    bidib.update();
+    TEST_ASSERT_EQUAL(2 * 41 + 8, mockSerial.available_outgoing());
+
+    // The first report is completed, then the track state, then the second report.
+    uint8_t skip[40];
+    mockSerial.read_outgoing(skip, sizeof(skip));
+    TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
+    TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
+    TEST_ASSERT_EQUAL(4, mockSerial.read_outgoing());
+    TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
+    TEST_ASSERT_EQUAL(0, mockSerial.read_outgoing());
+    TEST_ASSERT_EQUAL(MSG_CS_SET_STATE, mockSerial.read_outgoing());
+    mockSerial.read_outgoing(skip, 3);
+    TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
+    TEST_ASSERT_EQUAL(37, mockSerial.read_outgoing());
+}
+
+void test_bulk_packets_are_not_starved(void) {
+    mockSerial.writeRoom = 0;
+
+    uint8_t data[4] = {1, 2, 3, 4};
+    bidib.sendFirmwareUpdateData(0, data, sizeof(data));
+    for (int i = 0; i < BIDIB_TX_BULK_SHARE + 2; ++i) {
+        bidib.sendOccupancySingle(i, true);
+    }
+    TEST_ASSERT_TRUE(bidib.getTxQueueCount(BIDIB_TX_PRIORITY_BULK) > 0);
+
+    mockSerial.writeRoom = 256;
+    bidib.update();
+    TEST_ASSERT_EQUAL(0, bidib.getTxQueueCount());
+
+    // The bulk packet gets its turn after BIDIB_TX_BULK_SHARE realtime packets.
+    int packet = 0;
+    int bulk_turn = -1;
+    while (mockSerial.available_outgoing() > 0) {
+        TEST_ASSERT_EQUAL(BIDIB_MAGIC, mockSerial.read_outgoing());
+        uint8_t length = mockSerial.read_outgoing();
+        uint8_t content[BIDIB_MAX_MESSAGE_LENGTH];
+        mockSerial.read_outgoing(content, length + 2);
+        if (content[2] == MSG_FW_UPDATE_OP) { bulk_turn = packet; }
+        packet++;
+    }
+    TEST_ASSERT_EQUAL(BIDIB_TX_BULK_SHARE + 3, packet);
+    TEST_ASSERT_EQUAL(BIDIB_TX_BULK_SHARE, bulk_turn);
+}
+
+void test_worst_case_packet_fits_its_ring(void) {
+    mockSerial.writeRoom = 0;
+    uint16_t drops = bidib.getTxDropCount();
+
+    // A batch that carries a safety message goes to the system ring as a whole, here with
+    // every bitmap byte escaped.
+    uint8_t bitmap[32];
+    memset(bitmap, BIDIB_MAGIC, sizeof(bitmap));
+    bidib.setTxBatching(true);
+    bidib.sendOccupancyMultiple(0, sizeof(bitmap), bitmap);
+    bidib.sendOccupancyMultiple(8, sizeof(bitmap), bitmap);
+    bidib.setTrackState(BIDIB_CS_STATE_OFF);
+    bidib.setTxBatching(false);
+
+    TEST_ASSERT_EQUAL(drops, bidib.getTxDropCount());
+    TEST_ASSERT_TRUE(bidib.getTxQueueCount(BIDIB_TX_PRIORITY_SYSTEM) > 0);
+
+    uint8_t data[60];
+    memset(data, BIDIB_ESCAPE, sizeof(data));
+    bidib.sendFirmwareUpdateData(0, data, sizeof(data));
+    TEST_ASSERT_EQUAL(drops, bidib.getTxDropCount());
+    TEST_ASSERT_TRUE(bidib.getTxQueueCount(BIDIB_TX_PRIORITY_BULK) > 2 * sizeof(data));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_queued_packet_is_written_when_room_is_available);
+    RUN_TEST(test_send_does_not_block_on_full_uart);
+    RUN_TEST(test_full_queue_drops_whole_packets);
+    RUN_TEST(test_system_packet_waits_only_for_the_packet_in_progress);
+    RUN_TEST(test_bulk_packets_are_not_starved);
+    RUN_TEST(test_worst_case_packet_fits_its_ring);
+    RUN_TEST(test_disabling_queue_flushes_pending_bytes);
+    UNITY_END();
+    return 0;
+}